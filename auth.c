@@ -0,0 +1,375 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <crypt.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <config.h>
+#include <auth.h>
+
+/* Names end up in paths, keep them boring */
+static int auth_valid_user(const char *user)
+{
+    if (*user == '\0' || *user == '.') {
+        return 0;
+    }
+    for (; *user; user++) {
+        if (!((*user >= 'a' && *user <= 'z') || (*user >= 'A' && *user <= 'Z')
+                    || (*user >= '0' && *user <= '9')
+                    || *user == '.' || *user == '_' || *user == '-' || *user == '@')) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int auth_check(const char *user, const char *pass)
+{
+    struct crypt_data *cd;
+    char line[512], *hash, *out;
+    size_t ulen = strlen(user);
+    int ret = -1;
+    FILE *f;
+
+    if (!auth_valid_user(user) || (f = fopen(PASSWD_FILE, "r")) == NULL) {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, user, ulen) != 0 || line[ulen] != ':') {
+            continue;
+        }
+        hash = line + ulen + 1;
+        hash[strcspn(hash, ":\r\n")] = '\0';
+
+        /* crypt_r keeps its state in here, too big for a worker stack */
+        if ((cd = calloc(1, sizeof(struct crypt_data))) == NULL) {
+            break;
+        }
+        out = crypt_r(pass, hash, cd);
+        if (out != NULL && *out != '*' && strlen(out) == strlen(hash)
+                && CRYPTO_memcmp(out, hash, strlen(hash)) == 0) {
+            ret = 0;
+        }
+        OPENSSL_cleanse(cd, sizeof(struct crypt_data));
+        free(cd);
+        break;
+    }
+
+    OPENSSL_cleanse(line, sizeof(line));
+    fclose(f);
+    return ret;
+}
+
+int auth_plain(const char *b64, size_t len, char *user, char *pass)
+{
+    unsigned char raw[AUTH_USER_MAX * 2 + AUTH_PASS_MAX + 8];
+    size_t n, u, p;
+    int ret = -1;
+
+    if (len == 0 || len % 4 != 0 || len / 4 * 3 > sizeof(raw)) {
+        return -1;
+    }
+    if ((int) (n = EVP_DecodeBlock(raw, (const unsigned char *) b64, len)) < 0) {
+        return -1;
+    }
+    /* DecodeBlock counts the padding as data */
+    for (size_t i = len; i > 0 && b64[i-1] == '='; i--) {
+        n--;
+    }
+
+    /* authzid NUL authcid NUL passwd, authzid is ignored */
+    for (u = 0; u < n && raw[u] != '\0'; u++);
+    for (p = ++u; p < n && raw[p] != '\0'; p++);
+    if (p >= n || p - u >= AUTH_USER_MAX || n - p - 1 >= AUTH_PASS_MAX) {
+        goto out;
+    }
+
+    memcpy(user, raw + u, p - u);
+    user[p - u] = '\0';
+    memcpy(pass, raw + p + 1, n - p - 1);
+    pass[n - p - 1] = '\0';
+    ret = strlen(user) == p - u && strlen(pass) == n - p - 1 ? 0 : -1;
+
+out:
+    OPENSSL_cleanse(raw, sizeof(raw));
+    return ret;
+}
+
+int auth_copy(char *dst, size_t max, const char *s, size_t len)
+{
+    if (len >= max || memchr(s, '\0', len) != NULL) {
+        return -1;
+    }
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+
+    return 0;
+}
+
+/* Recently verified credentials, only the keyed hash is kept */
+typedef struct {
+    unsigned char mac[32];
+    time_t expires;
+} auth_entry;
+
+static pthread_mutex_t auth_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t auth_cond = PTHREAD_COND_INITIALIZER;
+static auth_req *auth_head, *auth_tail;
+static size_t auth_queued;
+static int auth_stopping;
+static pthread_t auth_threads[AUTH_THREADS];
+static size_t auth_nthreads;
+
+static pthread_mutex_t auth_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static auth_entry auth_cache[AUTH_CACHE > 0 ? AUTH_CACHE : 1];
+/* Random for every run, entries are useless outside of it */
+static unsigned char auth_key[32];
+/* PASSWD_FILE as it was when the entries were verified */
+static struct timespec auth_mtime;
+
+/* HMAC-SHA256 of user NUL pass */
+static int auth_mac(const char *user, const char *pass, unsigned char *mac)
+{
+    unsigned char data[AUTH_USER_MAX + AUTH_PASS_MAX];
+    size_t ulen = strlen(user), plen = strlen(pass), len;
+    int ret = -1;
+
+    if (ulen >= AUTH_USER_MAX || plen >= AUTH_PASS_MAX) {
+        return -1;
+    }
+    memcpy(data, user, ulen + 1);
+    memcpy(data + ulen + 1, pass, plen);
+
+    if (EVP_Q_mac(NULL, "HMAC", NULL, "SHA256", NULL, auth_key, sizeof(auth_key),
+                data, ulen + 1 + plen, mac, 32, &len) != NULL && len == 32) {
+        ret = 0;
+    }
+    OPENSSL_cleanse(data, sizeof(data));
+
+    return ret;
+}
+
+/*-
+ * Drop everything if PASSWD_FILE changed since the entries were
+ * added, a new password must not be shadowed by the old one.
+ * Called with auth_cache_lock held, -1 if the file is gone.
+ */
+static int auth_cache_check(void)
+{
+    struct stat st;
+
+    if (stat(PASSWD_FILE, &st) < 0) {
+        memset(auth_cache, 0, sizeof(auth_cache));
+        return -1;
+    }
+    if (st.st_mtim.tv_sec != auth_mtime.tv_sec || st.st_mtim.tv_nsec != auth_mtime.tv_nsec) {
+        memset(auth_cache, 0, sizeof(auth_cache));
+        auth_mtime = st.st_mtim;
+    }
+
+    return 0;
+}
+
+static auth_entry *auth_cache_slot(const unsigned char *mac)
+{
+    uint64_t h;
+
+    memcpy(&h, mac, sizeof(h));
+    return &auth_cache[h % (AUTH_CACHE > 0 ? AUTH_CACHE : 1)];
+}
+
+int auth_cached(const char *user, const char *pass)
+{
+    unsigned char mac[32];
+    auth_entry *e;
+    int ret = -1;
+
+    if (AUTH_CACHE == 0 || auth_mac(user, pass, mac) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&auth_cache_lock);
+    if (auth_cache_check() == 0) {
+        e = auth_cache_slot(mac);
+        if (e->expires > time(NULL) && CRYPTO_memcmp(e->mac, mac, sizeof(mac)) == 0) {
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&auth_cache_lock);
+
+    return ret;
+}
+
+static void auth_cache_add(const char *user, const char *pass, const struct timespec *mtime)
+{
+    unsigned char mac[32];
+    auth_entry *e;
+
+    if (AUTH_CACHE == 0 || auth_mac(user, pass, mac) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&auth_cache_lock);
+    /* Checked against a file that has been replaced since */
+    if (auth_cache_check() == 0 && mtime->tv_sec == auth_mtime.tv_sec && mtime->tv_nsec == auth_mtime.tv_nsec) {
+        e = auth_cache_slot(mac);
+        memcpy(e->mac, mac, sizeof(mac));
+        e->expires = time(NULL) + AUTH_CACHE_TTL;
+    }
+    pthread_mutex_unlock(&auth_cache_lock);
+}
+
+static void *auth_thread(void *arg)
+{
+    struct timespec mtime = { 0, 0 };
+    struct stat st;
+    auth_req *req;
+
+    for (;;) {
+        pthread_mutex_lock(&auth_lock);
+        while (auth_head == NULL && !auth_stopping) {
+            pthread_cond_wait(&auth_cond, &auth_lock);
+        }
+        if (auth_stopping) {
+            pthread_mutex_unlock(&auth_lock);
+            return NULL;
+        }
+        req = auth_head;
+        if ((auth_head = req->next) == NULL) {
+            auth_tail = NULL;
+        }
+        auth_queued--;
+        pthread_mutex_unlock(&auth_lock);
+
+        if (stat(PASSWD_FILE, &st) == 0) {
+            mtime = st.st_mtim;
+        }
+        if ((req->result = auth_check(req->user, req->pass)) == 0) {
+            auth_cache_add(req->user, req->pass, &mtime);
+        }
+        OPENSSL_cleanse(req->pass, sizeof(req->pass));
+
+        /* A pointer is well below PIPE_BUF, the write is atomic */
+        while (write(req->notify, &req, sizeof(req)) < 0 && errno == EINTR);
+    }
+}
+
+int auth_start(void)
+{
+    if (RAND_bytes(auth_key, sizeof(auth_key)) != 1) {
+        return -1;
+    }
+
+    for (auth_nthreads = 0; auth_nthreads < AUTH_THREADS; auth_nthreads++) {
+        if (pthread_create(&auth_threads[auth_nthreads], NULL, auth_thread, NULL) != 0) {
+            break;
+        }
+    }
+
+    return auth_nthreads > 0 ? 0 : -1;
+}
+
+void auth_stop(void)
+{
+    auth_req *req;
+
+    pthread_mutex_lock(&auth_lock);
+    auth_stopping = 1;
+    pthread_cond_broadcast(&auth_cond);
+    pthread_mutex_unlock(&auth_lock);
+
+    for (size_t i=0; i < auth_nthreads; i++) {
+        pthread_join(auth_threads[i], NULL);
+    }
+    auth_nthreads = 0;
+
+    while ((req = auth_head) != NULL) {
+        auth_head = req->next;
+        auth_req_free(req);
+    }
+    auth_tail = NULL;
+    auth_queued = 0;
+
+    OPENSSL_cleanse(auth_key, sizeof(auth_key));
+    memset(auth_cache, 0, sizeof(auth_cache));
+}
+
+auth_req *auth_req_new(const char *user, const char *pass, int notify)
+{
+    auth_req *req;
+
+    if (strlen(user) >= AUTH_USER_MAX || strlen(pass) >= AUTH_PASS_MAX
+            || (req = calloc(1, sizeof(auth_req))) == NULL) {
+        return NULL;
+    }
+    strcpy(req->user, user);
+    strcpy(req->pass, pass);
+    req->result = -1;
+    req->notify = notify;
+
+    return req;
+}
+
+void auth_req_free(auth_req *req)
+{
+    OPENSSL_cleanse(req, sizeof(auth_req));
+    free(req);
+}
+
+int auth_submit(auth_req *req)
+{
+    pthread_mutex_lock(&auth_lock);
+    if (auth_nthreads == 0 || auth_stopping || auth_queued >= AUTH_QUEUE) {
+        pthread_mutex_unlock(&auth_lock);
+        return -1;
+    }
+
+    req->next = NULL;
+    if (auth_tail != NULL) {
+        auth_tail->next = req;
+    } else {
+        auth_head = req;
+    }
+    auth_tail = req;
+    auth_queued++;
+    pthread_cond_signal(&auth_cond);
+    pthread_mutex_unlock(&auth_lock);
+
+    return 0;
+}
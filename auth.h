@@ -0,0 +1,81 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longest user name and password accepted */
+#define AUTH_USER_MAX 64
+#define AUTH_PASS_MAX 256
+
+/* Check pass against the PASSWD_FILE entry of user, 0 if it matches */
+int auth_check(const char *user, const char *pass);
+/*-
+ * Decode a base64 SASL PLAIN response into user and pass, both at
+ * least AUTH_USER_MAX and AUTH_PASS_MAX long. Returns 0 on success.
+ */
+int auth_plain(const char *b64, size_t len, char *user, char *pass);
+/* Copy an astring argument into dst (max bytes), -1 if too long */
+int auth_copy(char *dst, size_t max, const char *s, size_t len);
+
+/*-
+ * Password hashes are slow on purpose, so checks run on a pool of
+ * AUTH_THREADS threads instead of the event loops. A request is
+ * handed to auth_submit and, once checked, its address is written
+ * to the notify descriptor for the submitter to pick it up (and to
+ * free it with auth_req_free). Credentials that passed are cached
+ * AUTH_CACHE_TTL seconds under a keyed hash, see auth_cached.
+ */
+typedef struct auth_req {
+    char user[AUTH_USER_MAX];
+    char pass[AUTH_PASS_MAX];
+    /* 0 if the credentials are good, set by the pool */
+    int result;
+    int notify;
+    /* Owned by the submitter */
+    void *data;
+    uint32_t serial;
+    struct auth_req *next;
+} auth_req;
+
+/* Start the pool, -1 on failure */
+int auth_start(void);
+/* Stop the pool, requests not checked yet are freed */
+void auth_stop(void);
+/* New request for user and pass, NULL if either is too long */
+auth_req *auth_req_new(const char *user, const char *pass, int notify);
+/* Wipe and free a request */
+void auth_req_free(auth_req *req);
+/* Queue req, -1 if AUTH_QUEUE requests are already waiting */
+int auth_submit(auth_req *req);
+/* 0 if user and pass were checked recently and PASSWD_FILE is unchanged */
+int auth_cached(const char *user, const char *pass);
+
+#endif /* ifndef AUTH_H */
@@ -0,0 +1,85 @@
+#!/bin/sh
+# See LICENSE file for copyright and license details.
+#
+# Benchmark sis on localhost: build it with a config.h pointing at a
+# throwaway certificate, passwd file and Maildir, start it and drive
+# it with bench/load, once per scenario. Results go to stdout, so
+# runs on two commits can be diffed. Tunables, from the environment:
+#
+#   BENCH_CONNS     connections per scenario (1000)
+#   BENCH_THREADS   load threads (2)
+#   BENCH_TIME      seconds measured per scenario (10)
+#   BENCH_WARMUP    seconds of warmup, not measured (2)
+#   BENCH_MESSAGES  messages in the INBOX (1000)
+#   BENCH_PORT      port sis listens on (10143)
+#   BENCH_FLAGS     more options for bench/load, e.g. -H for histograms
+
+set -e
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+conns=${BENCH_CONNS:-1000}
+threads=${BENCH_THREADS:-2}
+secs=${BENCH_TIME:-10}
+warmup=${BENCH_WARMUP:-2}
+messages=${BENCH_MESSAGES:-1000}
+port=${BENCH_PORT:-10143}
+mix=NOOP=2,FETCH=4,SELECT=1,IDLE=1,LOGIN=1
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/sis-bench.XXXXXX")
+pid=
+cleanup() {
+    [ -n "$pid" ] && kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+    [ -n "$BENCH_KEEP" ] || rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+# The sources with the local config.h, if any, and the fixture paths
+mkdir "$work/src"
+cp "$top"/*.c "$top"/*.h "$top"/imap.routines "$top"/imap.commands "$top"/mkcmds.awk \
+    "$top"/Makefile "$top"/config.mk "$work/src"
+[ -f "$top/config.h" ] || cp "$top/config.def.h" "$work/src/config.h"
+sed -i -e "s/^#define IMAP_PORT .*/#define IMAP_PORT       $port/" \
+    -e 's/^#define TLS_ENABLED .*/#define TLS_ENABLED     0/' \
+    -e 's/^#define PLAINTEXT_AUTH .*/#define PLAINTEXT_AUTH  1/' \
+    -e 's|^#define MAIL_ROOT .*|#define MAIL_ROOT "mail/%s/Maildir"|' \
+    -e 's|^#define PASSWD_FILE .*|#define PASSWD_FILE "passwd"|' \
+    -e 's|^#define ADMIN_SOCKET .*|#define ADMIN_SOCKET    "admin.sock"|' "$work/src/config.h"
+make -C "$work/src" sis >"$work/build.log" 2>&1 || { cat "$work/build.log"; exit 1; }
+
+# Certificate, account and mailbox
+cd "$work"
+openssl req -x509 -newkey rsa:2048 -nodes -keyout ca-key.pem -out ca-cert.pem \
+    -days 1 -subj /CN=localhost >/dev/null 2>&1
+printf 'bench:%s\n' "$(openssl passwd -6 bench)" > passwd
+mkdir -p mail/bench/Maildir/cur mail/bench/Maildir/new mail/bench/Maildir/tmp
+awk -v n="$messages" 'BEGIN {
+    srand(1)
+    for (i = 1; i <= n; i++) {
+        f = sprintf("mail/bench/Maildir/cur/%d.M%dP1.bench:2,%s", 1700000000 + i, i, i % 3 ? "S" : "")
+        printf "From: Sender %d <sender%d@example.org>\r\n", i % 50, i % 50 > f
+        printf "To: bench@example.org\r\nSubject: Message %d\r\n", i > f
+        printf "Date: Tue, 14 Nov 2023 22:13:20 +0000\r\nMessage-ID: <%d@example.org>\r\n\r\n", i > f
+        for (j = int(rand() * 200) + 10; j > 0; j--) {
+            printf "line %d of a message body, more or less the length of real text\r\n", j > f
+        }
+        close(f)
+    }
+}'
+
+./src/sis >/dev/null 2>sis.log &
+pid=$!
+sleep 1
+
+run() {
+    name=$1
+    shift
+    echo "== $name"
+    "$top/bench/load" -p "$port" -P "$pid" -c "$conns" -j "$threads" -d "$secs" -w "$warmup" \
+        $BENCH_FLAGS "$@"
+    echo
+}
+
+# Commands before authentication, then full sessions in plaintext and over TLS
+run plain -m CAPABILITY=1,NOOP=1
+run mail -m "$mix"
+run tls -s -m "$mix"
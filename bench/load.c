@@ -0,0 +1,901 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*-
+ * load - drive an IMAP server with many concurrent sessions
+ *
+ * Every connection runs one command at a time, picked at random from
+ * a weighted mix, and times it from the moment it is written to its
+ * tagged response. Connections are spread over threads, each with its
+ * own epoll loop and histograms, merged once the run is over. Nothing
+ * is recorded during the warmup. See bench/bench.sh for the fixture
+ * it is meant to run against.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+/* Commands of the mix, then what is timed on the side */
+#define OP_CAPABILITY 0
+#define OP_NOOP 1
+#define OP_LOGIN 2
+#define OP_SELECT 3
+#define OP_FETCH 4
+#define OP_IDLE 5
+#define OP_MIX 6
+/* connect(2), TLS handshake included. A greeting is not waited for */
+#define OP_CONNECT 6
+/* STARTTLS to the end of the handshake */
+#define OP_STARTTLS 7
+#define OP_REPORT 8
+/* Ends a session for the next LOGIN, not timed */
+#define OP_LOGOUT 8
+
+static const char *op_names[OP_REPORT] = {
+    "CAPABILITY", "NOOP", "LOGIN", "SELECT", "FETCH", "IDLE", "connect", "STARTTLS"
+};
+
+/* Where a connection is */
+#define ST_CONNECT 0
+#define ST_HANDSHAKE 1
+/* Waiting for the tagged response */
+#define ST_CMD 2
+/* IDLE sent, DONE goes once it is accepted */
+#define ST_IDLING 3
+/* Out of the run, after an error */
+#define ST_DEAD 4
+
+/*-
+ * Latencies in ns, in log-linear buckets: 2^HIST_SUB of them per
+ * power of two, about 3% wide.
+ */
+#define HIST_SUB 5
+#define HIST_BUCKETS (64 << HIST_SUB)
+
+typedef struct {
+    uint64_t n, sum, max;
+    uint64_t b[HIST_BUCKETS];
+} hist;
+
+/* Room for a response line, literals are skipped as they stream by */
+#define LOAD_IN 8192
+#define LOAD_OUT 512
+#define LOAD_EVENTS 256
+
+typedef struct {
+    int fd;
+    SSL *ssl;
+    SSL_SESSION *session;
+    uint8_t st, op, authed, selected, wout;
+    uint32_t exists;
+    unsigned tag;
+    /* When the command (or connect) started */
+    uint64_t t0;
+    /* Literal bytes still to skip */
+    size_t skip;
+    size_t in_len;
+    char in[LOAD_IN];
+    size_t out_off, out_len;
+    char out[LOAD_OUT];
+} conn;
+
+typedef struct {
+    pthread_t thread;
+    int ep;
+    conn *conns;
+    size_t nconns;
+    unsigned seed;
+    hist h[OP_REPORT];
+    uint64_t errors[OP_REPORT];
+    uint64_t failed;
+} loader;
+
+static struct {
+    struct sockaddr_in addr;
+    size_t conns, threads;
+    unsigned duration, warmup;
+    unsigned weights[OP_MIX], total;
+    uint8_t tls, starttls, need_auth, need_select, hists;
+    const char *user, *pass, *fetch, *mix;
+    pid_t server;
+} opt;
+
+static SSL_CTX *load_ctx;
+/* Recording starts at warm, everything stops at end */
+static uint64_t load_warm, load_end;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+static size_t hist_index(uint64_t v)
+{
+    int e;
+
+    if (v < (1 << HIST_SUB)) {
+        return v;
+    }
+    e = 63 - __builtin_clzll(v);
+    return ((size_t) (e - HIST_SUB + 1) << HIST_SUB) + ((v >> (e - HIST_SUB)) & ((1 << HIST_SUB) - 1));
+}
+
+/* Lowest value of bucket i */
+static uint64_t hist_value(size_t i)
+{
+    int e;
+
+    if (i < (1 << HIST_SUB)) {
+        return i;
+    }
+    e = (i >> HIST_SUB) + HIST_SUB - 1;
+    return (uint64_t) ((1 << HIST_SUB) + (i & ((1 << HIST_SUB) - 1))) << (e - HIST_SUB);
+}
+
+static void hist_add(hist *h, uint64_t v)
+{
+    h->b[hist_index(v)]++;
+    h->n++;
+    h->sum += v;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static void hist_merge(hist *dst, const hist *src)
+{
+    for (size_t i=0; i < HIST_BUCKETS; i++) {
+        dst->b[i] += src->b[i];
+    }
+    dst->n += src->n;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/* Value under which a fraction q of the samples are, middle of its bucket */
+static uint64_t hist_quantile(const hist *h, double q)
+{
+    uint64_t seen = 0, want = (uint64_t) (q * h->n), v;
+
+    for (size_t i=0; i < HIST_BUCKETS; i++) {
+        if ((seen += h->b[i]) > want) {
+            v = (hist_value(i) + hist_value(i + 1)) / 2;
+            return v < h->max ? v : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+static void conn_want(loader *l, conn *c, uint8_t wout)
+{
+    struct epoll_event ev;
+
+    if (c->wout == wout) {
+        return;
+    }
+    c->wout = wout;
+    ev.events = EPOLLIN | (wout ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(l->ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void conn_close(loader *l, conn *c)
+{
+    if (c->ssl != NULL) {
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+/* Timed samples only once warm, errors are counted all along */
+static void conn_record(loader *l, conn *c, uint8_t op, int ok)
+{
+    uint64_t t = now_ns();
+
+    if (!ok) {
+        l->errors[op]++;
+    }
+    if (t >= load_warm && t < load_end) {
+        hist_add(&l->h[op], t - c->t0);
+    }
+}
+
+static void conn_open(loader *l, conn *c)
+{
+    struct epoll_event ev;
+    int on = 1;
+
+    c->st = ST_CONNECT;
+    c->authed = c->selected = 0;
+    c->in_len = c->skip = 0;
+    c->out_off = c->out_len = 0;
+    c->t0 = now_ns();
+
+    if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        die("socket: %s", strerror(errno));
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(c->fd, (struct sockaddr *) &opt.addr, sizeof(opt.addr)) < 0 && errno != EINPROGRESS) {
+        die("connect: %s", strerror(errno));
+    }
+
+    c->wout = 1;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(l->ep, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        die("epoll_ctl: %s", strerror(errno));
+    }
+}
+
+/* Lost the connection or the server said no where it shouldn't have */
+static void conn_fail(loader *l, conn *c)
+{
+    l->failed++;
+    conn_close(l, c);
+    if (c->st != ST_DEAD && now_ns() < load_end) {
+        conn_open(l, c);
+    }
+}
+
+static int conn_flush(loader *l, conn *c)
+{
+    ssize_t n;
+
+    while (c->out_off < c->out_len) {
+        if (c->ssl != NULL) {
+            if ((n = SSL_write(c->ssl, c->out + c->out_off, c->out_len - c->out_off)) <= 0) {
+                switch (SSL_get_error(c->ssl, n)) {
+                    case SSL_ERROR_WANT_WRITE:
+                    case SSL_ERROR_WANT_READ:
+                        conn_want(l, c, 1);
+                        return 0;
+                }
+                return -1;
+            }
+        } else if ((n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off)) < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                conn_want(l, c, 1);
+                return 0;
+            }
+            return -1;
+        }
+        c->out_off += n;
+    }
+    conn_want(l, c, 0);
+
+    return 0;
+}
+
+/* Queue a line, tagged unless tagged is 0, and start timing it */
+static int conn_send(loader *l, conn *c, uint8_t op, int tagged, const char *fmt, ...)
+{
+    va_list ap;
+    int n = 0;
+
+    if (tagged) {
+        n = snprintf(c->out, LOAD_OUT, "a%u ", ++c->tag);
+    }
+    va_start(ap, fmt);
+    n += vsnprintf(c->out + n, LOAD_OUT - n - 2, fmt, ap);
+    va_end(ap);
+    memcpy(c->out + n, "\r\n", 2);
+    c->out_off = 0;
+    c->out_len = n + 2;
+    if (tagged) {
+        c->op = op;
+        c->st = op == OP_IDLE ? ST_IDLING : ST_CMD;
+        c->t0 = now_ns();
+    }
+
+    return conn_flush(l, c);
+}
+
+static uint8_t conn_pick(loader *l)
+{
+    unsigned r = rand_r(&l->seed) % opt.total;
+    uint8_t op;
+
+    for (op=0; r >= opt.weights[op]; op++) {
+        r -= opt.weights[op];
+    }
+
+    return op;
+}
+
+/* Whatever the session needs first, then a command of the mix */
+static int conn_next(loader *l, conn *c)
+{
+    uint8_t op;
+
+    if (now_ns() >= load_end) {
+        return 0;
+    }
+    if (opt.starttls && c->ssl == NULL) {
+        return conn_send(l, c, OP_STARTTLS, 1, "STARTTLS");
+    }
+    if (opt.need_auth && !c->authed) {
+        return conn_send(l, c, OP_LOGIN, 1, "LOGIN %s %s", opt.user, opt.pass);
+    }
+    if (opt.need_select && !c->selected) {
+        return conn_send(l, c, OP_SELECT, 1, "SELECT INBOX");
+    }
+
+    switch ((op = conn_pick(l))) {
+        case OP_CAPABILITY:
+            return conn_send(l, c, op, 1, "CAPABILITY");
+        case OP_NOOP:
+            return conn_send(l, c, op, 1, "NOOP");
+        case OP_LOGIN:
+            /* A new session each time, LOGIN is timed once connected again */
+            return conn_send(l, c, OP_LOGOUT, 1, "LOGOUT");
+        case OP_SELECT:
+            return conn_send(l, c, op, 1, "SELECT INBOX");
+        case OP_FETCH:
+            return conn_send(l, c, op, 1, "FETCH %u %s",
+                    c->exists > 0 ? rand_r(&l->seed) % c->exists + 1 : 1, opt.fetch);
+        default:
+            return conn_send(l, c, op, 1, "IDLE");
+    }
+}
+
+static int conn_handshake(loader *l, conn *c)
+{
+    int n;
+
+    if ((n = SSL_do_handshake(c->ssl)) == 1) {
+        conn_record(l, c, opt.starttls ? OP_STARTTLS : OP_CONNECT, 1);
+        return conn_next(l, c);
+    }
+
+    switch (SSL_get_error(c->ssl, n)) {
+        case SSL_ERROR_WANT_READ:
+            conn_want(l, c, 0);
+            return 0;
+        case SSL_ERROR_WANT_WRITE:
+            conn_want(l, c, 1);
+            return 0;
+    }
+
+    return -1;
+}
+
+static int conn_tls(loader *l, conn *c)
+{
+    if ((c->ssl = SSL_new(load_ctx)) == NULL) {
+        return -1;
+    }
+    SSL_set_fd(c->ssl, c->fd);
+    SSL_set_connect_state(c->ssl);
+    /* Sessions are resumed as a mail client would */
+    if (c->session != NULL) {
+        SSL_set_session(c->ssl, c->session);
+    }
+    c->st = ST_HANDSHAKE;
+
+    return conn_handshake(l, c);
+}
+
+/* A tagged response to the command in flight, res is what follows the tag */
+static int conn_done(loader *l, conn *c, const char *res, size_t len)
+{
+    int ok = len >= 2 && memcmp(res, "OK", 2) == 0;
+
+    switch (c->op) {
+        case OP_STARTTLS:
+            if (!ok) {
+                return -1;
+            }
+            return conn_tls(l, c);
+        case OP_LOGOUT:
+            if (c->ssl != NULL) {
+                SSL_SESSION_free(c->session);
+                c->session = SSL_get1_session(c->ssl);
+            }
+            conn_close(l, c);
+            conn_open(l, c);
+            return 0;
+        case OP_LOGIN:
+            conn_record(l, c, c->op, ok);
+            /* Wrong credentials stop the connection, a busy server is tried again */
+            if (!ok && len > 24 && memcmp(res, "NO [AUTHENTICATIONFAILED]", 25) == 0) {
+                c->st = ST_DEAD;
+                return -1;
+            }
+            c->authed = ok;
+            break;
+        case OP_SELECT:
+            conn_record(l, c, c->op, ok);
+            c->selected = ok;
+            break;
+        default:
+            conn_record(l, c, c->op, ok);
+            break;
+    }
+
+    return conn_next(l, c);
+}
+
+/* One response line, without CRLF */
+static int conn_line(loader *l, conn *c, char *line, size_t len)
+{
+    char tag[16];
+    unsigned long n;
+    char *p;
+    int t;
+
+    /* A literal follows, its bytes are no lines */
+    if (len > 2 && line[len - 1] == '}') {
+        for (p = line + len - 2; p > line && isdigit((unsigned char) *p); p--);
+        if (*p == '{') {
+            c->skip = strtoul(p + 1, NULL, 10);
+        }
+    }
+
+    if (len > 2 && line[0] == '*' && line[1] == ' ') {
+        if (len < 64 && (n = strtoul(line + 2, &p, 10)) > 0 && strncmp(p, " EXISTS", 7) == 0) {
+            c->exists = n;
+        }
+        return 0;
+    }
+
+    if (line[0] == '+') {
+        if (c->st == ST_IDLING) {
+            c->st = ST_CMD;
+            return conn_send(l, c, OP_IDLE, 0, "DONE");
+        }
+        return 0;
+    }
+
+    t = snprintf(tag, sizeof(tag), "a%u ", c->tag);
+    if (len >= (size_t) t && memcmp(line, tag, t) == 0) {
+        return conn_done(l, c, line + t, len - t);
+    }
+
+    return 0;
+}
+
+/* Split what came in into lines, -1 when one doesn't fit */
+static int conn_input(loader *l, conn *c)
+{
+    size_t off = 0, n;
+    char *eol;
+
+    while (off < c->in_len) {
+        if (c->skip > 0) {
+            n = c->in_len - off < c->skip ? c->in_len - off : c->skip;
+            off += n;
+            c->skip -= n;
+            continue;
+        }
+        if ((eol = memchr(c->in + off, '\n', c->in_len - off)) == NULL) {
+            break;
+        }
+        n = eol - (c->in + off);
+        if (conn_line(l, c, c->in + off, n > 0 && eol[-1] == '\r' ? n - 1 : n) < 0) {
+            return -1;
+        }
+        off += n + 1;
+        /* Reconnected or past STARTTLS, the rest was for the old session */
+        if (c->st == ST_CONNECT || c->st == ST_HANDSHAKE) {
+            c->in_len = 0;
+            return 0;
+        }
+    }
+
+    if (off == 0 && c->in_len == LOAD_IN) {
+        return -1;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+
+    return 0;
+}
+
+static int conn_read(loader *l, conn *c)
+{
+    ssize_t n;
+
+    for (;;) {
+        if (c->st == ST_HANDSHAKE) {
+            return conn_handshake(l, c);
+        }
+        if (c->ssl != NULL) {
+            if ((n = SSL_read(c->ssl, c->in + c->in_len, LOAD_IN - c->in_len)) <= 0) {
+                switch (SSL_get_error(c->ssl, n)) {
+                    case SSL_ERROR_WANT_READ:
+                        return 0;
+                    case SSL_ERROR_WANT_WRITE:
+                        conn_want(l, c, 1);
+                        return 0;
+                }
+                return -1;
+            }
+        } else if ((n = read(c->fd, c->in + c->in_len, LOAD_IN - c->in_len)) <= 0) {
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                return 0;
+            }
+            return -1;
+        }
+        c->in_len += n;
+        if (conn_input(l, c) < 0) {
+            return -1;
+        }
+        if (c->st == ST_CONNECT) {
+            return 0;
+        }
+    }
+}
+
+static void conn_event(loader *l, conn *c, uint32_t events)
+{
+    socklen_t len = sizeof(int);
+    int err = 0, ret = 0;
+
+    if (c->st == ST_DEAD) {
+        return;
+    }
+
+    if (c->st == ST_CONNECT) {
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            l->errors[OP_CONNECT]++;
+            conn_close(l, c);
+            /* Not listening yet, or the backlog is full */
+            if (now_ns() < load_end) {
+                conn_open(l, c);
+            }
+            return;
+        }
+        c->st = ST_CMD;
+        conn_want(l, c, 0);
+        if (opt.tls) {
+            ret = conn_tls(l, c);
+        } else {
+            conn_record(l, c, OP_CONNECT, 1);
+            ret = conn_next(l, c);
+        }
+    } else if (c->st == ST_HANDSHAKE) {
+        ret = conn_handshake(l, c);
+    } else {
+        if (events & EPOLLOUT) {
+            ret = conn_flush(l, c);
+        }
+        if (ret == 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            ret = conn_read(l, c);
+        }
+    }
+
+    if (ret < 0) {
+        conn_fail(l, c);
+    }
+}
+
+static void *loader_run(void *arg)
+{
+    loader *l = arg;
+    struct epoll_event events[LOAD_EVENTS];
+    int n;
+
+    for (size_t i=0; i < l->nconns; i++) {
+        l->conns[i].fd = -1;
+        l->conns[i].ssl = NULL;
+        l->conns[i].session = NULL;
+        l->conns[i].tag = 0;
+        l->conns[i].exists = 0;
+        conn_open(l, &l->conns[i]);
+    }
+
+    while (now_ns() < load_end) {
+        if ((n = epoll_wait(l->ep, events, LOAD_EVENTS, 100)) < 0 && errno != EINTR) {
+            die("epoll_wait: %s", strerror(errno));
+        }
+        for (int i=0; i < n; i++) {
+            conn_event(l, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    for (size_t i=0; i < l->nconns; i++) {
+        conn_close(l, &l->conns[i]);
+        SSL_SESSION_free(l->conns[i].session);
+    }
+
+    return NULL;
+}
+
+/* utime + stime of pid in seconds, -1 if it can't be read */
+static double proc_cpu(pid_t pid)
+{
+    char path[64], buf[1024], *p;
+    unsigned long utime, stime;
+    FILE *f;
+    size_t n;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    if ((f = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    /* The name may hold spaces, fields are counted from its end */
+    if ((p = strrchr(buf, ')')) == NULL
+            || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return -1;
+    }
+
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void parse_mix(const char *s)
+{
+    char buf[256], *tok, *save, *eq;
+    uint8_t op;
+
+    snprintf(buf, sizeof(buf), "%s", s);
+    for (tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        if ((eq = strchr(tok, '=')) != NULL) {
+            *eq++ = '\0';
+        }
+        for (op=0; op < OP_MIX && strcasecmp(tok, op_names[op]) != 0; op++);
+        if (op == OP_MIX) {
+            die("unknown command in mix: %s", tok);
+        }
+        opt.weights[op] = eq != NULL ? strtoul(eq, NULL, 10) : 1;
+        opt.total += opt.weights[op];
+    }
+    if (opt.total == 0) {
+        die("empty mix");
+    }
+
+    opt.need_select = opt.weights[OP_FETCH] > 0 || opt.weights[OP_IDLE] > 0;
+    opt.need_auth = opt.need_select || opt.weights[OP_LOGIN] > 0 || opt.weights[OP_SELECT] > 0;
+}
+
+static void usage(void)
+{
+    die("usage: load [-a addr] [-p port] [-c conns] [-j threads] [-d secs] [-w secs]\n"
+        "            [-m CMD=weight,...] [-t | -s] [-u user] [-k pass] [-f items] [-P pid] [-H]\n"
+        "commands: CAPABILITY NOOP LOGIN SELECT FETCH IDLE");
+}
+
+static void report(loader *loaders, double secs, double cpu)
+{
+    hist *all = calloc(OP_REPORT + 1, sizeof(hist)), *h;
+    uint64_t errors[OP_REPORT] = {0}, failed = 0, cmds;
+
+    if (all == NULL) {
+        die("calloc: %s", strerror(errno));
+    }
+    for (size_t t=0; t < opt.threads; t++) {
+        for (int op=0; op < OP_REPORT; op++) {
+            hist_merge(&all[op], &loaders[t].h[op]);
+            errors[op] += loaders[t].errors[op];
+        }
+        failed += loaders[t].failed;
+    }
+    /* Commands only, connects and handshakes aside */
+    for (int op=0; op < OP_MIX; op++) {
+        hist_merge(&all[OP_REPORT], &all[op]);
+    }
+    cmds = all[OP_REPORT].n;
+
+    printf("# %zu connections, %zu threads, %us (%us warmup), %s, mix %s\n", opt.conns, opt.threads,
+            opt.duration, opt.warmup, opt.tls ? "tls" : opt.starttls ? "starttls" : "plain", opt.mix);
+    printf("%-10s %10s %10s %6s %9s %9s %9s %9s\n", "op", "count", "ops/s", "err",
+            "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    for (int op=0; op <= OP_REPORT; op++) {
+        h = &all[op];
+        if (h->n == 0 && (op == OP_REPORT || errors[op] == 0)) {
+            continue;
+        }
+        printf("%-10s %10llu %10.0f %6llu %9.1f %9.1f %9.1f %9.1f\n", op < OP_REPORT ? op_names[op] : "total",
+                (unsigned long long) h->n, h->n / secs, (unsigned long long) (op < OP_REPORT ? errors[op] : 0),
+                hist_quantile(h, 0.5) / 1e3, hist_quantile(h, 0.99) / 1e3,
+                hist_quantile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+    if (failed > 0) {
+        printf("lost connections: %llu\n", (unsigned long long) failed);
+    }
+    if (cpu >= 0 && cmds > 0) {
+        printf("server cpu: %.2f ms per 1k commands (%.0f%% of a core)\n", cpu * 1e6 / cmds, cpu * 100 / secs);
+    }
+
+    if (opt.hists) {
+        for (int op=0; op <= OP_REPORT; op++) {
+            for (size_t i=0; i < HIST_BUCKETS; i++) {
+                if (all[op].b[i] > 0) {
+                    printf("hist %s %.1f %llu\n", op < OP_REPORT ? op_names[op] : "total",
+                            hist_value(i) / 1e3, (unsigned long long) all[op].b[i]);
+                }
+            }
+        }
+    }
+    free(all);
+}
+
+int main(int argc, char **argv)
+{
+    loader *loaders;
+    struct rlimit rl;
+    struct timespec ts;
+    double cpu0 = -1, cpu1 = -1, self0;
+    uint64_t start;
+    int c;
+
+    opt.addr.sin_family = AF_INET;
+    opt.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    opt.addr.sin_port = htons(143);
+    opt.conns = 100;
+    opt.threads = 1;
+    opt.duration = 10;
+    opt.warmup = 1;
+    opt.user = "bench";
+    opt.pass = "bench";
+    opt.fetch = "(FLAGS RFC822.SIZE ENVELOPE BODY.PEEK[])";
+    opt.mix = "NOOP";
+
+    while ((c = getopt(argc, argv, "a:p:c:j:d:w:m:tsu:k:f:P:H")) != -1) {
+        switch (c) {
+            case 'a':
+                if (inet_pton(AF_INET, optarg, &opt.addr.sin_addr) != 1) {
+                    usage();
+                }
+                break;
+            case 'p': opt.addr.sin_port = htons(atoi(optarg)); break;
+            case 'c': opt.conns = strtoul(optarg, NULL, 10); break;
+            case 'j': opt.threads = strtoul(optarg, NULL, 10); break;
+            case 'd': opt.duration = strtoul(optarg, NULL, 10); break;
+            case 'w': opt.warmup = strtoul(optarg, NULL, 10); break;
+            case 'm': opt.mix = optarg; break;
+            case 't': opt.tls = 1; break;
+            case 's': opt.starttls = 1; break;
+            case 'u': opt.user = optarg; break;
+            case 'k': opt.pass = optarg; break;
+            case 'f': opt.fetch = optarg; break;
+            case 'P': opt.server = atoi(optarg); break;
+            case 'H': opt.hists = 1; break;
+            default: usage();
+        }
+    }
+    if (opt.conns == 0 || opt.threads == 0 || opt.duration == 0 || (opt.tls && opt.starttls)) {
+        usage();
+    }
+    if (opt.threads > opt.conns) {
+        opt.threads = opt.conns;
+    }
+    parse_mix(opt.mix);
+
+    signal(SIGPIPE, SIG_IGN);
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < opt.conns + 64) {
+        rl.rlim_cur = rl.rlim_max < opt.conns + 64 ? rl.rlim_max : opt.conns + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    /* Throwaway certificates, nothing is verified */
+    if ((load_ctx = SSL_CTX_new(TLS_client_method())) == NULL) {
+        die("SSL_CTX_new failed");
+    }
+    SSL_CTX_set_verify(load_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(load_ctx, SSL_SESS_CACHE_CLIENT);
+
+    if ((loaders = calloc(opt.threads, sizeof(loader))) == NULL) {
+        die("calloc: %s", strerror(errno));
+    }
+    start = now_ns();
+    load_warm = start + (uint64_t) opt.warmup * 1000000000;
+    load_end = load_warm + (uint64_t) opt.duration * 1000000000;
+
+    for (size_t t=0; t < opt.threads; t++) {
+        loader *l = &loaders[t];
+
+        l->nconns = opt.conns / opt.threads + (t < opt.conns % opt.threads);
+        l->seed = t + 1;
+        if ((l->conns = calloc(l->nconns, sizeof(conn))) == NULL || (l->ep = epoll_create1(0)) < 0) {
+            die("setup: %s", strerror(errno));
+        }
+        if (pthread_create(&l->thread, NULL, loader_run, l) != 0) {
+            die("pthread_create failed");
+        }
+    }
+
+    ts.tv_sec = opt.warmup;
+    ts.tv_nsec = 0;
+    nanosleep(&ts, NULL);
+    if (opt.server > 0) {
+        cpu0 = proc_cpu(opt.server);
+    }
+    self0 = self_cpu();
+    ts.tv_sec = opt.duration;
+    nanosleep(&ts, NULL);
+    if (opt.server > 0 && cpu0 >= 0 && (cpu1 = proc_cpu(opt.server)) >= 0) {
+        cpu1 -= cpu0;
+    }
+
+    for (size_t t=0; t < opt.threads; t++) {
+        pthread_join(loaders[t].thread, NULL);
+    }
+    report(loaders, opt.duration, cpu1);
+    printf("load cpu: %.0f%% of a core\n", (self_cpu() - self0) * 100 / opt.duration);
+
+    for (size_t t=0; t < opt.threads; t++) {
+        close(loaders[t].ep);
+        free(loaders[t].conns);
+    }
+    free(loaders);
+    SSL_CTX_free(load_ctx);
+
+    return 0;
+}
@@ -0,0 +1,431 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*-
+ * micro - time the hot functions of sis on their own
+ *
+ * Every stage runs a function over the lines of a corpus of commands
+ * as clients send them (bench/commands.txt): the parser, the command
+ * lookup, the string helpers of utils.c and the formatting done by
+ * imap_write. After a warmup that also sizes the repetitions, each
+ * stage is run a number of times and the median is reported, in ns
+ * per line, heap allocations per line and, where the kernel lets us
+ * count them, CPU cycles per byte. Given the output of an earlier run
+ * with -b, stages slower by more than -t percent fail the run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+#include <utils.h>
+#include <imap.h>
+
+#define MICRO_LINES 4096
+#define MICRO_LINE_MAX 1024
+
+typedef struct {
+    const char *name;
+    /* One pass over the corpus, returns the bytes it went through */
+    size_t (*run)(void);
+} micro_stage;
+
+typedef struct {
+    double ns, allocs, cycles;
+} micro_result;
+
+static char *lines[MICRO_LINES];
+static size_t lens[MICRO_LINES], nlines;
+/* Command names, for imap_match_cmd */
+static const char *names[MICRO_LINES];
+static size_t name_lens[MICRO_LINES];
+static char scratch[MICRO_LINE_MAX + 1];
+static imap_tok toks[IMAP_TOK_MAX];
+static client_t node;
+/* Keeps the compiler from dropping what is timed */
+static volatile size_t sink;
+
+#ifdef __GLIBC__
+/*-
+ * Heap allocations are counted by standing in for malloc and friends,
+ * glibc still does the work.
+ */
+#define MICRO_ALLOCS 1
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+static size_t allocs;
+
+void *malloc(size_t size)
+{
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    allocs++;
+    return __libc_realloc(p, size);
+}
+#else
+#define MICRO_ALLOCS 0
+static size_t allocs;
+#endif
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* CPU cycles spent in userspace by this thread, -1 if they can't be counted */
+static int perf_open(void)
+{
+#if defined(__linux__) && defined(SYS_perf_event_open)
+    struct perf_event_attr pe;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CPU_CYCLES;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static size_t stage_copy(void)
+{
+    for (size_t i=0; i < nlines; i++) {
+        memcpy(scratch, lines[i], lens[i]);
+    }
+    sink += scratch[0];
+
+    return 0;
+}
+
+/* The tokenizer unescapes in place, every line is parsed from a copy */
+static size_t stage_parse(void)
+{
+    size_t bytes = 0;
+    imap_cmd cmd;
+
+    for (size_t i=0; i < nlines; i++) {
+        memcpy(scratch, lines[i], lens[i]);
+        cmd = imap_parse_cmd(scratch, lens[i], toks, IMAP_TOK_MAX);
+        sink += cmd.id + cmd.p_count;
+        bytes += lens[i];
+    }
+
+    return bytes;
+}
+
+static size_t stage_match(void)
+{
+    size_t bytes = 0;
+
+    for (size_t i=0; i < nlines; i++) {
+        sink += imap_match_cmd(names[i], name_lens[i]);
+        bytes += name_lens[i];
+    }
+
+    return bytes;
+}
+
+static size_t stage_strstrip(void)
+{
+    size_t bytes = 0;
+
+    for (size_t i=0; i < nlines; i++) {
+        memcpy(scratch, lines[i], lens[i]);
+        scratch[lens[i]] = '\0';
+        strstrip(scratch);
+        bytes += lens[i];
+    }
+    sink += scratch[0];
+
+    return bytes;
+}
+
+static size_t stage_strnlower(void)
+{
+    size_t bytes = 0;
+
+    for (size_t i=0; i < nlines; i++) {
+        memcpy(scratch, lines[i], lens[i]);
+        strnlower(scratch, lens[i]);
+        bytes += lens[i];
+    }
+    sink += scratch[0];
+
+    return bytes;
+}
+
+/*-
+ * What FETCH answers most, then the tagged completion of every line.
+ * The output buffer is emptied before imap_write would flush it.
+ */
+static size_t stage_write(void)
+{
+    buf_t *out = &node.out;
+    size_t bytes = 0, tag;
+
+    for (size_t i=0; i < nlines; i++) {
+        if (buf_used(out) > IMAP_OUT_HIGH - 2 * MICRO_LINE_MAX) {
+            bytes += buf_used(out);
+            out->off = out->len = 0;
+        }
+        for (tag=0; tag < lens[i] && lines[i][tag] != ' '; tag++);
+        imap_write(&node, 0, "* %zu FETCH (UID %zu FLAGS (\\Seen \\Flagged) RFC822.SIZE %zu)\r\n",
+                i + 1, i + 31000, lens[i] * 97);
+        imap_write(&node, 0, "%.*s OK %.*s completed\r\n", (int) tag, lines[i],
+                (int) name_lens[i], names[i]);
+    }
+    bytes += buf_used(out);
+    out->off = out->len = 0;
+
+    return bytes;
+}
+
+static const micro_stage stages[] = {
+    /* memcpy of the lines, part of parse, strstrip and strnlower */
+    { "copy", stage_copy },
+    { "parse", stage_parse },
+    { "match", stage_match },
+    { "strstrip", stage_strstrip },
+    { "strnlower", stage_strnlower },
+    { "write", stage_write },
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*-
+ * Warm up until a pass takes a measurable time, then time reps runs
+ * of as many passes as fit in rep_ms. Medians of the runs are kept.
+ */
+static void measure(const micro_stage *s, int perf, unsigned reps, unsigned rep_ms, micro_result *r)
+{
+    double ns[64], al[64], cy[64];
+    uint64_t t0, t1, passes = 1, cycles;
+    size_t bytes = 0, a0;
+
+    do {
+        t0 = now_ns();
+        for (uint64_t p=0; p < passes; p++) {
+            bytes = s->run();
+        }
+        t1 = now_ns();
+        passes *= 2;
+    } while (t1 - t0 < (uint64_t) rep_ms * 1000000 / 8);
+    passes = passes * rep_ms * 1000000 / 2 / (t1 - t0 + 1) + 1;
+
+    for (unsigned rep=0; rep < reps; rep++) {
+        if (perf >= 0) {
+            ioctl(perf, PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        a0 = allocs;
+        t0 = now_ns();
+        for (uint64_t p=0; p < passes; p++) {
+            s->run();
+        }
+        t1 = now_ns();
+        al[rep] = (double) (allocs - a0) / (passes * nlines);
+        ns[rep] = (double) (t1 - t0) / (passes * nlines);
+        cy[rep] = -1;
+        if (perf >= 0) {
+            ioctl(perf, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(perf, &cycles, sizeof(cycles)) == sizeof(cycles) && bytes > 0) {
+                cy[rep] = (double) cycles / (passes * bytes);
+            }
+        }
+    }
+
+    qsort(ns, reps, sizeof(double), cmp_double);
+    qsort(al, reps, sizeof(double), cmp_double);
+    qsort(cy, reps, sizeof(double), cmp_double);
+    r->ns = ns[reps / 2];
+    r->allocs = al[reps / 2];
+    r->cycles = cy[reps / 2];
+}
+
+static void load_corpus(const char *path)
+{
+    char buf[MICRO_LINE_MAX + 2], *name;
+    size_t len;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "micro: %s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+    while (nlines < MICRO_LINES && fgets(buf, sizeof(buf), f) != NULL) {
+        len = strcspn(buf, "\r\n");
+        if (len == 0 || buf[0] == '#') {
+            continue;
+        }
+        if ((lines[nlines] = malloc(len + 1)) == NULL) {
+            perror("malloc");
+            exit(2);
+        }
+        memcpy(lines[nlines], buf, len);
+        lines[nlines][len] = '\0';
+        lens[nlines] = len;
+
+        /* tag SP name, or the whole line for DONE and such */
+        name = memchr(lines[nlines], ' ', len);
+        names[nlines] = name != NULL ? name + 1 : lines[nlines];
+        name_lens[nlines] = strcspn(names[nlines], " ");
+        nlines++;
+    }
+    fclose(f);
+
+    if (nlines == 0) {
+        fprintf(stderr, "micro: %s: no commands\n", path);
+        exit(2);
+    }
+}
+
+/* ns/op of stage in the output of an earlier run, -1 if it isn't there */
+static double baseline(const char *path, const char *stage)
+{
+    char line[256], name[64];
+    double ns;
+    FILE *f;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "micro: %s: %s\n", path, strerror(errno));
+        exit(2);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] != '#' && sscanf(line, "%63s %lf", name, &ns) == 2 && strcmp(name, stage) == 0) {
+            fclose(f);
+            return ns;
+        }
+    }
+    fclose(f);
+
+    return -1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: micro [-r reps] [-m ms] [-b baseline] [-t percent] [corpus]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *corpus = "bench/commands.txt", *base = NULL;
+    unsigned reps = 5, rep_ms = 200;
+    double threshold = 10, old, delta;
+    size_t bytes = 0;
+    micro_result r;
+    int c, perf, failed = 0;
+
+    while ((c = getopt(argc, argv, "r:m:b:t:")) != -1) {
+        switch (c) {
+            case 'r': reps = strtoul(optarg, NULL, 10); break;
+            case 'm': rep_ms = strtoul(optarg, NULL, 10); break;
+            case 'b': base = optarg; break;
+            case 't': threshold = strtod(optarg, NULL); break;
+            default: usage();
+        }
+    }
+    if (optind < argc) {
+        corpus = argv[optind];
+    }
+    if (reps == 0 || reps > 64 || rep_ms == 0) {
+        usage();
+    }
+    load_corpus(corpus);
+    for (size_t i=0; i < nlines; i++) {
+        bytes += lens[i];
+    }
+
+    /* A connection imap_write never gets to flush */
+    buf_init(&node.out, node.obuf, sizeof(node.obuf));
+    node.socket = -1;
+    node.conn = IMAP_CONN_ESTABLISHED;
+    node.corked = 1;
+
+    perf = perf_open();
+    printf("# %s: %zu lines, %zu bytes, %u reps of %ums, cycles %s, allocations %s\n", corpus,
+            nlines, bytes, reps, rep_ms, perf >= 0 ? "counted" : "not available",
+            MICRO_ALLOCS ? "counted" : "not available");
+    printf("%-10s %10s %10s %12s%s\n", "stage", "ns/op", "allocs/op", "cycles/byte", base != NULL ? "      delta" : "");
+
+    for (size_t i=0; i < sizeof(stages) / sizeof(stages[0]); i++) {
+        measure(&stages[i], perf, reps, rep_ms, &r);
+        printf("%-10s %10.2f %10.3f", stages[i].name, r.ns, r.allocs);
+        if (r.cycles >= 0) {
+            printf(" %12.2f", r.cycles);
+        } else {
+            printf(" %12s", "-");
+        }
+        if (base != NULL && (old = baseline(base, stages[i].name)) > 0) {
+            delta = (r.ns - old) * 100 / old;
+            printf(" %+9.1f%%%s", delta, delta > threshold ? " REGRESSION" : "");
+            failed |= delta > threshold;
+        }
+        putchar('\n');
+    }
+
+    node.out.off = node.out.len = 0;
+    buf_free(&node.out);
+    if (perf >= 0) {
+        close(perf);
+    }
+
+    return failed;
+}
@@ -0,0 +1,126 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <buf.h>
+
+void buf_init(buf_t *b, char *storage, size_t cap)
+{
+    b->data = b->fixed = storage;
+    b->cap = b->fixed_cap = storage != NULL ? cap : 0;
+    b->off = b->len = 0;
+    b->stale = NULL;
+    b->pinned = 0;
+}
+
+int buf_reserve(buf_t *b, size_t n, size_t max)
+{
+    size_t used = buf_used(b), cap;
+    char *data;
+
+    if (b->cap - b->len >= n) {
+        return 0;
+    }
+
+    /* Reclaim the consumed head first, it's cheaper than growing */
+    if (b->off > 0 && b->cap - used >= n && !b->pinned) {
+        memmove(b->data, b->data + b->off, used);
+        b->off = 0;
+        b->len = used;
+        return 0;
+    }
+
+    if (used + n > max) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    cap = b->cap ? b->cap : n;
+    while (cap < used + n) {
+        cap *= 2;
+    }
+    if (cap > max) {
+        cap = max;
+    }
+
+    if ((data = (char *) malloc(cap)) == NULL) {
+        return -1;
+    }
+    if (used > 0) {
+        memcpy(data, b->data + b->off, used);
+    }
+
+    /* Only the first copy is read from, later ones can go */
+    if (b->data != b->fixed && b->pinned && b->stale == NULL) {
+        b->stale = b->data;
+    } else if (b->data != b->fixed) {
+        free(b->data);
+    }
+    b->data = data;
+    b->cap = cap;
+    b->off = 0;
+    b->len = used;
+
+    return 0;
+}
+
+void buf_consume(buf_t *b, size_t n)
+{
+    b->off += n;
+    if (b->off < b->len) {
+        return;
+    }
+
+    b->off = b->len = 0;
+    /* Empty again, give the spilled memory back */
+    if (b->fixed != NULL && b->data != b->fixed) {
+        buf_free(b);
+    }
+}
+
+void buf_pin(buf_t *b)
+{
+    b->pinned = 1;
+}
+
+void buf_unpin(buf_t *b)
+{
+    free(b->stale);
+    b->stale = NULL;
+    b->pinned = 0;
+}
+
+void buf_free(buf_t *b)
+{
+    if (b->data != b->fixed) {
+        free(b->data);
+    }
+    free(b->stale);
+    buf_init(b, b->fixed, b->fixed_cap);
+}
@@ -0,0 +1,65 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BUF_H
+#define BUF_H
+
+#include <stddef.h>
+
+/*-
+ * Growable byte buffer, data[off, len) holds the bytes not yet
+ * consumed. Consuming only moves off, unconsumed bytes are moved
+ * to the front when room is needed at the tail. A buffer may start
+ * on caller provided storage, it only spills to the heap when that
+ * is too small and goes back to it once emptied. While pinned, the
+ * bytes already in it stay where they are: growing copies them and
+ * keeps the old storage until buf_unpin.
+ */
+typedef struct {
+    char *data;
+    size_t off, len, cap;
+    char *fixed;
+    size_t fixed_cap;
+    char *stale;
+    int pinned;
+} buf_t;
+
+/* Use storage (may be NULL) until more than cap bytes are needed. */
+void buf_init(buf_t *b, char *storage, size_t cap);
+
+/* Make room for at least n bytes at the tail, never beyond max. */
+int buf_reserve(buf_t *b, size_t n, size_t max);
+/* Drop n bytes from the head. */
+void buf_consume(buf_t *b, size_t n);
+/* Somebody else reads data[off, len) until buf_unpin */
+void buf_pin(buf_t *b);
+void buf_unpin(buf_t *b);
+/* Number of bytes not yet consumed. */
+#define buf_used(b) ((b)->len - (b)->off)
+void buf_free(buf_t *b);
+
+#endif /* ifndef BUF_H */
@@ -0,0 +1,262 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <config.h>
+#include <commit.h>
+
+/* A file of the batch, synced once for every request naming it */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    uint8_t reg, failed;
+} commit_file;
+
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static commit_req *commit_head = NULL, *commit_tail = NULL;
+static size_t commit_queued = 0;
+static int commit_stopping = 0;
+static int commit_running = 0;
+static pthread_t commit_thread_id;
+/* Only touched by the commit thread */
+static commit_file *commit_files = NULL;
+static size_t commit_nfiles = 0, commit_cap = 0;
+
+static int commit_fsync(int fd)
+{
+    while (fsync(fd) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Slot of the file fd refers to, added if new, -1 on failure */
+static ssize_t commit_slot(int fd)
+{
+    commit_file *grown;
+    struct stat st;
+    size_t i;
+
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    /* Batches name a few directories and the files appended to them */
+    for (i=0; i < commit_nfiles; i++) {
+        if (commit_files[i].ino == st.st_ino && commit_files[i].dev == st.st_dev) {
+            return i;
+        }
+    }
+
+    if (commit_nfiles == commit_cap) {
+        if ((grown = realloc(commit_files, (commit_cap * 2 + 16) * sizeof(commit_file))) == NULL) {
+            return -1;
+        }
+        commit_files = grown;
+        commit_cap = commit_cap * 2 + 16;
+    }
+    commit_files[i].dev = st.st_dev;
+    commit_files[i].ino = st.st_ino;
+    commit_files[i].fd = fd;
+    commit_files[i].reg = S_ISREG(st.st_mode);
+    commit_files[i].failed = 0;
+
+    return commit_nfiles++;
+}
+
+/* Sync every file of the requests chained from batch once */
+static void commit_batch(commit_req *batch)
+{
+    ssize_t slot;
+
+    commit_nfiles = 0;
+    for (commit_req *req = batch; req != NULL; req = req->next) {
+        for (size_t i=0; i < req->nfds; i++) {
+            if ((slot = commit_slot(req->fds[i])) < 0) {
+                req->failed = 1;
+                req->slots[i] = (size_t) -1;
+            } else {
+                req->slots[i] = slot;
+            }
+        }
+    }
+
+    /*-
+     * Writeback of every message starts before waiting for any, the
+     * fsync calls then mostly wait for the same journal commit.
+     */
+    for (size_t i=0; i < commit_nfiles; i++) {
+        if (commit_files[i].reg) {
+            sync_file_range(commit_files[i].fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+    }
+    for (size_t i=0; i < commit_nfiles; i++) {
+        commit_files[i].failed = commit_fsync(commit_files[i].fd) < 0;
+    }
+
+    for (commit_req *req = batch; req != NULL; req = req->next) {
+        for (size_t i=0; i < req->nfds; i++) {
+            if (req->slots[i] != (size_t) -1 && commit_files[req->slots[i]].failed) {
+                req->failed = 1;
+            }
+        }
+    }
+}
+
+static void *commit_thread(void *arg)
+{
+    commit_req *batch, *req;
+
+    for (;;) {
+        pthread_mutex_lock(&commit_lock);
+        while (commit_head == NULL && !commit_stopping) {
+            pthread_cond_wait(&commit_cond, &commit_lock);
+        }
+        if (commit_stopping) {
+            pthread_mutex_unlock(&commit_lock);
+            return NULL;
+        }
+        /* Everything that came in during the last batch makes the next one */
+        batch = commit_head;
+        commit_head = commit_tail = NULL;
+        commit_queued = 0;
+        pthread_mutex_unlock(&commit_lock);
+
+        commit_batch(batch);
+
+        /* Gone to the submitter once written, next is read before */
+        while ((req = batch) != NULL) {
+            batch = req->next;
+            while (write(req->notify, &req, sizeof(req)) < 0 && errno == EINTR);
+        }
+    }
+}
+
+int commit_start(void)
+{
+    if (pthread_create(&commit_thread_id, NULL, commit_thread, NULL) != 0) {
+        return -1;
+    }
+    commit_running = 1;
+
+    return 0;
+}
+
+void commit_stop(void)
+{
+    commit_req *req;
+
+    pthread_mutex_lock(&commit_lock);
+    commit_stopping = 1;
+    pthread_cond_broadcast(&commit_cond);
+    pthread_mutex_unlock(&commit_lock);
+
+    if (commit_running) {
+        pthread_join(commit_thread_id, NULL);
+        commit_running = 0;
+    }
+
+    while ((req = commit_head) != NULL) {
+        commit_head = req->next;
+        commit_req_free(req);
+    }
+    commit_tail = NULL;
+    commit_queued = 0;
+    free(commit_files);
+    commit_files = NULL;
+    commit_nfiles = commit_cap = 0;
+}
+
+commit_req *commit_req_new(const int *fds, size_t nfds, int notify)
+{
+    commit_req *req;
+
+    if (nfds > COMMIT_FDS || (req = calloc(1, sizeof(commit_req))) == NULL) {
+        return NULL;
+    }
+    memcpy(req->fds, fds, nfds * sizeof(int));
+    req->nfds = nfds;
+    req->notify = notify;
+
+    return req;
+}
+
+void commit_req_free(commit_req *req)
+{
+    for (size_t i=0; i < req->nfds; i++) {
+        close(req->fds[i]);
+    }
+    free(req);
+}
+
+int commit_submit(commit_req *req)
+{
+    pthread_mutex_lock(&commit_lock);
+    if (!commit_running || commit_stopping || commit_queued >= COMMIT_QUEUE) {
+        pthread_mutex_unlock(&commit_lock);
+        return -1;
+    }
+
+    req->next = NULL;
+    if (commit_tail != NULL) {
+        commit_tail->next = req;
+    } else {
+        commit_head = req;
+    }
+    commit_tail = req;
+    commit_queued++;
+    pthread_cond_signal(&commit_cond);
+    pthread_mutex_unlock(&commit_lock);
+
+    return 0;
+}
+
+int commit_sync(const int *fds, size_t n)
+{
+    int ret = 0;
+
+    for (size_t i=0; i < n; i++) {
+        if (commit_fsync(fds[i]) < 0) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
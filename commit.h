@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Descriptors a request can ask to be synced */
+#define COMMIT_FDS 4
+
+/*-
+ * A command is only answered once what it changed is on disk. The
+ * files and directories it touched go in a request, handed to
+ * commit_submit. A single thread takes every request queued while it
+ * was syncing the previous ones and syncs them as one batch, each
+ * file once however many requests ask for it: sessions appending or
+ * storing at the same time share the cost of the fsync calls. Like
+ * auth_req, the address of a request is then written to notify for
+ * the submitter to pick it up.
+ */
+typedef struct commit_req {
+    /* Owned by the request, closed by commit_req_free */
+    int fds[COMMIT_FDS];
+    size_t nfds;
+    /* Set if any of them could not be synced */
+    int failed;
+    int notify;
+    /* Owned by the submitter */
+    void *data;
+    uint32_t serial;
+    /* Where the commit thread put each descriptor in its batch */
+    size_t slots[COMMIT_FDS];
+    struct commit_req *next;
+} commit_req;
+
+/* Start the commit thread, -1 on failure */
+int commit_start(void);
+/* Stop it, requests not synced yet are freed */
+void commit_stop(void);
+/* New request taking over the nfds descriptors of fds, NULL if out of memory */
+commit_req *commit_req_new(const int *fds, size_t nfds, int notify);
+void commit_req_free(commit_req *req);
+/* Queue req, -1 if COMMIT_QUEUE requests are already waiting */
+int commit_submit(commit_req *req);
+/* Sync the n descriptors of fds on the calling thread, -1 on failure */
+int commit_sync(const int *fds, size_t n);
+
+#endif /* ifndef COMMIT_H */
@@ -0,0 +1,172 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <config.h>
+#include <compress.h>
+
+compress_t *compress_new(const char *data, size_t len)
+{
+    compress_t *z;
+
+    if (len > COMPRESS_BUF || (z = calloc(1, sizeof(compress_t))) == NULL) {
+        return NULL;
+    }
+    if ((z->pend = malloc(COMPRESS_BUF)) == NULL || (z->raw = malloc(COMPRESS_BUF)) == NULL) {
+        goto fail;
+    }
+
+    /* Negative window bits, no zlib header or trailer */
+    if (deflateInit2(&z->def, COMPRESS_LEVEL, Z_DEFLATED, -COMPRESS_WINDOW,
+                COMPRESS_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        goto fail;
+    }
+    if (inflateInit2(&z->inf, -15) != Z_OK) {
+        deflateEnd(&z->def);
+        goto fail;
+    }
+
+    memcpy(z->raw, data, len);
+    z->inf.next_in = (Bytef *) z->raw;
+    z->inf.avail_in = len;
+    z->synced = 1;
+
+    return z;
+
+fail:
+    free(z->pend);
+    free(z->raw);
+    free(z);
+    return NULL;
+}
+
+void compress_free(compress_t *z)
+{
+    deflateEnd(&z->def);
+    inflateEnd(&z->inf);
+    free(z->pend);
+    free(z->raw);
+    free(z);
+}
+
+/* Room at the tail of pend, unwritten bytes moved to the front */
+static size_t compress_room(compress_t *z)
+{
+    if (z->pend_off > 0) {
+        memmove(z->pend, z->pend + z->pend_off, z->pend_len);
+        z->pend_off = 0;
+    }
+    z->def.next_out = (Bytef *) z->pend + z->pend_len;
+    z->def.avail_out = COMPRESS_BUF - z->pend_len;
+
+    return z->def.avail_out;
+}
+
+size_t compress_deflate(compress_t *z, const char *data, size_t len)
+{
+    size_t room;
+
+    if ((room = compress_room(z)) == 0) {
+        return 0;
+    }
+
+    z->def.next_in = (Bytef *) data;
+    z->def.avail_in = len;
+    deflate(&z->def, Z_NO_FLUSH);
+    z->pend_len += room - z->def.avail_out;
+
+    if (z->def.avail_in < len) {
+        z->synced = 0;
+    }
+    return len - z->def.avail_in;
+}
+
+int compress_sync(compress_t *z)
+{
+    size_t room;
+
+    if (z->synced) {
+        return 0;
+    }
+    if ((room = compress_room(z)) == 0) {
+        return 1;
+    }
+
+    z->def.next_in = NULL;
+    z->def.avail_in = 0;
+    deflate(&z->def, Z_SYNC_FLUSH);
+    z->pend_len += room - z->def.avail_out;
+
+    /* Output space left over means the flush is complete */
+    if (z->def.avail_out == 0) {
+        return 1;
+    }
+    z->synced = 1;
+    return 0;
+}
+
+void compress_consume(compress_t *z, size_t n)
+{
+    z->pend_off += n;
+    z->pend_len -= n;
+    if (z->pend_len == 0) {
+        z->pend_off = 0;
+    }
+}
+
+char *compress_raw(compress_t *z, size_t *len)
+{
+    /* Only read once the previous input was all inflated */
+    *len = z->inf.avail_in == 0 ? COMPRESS_BUF : 0;
+    return z->raw;
+}
+
+void compress_fill(compress_t *z, size_t n)
+{
+    z->inf.next_in = (Bytef *) z->raw;
+    z->inf.avail_in = n;
+}
+
+ssize_t compress_inflate(compress_t *z, char *dst, size_t len)
+{
+    int ret;
+
+    if (z->inf.avail_in == 0) {
+        return 0;
+    }
+
+    z->inf.next_out = (Bytef *) dst;
+    z->inf.avail_out = len;
+    ret = inflate(&z->inf, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return -1;
+    }
+
+    return len - z->inf.avail_out;
+}
@@ -0,0 +1,78 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+/* Room for deflated output and for compressed input, each */
+#define COMPRESS_BUF (16 * 1024)
+
+/*-
+ * Both directions of a COMPRESS=DEFLATE (RFC 4978) connection, raw
+ * deflate streams. No I/O happens in here: the caller writes out
+ * what piles up in pend[off, len) and reads into raw before asking
+ * for it to be inflated. Output is only flushed by compress_sync,
+ * at the end of each batch of responses. Deflate memory is set by
+ * COMPRESS_WINDOW and COMPRESS_MEMLEVEL, inflate has to accept any
+ * window the client picked.
+ */
+typedef struct {
+    z_stream def, inf;
+    char *pend;
+    size_t pend_off, pend_len;
+    /* Every byte deflated so far was flushed */
+    int synced;
+    char *raw;
+} compress_t;
+
+/*-
+ * Start compressing, the len bytes at data were received after the
+ * COMPRESS command and are already compressed. NULL on failure.
+ */
+compress_t *compress_new(const char *data, size_t len);
+void compress_free(compress_t *z);
+/* Deflate what fits of data into pend, returns how much was taken */
+size_t compress_deflate(compress_t *z, const char *data, size_t len);
+/* Flush deflated data into pend, 1 if pend must be drained first */
+int compress_sync(compress_t *z);
+/* Drop n bytes from the head of pend */
+void compress_consume(compress_t *z, size_t n);
+/* Where up to *len bytes of compressed input can be read to */
+char *compress_raw(compress_t *z, size_t *len);
+/* Account for n bytes read at compress_raw */
+void compress_fill(compress_t *z, size_t n);
+/*-
+ * Inflate into dst, returns the bytes produced, 0 if more input
+ * must be read and -1 if the stream is broken or over.
+ */
+ssize_t compress_inflate(compress_t *z, char *dst, size_t len);
+
+#endif /* ifndef COMPRESS_H */
@@ -0,0 +1,193 @@
+/* See LICENSE file for copyright and license details. */
+
+/* network */
+#define IMAP_PORT       143
+#define IMAPS_PORT      993
+#define TLS_ENABLED     1
+/*-
+ * Let the kernel encrypt TLS records
+ * once the handshake is done (Linux
+ * kTLS, needs the tls module loaded),
+ * message bodies are then sent with
+ * sendfile(2). Connections fall back
+ * to userspace TLS when unavailable.
+ */
+#define KTLS_ENABLED    1
+/*-
+ * Take LOGIN and AUTHENTICATE on
+ * plaintext connections too. Only for
+ * trusted networks, e.g. benchmarks on
+ * localhost (see bench/bench.sh).
+ * LOGINDISABLED is then left out of
+ * CAPABILITY.
+ */
+#define PLAINTEXT_AUTH  0
+/*-
+ * TLS session resumption. Tickets are
+ * encrypted with a key replaced every
+ * TICKET_ROTATE seconds, clients that
+ * don't use them are looked up in a
+ * cache of SESSION_CACHE sessions (about
+ * 1KB each, 0 disables it). Resumed
+ * sessions live SESSION_TIMEOUT seconds.
+ */
+#define SESSION_CACHE   4096
+#define SESSION_TIMEOUT 7200
+#define TICKET_ROTATE   (12 * 3600)
+/*-
+ * COMPRESS=DEFLATE (RFC 4978). Output
+ * uses a 2^COMPRESS_WINDOW bytes window
+ * (9-15) and COMPRESS_MEMLEVEL (1-9),
+ * about 2^(WINDOW+2) + 2^(MEMLEVEL+9)
+ * bytes. Input needs a full 32KB window
+ * plus 32KB of buffers on top of that,
+ * for each compressing client.
+ */
+#define COMPRESS_ENABLED  1
+#define COMPRESS_LEVEL    6
+#define COMPRESS_WINDOW   12
+#define COMPRESS_MEMLEVEL 5
+/*-
+ * Number of worker threads, each one
+ * with its own listening socket, event
+ * loop and clients. 0 starts one worker
+ * per online CPU.
+ */
+#define WORKERS         0
+/*-
+ * Maximum number of connected clients,
+ * NOTE: each one of these is a currently
+ * connected client and holds a file
+ * descriptor, the RLIMIT_NOFILE soft
+ * limit is raised accordingly at startup.
+ * With the epoll backend idle clients
+ * cost nothing per wakeup, the select
+ * fallback is capped by FD_SETSIZE.
+ * The limit is split evenly between
+ * workers, whose connection tables are
+ * allocated at startup (about 6KB per
+ * client).
+ */
+#define MAX_CLIENTS     4096
+/*-
+ * Maximum size for the command buffer.
+ * IMAP sends plain text commands, so
+ * the default value can receive up to
+ * 8000 characters long commands.
+ * It should be enough but feel free to
+ * modify this.
+ */
+#define CMD_MAX_SIZE    8000
+/*-
+ * Maximum size of a single literal,
+ * e.g. a message sent with APPEND. It
+ * is buffered in memory until the
+ * command is complete.
+ */
+#define LITERAL_MAX_SIZE (32 * 1024 * 1024)
+/*-
+ * Where mail is kept, %s is the user
+ * name. INBOX is the Maildir itself,
+ * other mailboxes are Maildir++ ones
+ * (".Name" directories inside it).
+ */
+#define MAIL_ROOT "/var/mail/%s/Maildir"
+/*-
+ * Accounts, one "user:hash" per line.
+ * The hash is anything crypt(3) knows
+ * about, e.g. from mkpasswd(1).
+ */
+#define PASSWD_FILE "/etc/sis/passwd"
+/*-
+ * Passwords are checked by AUTH_THREADS
+ * threads, with at most AUTH_QUEUE
+ * checks waiting. Good credentials are
+ * remembered AUTH_CACHE_TTL seconds, up
+ * to AUTH_CACHE of them (0 disables),
+ * so frequent logins skip the hashing.
+ * Editing PASSWD_FILE clears them.
+ */
+#define AUTH_THREADS    2
+#define AUTH_QUEUE      64
+#define AUTH_CACHE      1024
+#define AUTH_CACHE_TTL  300
+/*-
+ * SEARCH for strings runs on
+ * SEARCH_THREADS threads, with at most
+ * SEARCH_QUEUE searches waiting (more
+ * run on the event loop). From, To, Cc,
+ * Bcc and Subject are indexed next to
+ * the messages, changes are logged and
+ * folded into the index past
+ * SEARCH_LOG_MAX bytes.
+ */
+#define SEARCH_THREADS  2
+#define SEARCH_QUEUE    64
+#define SEARCH_LOG_MAX  (256 * 1024)
+/*-
+ * APPEND, STORE and EXPUNGE are only
+ * answered once their changes are
+ * synced. A thread syncs whatever the
+ * sessions queued meanwhile as one
+ * batch, with at most COMMIT_QUEUE
+ * commands waiting (more sync on the
+ * event loop).
+ */
+#define COMMIT_QUEUE    256
+/*-
+ * Plaintext and kTLS connections are
+ * served through io_uring on Linux 6.0
+ * and later, epoll otherwise. A ring
+ * per worker queues URING_ENTRIES
+ * requests per batch and receives into
+ * URING_BUFS buffers (a power of two)
+ * of URING_BUF_SIZE bytes. Set
+ * URING_ENABLED to 0 where there is no
+ * linux/io_uring.h.
+ */
+#define URING_ENABLED   1
+#define URING_ENTRIES   1024
+#define URING_BUFS      512
+#define URING_BUF_SIZE  4096
+/*-
+ * Connection counts, traffic and the
+ * time commands and TLS handshakes
+ * take are served in the Prometheus
+ * text format to whoever connects to
+ * ADMIN_SOCKET (a UNIX socket, only
+ * open to the user sis runs as). Leave
+ * it empty to go without.
+ */
+#define ADMIN_SOCKET    "/run/sis-admin.sock"
+/*-
+ * Workers queue their messages, up to
+ * LOG_RING (a power of two) of them,
+ * for a thread that writes them to
+ * syslog, or LOG_FILE if set. Past
+ * LOG_RATE messages a second per
+ * worker, or with the queue full,
+ * messages are dropped and counted.
+ */
+#define LOG_FILE        ""
+#define LOG_RING        256
+#define LOG_RATE        1000
+
+/*-
+ * Advertised by CAPABILITY. Every file
+ * reading the settings above sees these
+ * too, only imap.c uses them.
+ */
+static char *imap_capabilities[] __attribute__((unused)) = {
+    "IMAP4rev1",
+    "STARTTLS",
+    "AUTH=GSSAPI",
+    "LOGINDISABLED",
+    NULL
+};
+
+static char *imaps_capabilities[] __attribute__((unused)) = {
+    "IMAP4rev1",
+    "AUTH=GSSAPI",
+    "AUTH=PLAIN",
+    NULL
+};
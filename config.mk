@@ -10,11 +10,18 @@ MANPREFIX = ${PREFIX}/share/man
 # OpenBSD (uncomment)
 #MANPREFIX = ${PREFIX}/man
 
+# event backend, ev_select.c is the portable fallback
+EVSRC = ev_epoll.c
+#EVSRC = ev_select.c
+
+# mailbox storage backend
+STORESRC = maildir.c
+
 # includes and libs
 INCS = -I.
-LIBS = -lssl -lcrypto
+LIBS = -lssl -lcrypto -lcrypt -lz -lpthread
 # flags
-CPPFLAGS = -DVERSION=\"${VERSION}\" 
+CPPFLAGS = -DVERSION=\"${VERSION}\" -D_DEFAULT_SOURCE -D_POSIX_C_SOURCE=200809L
 CFLAGS  := -std=c99 -pedantic -Wall -O0 -Wno-gnu-label-as-value -Wno-gnu-zero-variadic-macro-arguments ${INCS} ${CPPFLAGS} 
 CFLAGS  := ${CFLAGS} -g
 LDFLAGS  = ${LIBS}
@@ -0,0 +1,69 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef EV_H
+#define EV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Interest and readiness flags. */
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+/* Only reported, hangup or error on the descriptor. */
+#define EV_ERROR 0x4
+
+typedef struct {
+    void *data;
+    uint32_t events;
+} ev_event;
+
+/*-
+ * Opaque event loop, the implementation is picked at build time
+ * through EVSRC in config.mk. Consumers must treat readiness as
+ * edge-triggered: once notified, read or write until EAGAIN.
+ * Level-triggered backends satisfy this contract as well.
+ */
+typedef struct ev_loop ev_loop;
+
+/* Create a loop able to watch up to max descriptors. */
+ev_loop *ev_new(size_t max);
+/* Register fd once, data is handed back with every event. */
+int ev_add(ev_loop *loop, int fd, uint32_t events, void *data);
+/* Change the interest set of an already registered fd. */
+int ev_mod(ev_loop *loop, int fd, uint32_t events, void *data);
+/* Stop watching fd, must be called before closing it. */
+int ev_del(ev_loop *loop, int fd);
+/* Wait up to timeout ms (-1 forever) and fill at most max events. */
+int ev_wait(ev_loop *loop, ev_event *events, int max, int timeout);
+void ev_free(ev_loop *loop);
+/* Descriptor readable while events are waiting, -1 if there is none. */
+int ev_fd(ev_loop *loop);
+/* Name of the compiled in backend. */
+const char *ev_backend(void);
+
+#endif /* ifndef EV_H */
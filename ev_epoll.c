@@ -0,0 +1,148 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <ev.h>
+
+struct ev_loop {
+    int fd, max;
+    struct epoll_event *events;
+};
+
+static uint32_t ev_to_epoll(uint32_t events)
+{
+    uint32_t e = EPOLLET;
+
+    if (events & EV_READ) {
+        e |= EPOLLIN;
+    }
+    if (events & EV_WRITE) {
+        e |= EPOLLOUT;
+    }
+
+    return e;
+}
+
+ev_loop *ev_new(size_t max)
+{
+    ev_loop *loop = (ev_loop *) malloc(sizeof(ev_loop));
+    if (loop == NULL) {
+        return NULL;
+    }
+
+    loop->max = max;
+    loop->events = (struct epoll_event *) calloc(max, sizeof(struct epoll_event));
+    if (loop->events == NULL) {
+        free(loop);
+        return NULL;
+    }
+
+    if ((loop->fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        free(loop->events);
+        free(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+int ev_add(ev_loop *loop, int fd, uint32_t events, void *data)
+{
+    struct epoll_event ev;
+
+    ev.events = ev_to_epoll(events);
+    ev.data.ptr = data;
+
+    return epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int ev_mod(ev_loop *loop, int fd, uint32_t events, void *data)
+{
+    struct epoll_event ev;
+
+    ev.events = ev_to_epoll(events);
+    ev.data.ptr = data;
+
+    return epoll_ctl(loop->fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int ev_del(ev_loop *loop, int fd)
+{
+    /* Non-NULL event for kernels older than 2.6.9. */
+    struct epoll_event ev;
+
+    return epoll_ctl(loop->fd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int ev_wait(ev_loop *loop, ev_event *events, int max, int timeout)
+{
+    int n;
+
+    if (max > loop->max) {
+        max = loop->max;
+    }
+
+    if ((n = epoll_wait(loop->fd, loop->events, max, timeout)) < 0) {
+        return n;
+    }
+
+    for (int i=0; i < n; i++) {
+        uint32_t e = loop->events[i].events;
+        events[i].data = loop->events[i].data.ptr;
+        events[i].events = 0;
+        if (e & EPOLLIN) {
+            events[i].events |= EV_READ;
+        }
+        if (e & EPOLLOUT) {
+            events[i].events |= EV_WRITE;
+        }
+        if (e & (EPOLLERR | EPOLLHUP)) {
+            events[i].events |= EV_ERROR;
+        }
+    }
+
+    return n;
+}
+
+void ev_free(ev_loop *loop)
+{
+    close(loop->fd);
+    free(loop->events);
+    free(loop);
+}
+
+int ev_fd(ev_loop *loop)
+{
+    return loop->fd;
+}
+
+const char *ev_backend(void)
+{
+    return "epoll";
+}
@@ -0,0 +1,156 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/select.h>
+#include <ev.h>
+
+/*-
+ * Portable fallback, level-triggered and bounded by FD_SETSIZE.
+ * Every wakeup costs O(highest fd), use ev_epoll.c where possible.
+ */
+struct ev_loop {
+    fd_set rfds, wfds;
+    int max_fd;
+    void *data[FD_SETSIZE];
+};
+
+ev_loop *ev_new(size_t max)
+{
+    ev_loop *loop = (ev_loop *) malloc(sizeof(ev_loop));
+    if (loop == NULL) {
+        return NULL;
+    }
+
+    FD_ZERO(&loop->rfds);
+    FD_ZERO(&loop->wfds);
+    loop->max_fd = -1;
+    memset(loop->data, 0x0, sizeof(loop->data));
+
+    return loop;
+}
+
+int ev_mod(ev_loop *loop, int fd, uint32_t events, void *data)
+{
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    FD_CLR(fd, &loop->rfds);
+    FD_CLR(fd, &loop->wfds);
+    if (events & EV_READ) {
+        FD_SET(fd, &loop->rfds);
+    }
+    if (events & EV_WRITE) {
+        FD_SET(fd, &loop->wfds);
+    }
+
+    loop->data[fd] = data;
+    if (fd > loop->max_fd) {
+        loop->max_fd = fd;
+    }
+
+    return 0;
+}
+
+int ev_add(ev_loop *loop, int fd, uint32_t events, void *data)
+{
+    return ev_mod(loop, fd, events, data);
+}
+
+int ev_del(ev_loop *loop, int fd)
+{
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        errno = EBADF;
+        return -1;
+    }
+
+    FD_CLR(fd, &loop->rfds);
+    FD_CLR(fd, &loop->wfds);
+    loop->data[fd] = NULL;
+
+    while (loop->max_fd >= 0
+            && !FD_ISSET(loop->max_fd, &loop->rfds)
+            && !FD_ISSET(loop->max_fd, &loop->wfds)) {
+        loop->max_fd--;
+    }
+
+    return 0;
+}
+
+int ev_wait(ev_loop *loop, ev_event *events, int max, int timeout)
+{
+    fd_set rfds = loop->rfds, wfds = loop->wfds;
+    struct timeval tv, *tvp = NULL;
+    int n, count = 0;
+
+    if (timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    if ((n = select(loop->max_fd + 1, &rfds, &wfds, NULL, tvp)) <= 0) {
+        return n;
+    }
+
+    /* Whatever does not fit in events is reported again next time. */
+    for (int fd=0; fd <= loop->max_fd && count < max; fd++) {
+        uint32_t e = 0;
+        if (FD_ISSET(fd, &rfds)) {
+            e |= EV_READ;
+        }
+        if (FD_ISSET(fd, &wfds)) {
+            e |= EV_WRITE;
+        }
+        if (e) {
+            events[count].data = loop->data[fd];
+            events[count].events = e;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+void ev_free(ev_loop *loop)
+{
+    free(loop);
+}
+
+int ev_fd(ev_loop *loop)
+{
+    return -1;
+}
+
+const char *ev_backend(void)
+{
+    return "select";
+}
@@ -28,83 +28,197 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 #include <syslog.h>
 #include <errno.h>
 #include <config.h>
 #include <utils.h>
+#include <ev.h>
+#include <uring.h>
+#include <buf.h>
+#include <auth.h>
+#include <search.h>
+#include <commit.h>
+#include <metrics.h>
+#include <logger.h>
+#include <mime.h>
+#include <store.h>
+#include <tls.h>
 #include <imap.h>
+#include <imap_cmds.h>
 
-static char buf[CMD_MAX_SIZE];
-static trie_node *trie;
-
-void imap_trie_encode(char *str, uint8_t cmd)
+/*-
+ * What a ring completion is about, in the top byte of its user data.
+ * Requests made for a client carry its slot and serial below it, the
+ * cancellations themselves carry 0 and are ignored.
+ */
+#define IMAP_OP_EV 0x1
+#define IMAP_OP_ACCEPT 0x2
+#define IMAP_OP_RECV 0x3
+#define IMAP_OP_SEND 0x4
+#define IMAP_OP_POLL 0x5
+#define IMAP_RING_DATA(op, node) ((uint64_t) (op) << 56 \
+        | (uint64_t) ((node) - (node)->worker->clients) << 32 | (node)->serial)
+#define IMAP_RING_OP(data) ((uint8_t) ((data) >> 56))
+#define IMAP_RING_SLOT(data) ((size_t) ((data) >> 32) & 0xffffff)
+
+/* In imap.routines, answers a parked LOGIN or AUTHENTICATE */
+static void imap_login_done(client_t *node, uint8_t ssl, const char *user, int result);
+/* In imap.routines, untagged responses for changes to the selected mailbox */
+static void imap_rescan(client_t *node, uint8_t ssl);
+/* In imap.routines, goes on with a FETCH or STORE parked in IMAP_CONT_JOB */
+static void imap_job_run(client_t *node, uint8_t ssl);
+/* In imap.routines, answers a SEARCH parked in IMAP_CONT_SEARCH */
+static void imap_search_finish(client_t *node, uint8_t ssl, search_req *req);
+/* In imap.routines, answers a command parked in IMAP_CONT_COMMIT */
+static void imap_commit_finish(client_t *node, uint8_t ssl, int failed);
+/* In imap.routines, frees the job of a client that leaves */
+static void imap_job_drop(client_t *node);
+
+static int imap_set_nonblock(int fd)
 {
-    trie_node *node;
-    if (trie == NULL) {
-        trie = (trie_node *) malloc(sizeof(trie_node));
-        memset(trie, 0x0, sizeof(trie_node));
-    }
+    int flags;
 
-    node = trie;
-    do {
-        node->children[*(str) - 'a'] = (trie_node *) malloc(sizeof(trie_node));
-        node = node->children[*(str) - 'a'];
-        memset(node, 0x0, sizeof(trie_node));
-        node->id = 0xff;
-        str++;
-    } while (*str != '\0');
+    if ((flags = fcntl(fd, F_GETFL)) < 0) {
+        return -1;
+    }
 
-    node->id = cmd;
-    printf("%d\n", node->id);
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-void imap_populate_trie(void)
+static int imap_worker_init(imap_t *imap, imap_worker *worker)
 {
-    imap_trie_encode("capability", 0x0);
-    imap_trie_encode("noop", 0x1);
-    imap_trie_encode("logout", 0x2);
-    imap_trie_encode("starttls", 0x3);
-    imap_trie_encode("authenticate", 0x4);
-    imap_trie_encode("login", 0x5);
-}
+    int on = 1;
+
+    worker->imap = imap;
+    worker->clients = NULL;
+    worker->nclients = 0;
+    worker->max_clients = (MAX_CLIENTS + imap->nworkers - 1) / imap->nworkers;
+    worker->socket = -1;
+    worker->ev = NULL;
+    worker->ring = NULL;
+    worker->serial = 0;
+    worker->auth_done[0] = worker->auth_done[1] = -1;
+    worker->search_done[0] = worker->search_done[1] = -1;
+    worker->commit_done[0] = worker->commit_done[1] = -1;
+    worker->watches = NULL;
+    worker->nwatches = 0;
+    worker->job = NULL;
+    worker->inotify = worker->accept_retry = -1;
+    worker->accept_paused = 0;
+    buf_init(&worker->scratch, NULL, 0);
+
+    if ((worker->log = logger_ring_new()) == NULL) {
+        perror("logger_ring_new");
+        return 1;
+    }
 
-#define CMD_MAP_LAST 0x5
+    if ((worker->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        perror("inotify_init1");
+        return 1;
+    }
+    if ((worker->accept_retry = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        perror("timerfd_create");
+        return 1;
+    }
 
-void imap_trie_free(trie_node *node)
-{
-    trie_node *tmp = NULL;
-    
-    for (int i=0; i < 26; i++) {
-        tmp = node->children[i];
-        if (tmp != NULL) {
-            imap_trie_free(tmp);
-        }
+    if (pipe(worker->auth_done) < 0 || imap_set_nonblock(worker->auth_done[0]) < 0
+            || pipe(worker->search_done) < 0 || imap_set_nonblock(worker->search_done[0]) < 0
+            || pipe(worker->commit_done) < 0 || imap_set_nonblock(worker->commit_done[0]) < 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    if ((worker->chunk = malloc(IMAP_CHUNK)) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    /* The whole table up front, accept and close never allocate */
+    if (posix_memalign((void **) &worker->clients, IMAP_CACHELINE,
+                worker->max_clients * sizeof(client_t)) != 0) {
+        worker->clients = NULL;
+        perror("posix_memalign");
+        return 1;
+    }
+
+    for (size_t i=0; i < worker->max_clients; i++) {
+        worker->clients[i].socket = -1;
+        worker->clients[i].next_free = i + 1 < worker->max_clients ? (int32_t) i + 1 : -1;
+    }
+    worker->free_slot = 0;
+
+    if ((worker->ev = ev_new(worker->max_clients + 4)) == NULL) {
+        perror("ev_new");
+        return 1;
+    }
+
+    /* Create a new socket using IPv4 protocol */
+    if ((worker->socket = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return 1;
     }
 
-    free(node);
+    /* Every worker binds its own listener, the kernel spreads connections */
+    if (setsockopt(worker->socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+            || setsockopt(worker->socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("setsockopt");
+        return 1;
+    }
+
+    /* Bind the socket to the specified address */
+    if ((bind(worker->socket, (struct sockaddr *)&imap->addr, sizeof(imap->addr)) < 0)) {
+        perror("bind");
+        return 2;
+    }
+
+    return 0;
 }
 
 uint8_t imap_init(uint8_t daemon, imap_t *instance)
 {
-    imap_populate_trie();
-
     imap_t imap;
+    struct rlimit rl;
+    long ncpu;
+    uint8_t status;
     imap.ssl_ctx = NULL;
     imap.ssl = 0;
+    imap.uring = 0;
 
-    /* Create a new socket using IPv4 protocol */
-    if ((imap.socket = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socker");
+    /* From config.h, 0 means one worker per online CPU */
+    imap.nworkers = WORKERS;
+    if (imap.nworkers == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        imap.nworkers = ncpu > 0 ? ncpu : 1;
+    }
+
+    /* Every client costs a descriptor, make room for MAX_CLIENTS of them */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < MAX_CLIENTS + 16) {
+        rl.rlim_cur = rl.rlim_max < MAX_CLIENTS + 16 ? rl.rlim_max : MAX_CLIENTS + 16;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    /* Written once on shutdown, every worker watches the read end */
+    if (pipe(imap.wake) < 0) {
+        perror("pipe");
         return 1;
     }
 
     bzero(&imap.addr, sizeof(struct sockaddr_in));
 
-    imap.state = IMAP_STATE_NO_AUTH;
     imap.addr.sin_family = AF_INET;
     /* From config.h */
     imap.addr.sin_port = htons(TLS_ENABLED ? IMAPS_PORT : IMAP_PORT);
@@ -113,10 +227,16 @@ uint8_t imap_init(uint8_t daemon, imap_t *instance)
         imap.addr.sin_addr.s_addr = htonl(INADDR_ANY);
     }
 
-    /* Bind the socket to the specified address */
-    if ((bind(imap.socket, (struct sockaddr *)&imap.addr, sizeof(imap.addr)) < 0)) {
-        perror("bind");
-        return 2;
+    imap.workers = (imap_worker *) calloc(imap.nworkers, sizeof(imap_worker));
+    if (imap.workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (size_t i=0; i < imap.nworkers; i++) {
+        if ((status = imap_worker_init(&imap, &imap.workers[i])) != 0) {
+            return status;
+        }
     }
 
     /* If daemon mode is activated, detach */
@@ -127,7 +247,9 @@ uint8_t imap_init(uint8_t daemon, imap_t *instance)
                 return 3;
                 break;
             default:
-                close(imap.socket);
+                for (size_t i=0; i < imap.nworkers; i++) {
+                    close(imap.workers[i].socket);
+                }
                 free(instance);
                 exit(0);
                 break;
@@ -136,367 +258,1889 @@ uint8_t imap_init(uint8_t daemon, imap_t *instance)
         }
     }
 
-    if (TLS_ENABLED) {
-        imap_create_ssl_ctx(&imap);
-        imap_starttls(&imap, NULL);
-    }
+    /* Needed for port 993 as well as for STARTTLS on port 143 */
+    imap_create_ssl_ctx(&imap);
+    imap.ssl = TLS_ENABLED;
 
     memcpy(instance, &imap, sizeof(imap));
+    /* Workers keep a pointer to the final instance */
+    for (size_t i=0; i < instance->nworkers; i++) {
+        instance->workers[i].imap = instance;
+    }
 
     return 0;
 }
 
-int imap_get_max_fd(client_list *list, int master)
+/*-
+ * Give node back to the event loop: the receive and poll it has on
+ * the ring are cancelled, a send in flight is let finish (see
+ * imap_send_raw). What was received but not read yet is kept if keep,
+ * otherwise dropped.
+ */
+static void imap_ring_detach(imap_worker *worker, client_t *node, int keep)
 {
-    int max_fd = 0;
-    client_list *node = list;
+    if (node->ring & IMAP_RING_RECV) {
+        uring_cancel(worker->ring, IMAP_RING_DATA(IMAP_OP_RECV, node));
+    }
+    if (node->ring & IMAP_RING_POLL) {
+        uring_cancel(worker->ring, IMAP_RING_DATA(IMAP_OP_POLL, node));
+    }
+    /* Before anything else is read from the socket */
+    uring_submit(worker->ring);
+    node->ring &= IMAP_RING_SEND;
+    if (!keep) {
+        buf_free(&node->rx);
+    }
+    node->rx_view = NULL;
+    node->rx_len = 0;
 
-    while (node != NULL) {
-        if (max_fd < node->socket) {
-            max_fd = node->socket;
-        }
+    node->events = IMAP_PENDING(node) ? EV_READ | EV_WRITE : EV_READ;
+    if (ev_add(worker->ev, node->socket, node->events, node) < 0) {
+        node->conn = IMAP_CONN_ERROR;
+    }
+}
+
+/* Receive again, unless node is done with it or behind */
+static void imap_ring_recv_arm(client_t *node)
+{
+    imap_worker *worker = node->worker;
+
+    if ((node->ring & (IMAP_RING_ON | IMAP_RING_RECV | IMAP_RING_EOF | IMAP_RING_HOLD)) != IMAP_RING_ON
+            || node->rx_err != 0) {
+        return;
+    }
+    if (uring_recv(worker->ring, node->socket, IMAP_RING_DATA(IMAP_OP_RECV, node)) < 0) {
+        imap_ring_detach(worker, node, 1);
+        return;
+    }
+    node->ring |= IMAP_RING_RECV;
+}
 
-        node = node->next;
+/*-
+ * Serve node through the ring of its worker from now on, -1 if it
+ * can't be and stays with the event loop. The caller takes it off
+ * the loop.
+ */
+static int imap_ring_attach(imap_worker *worker, client_t *node)
+{
+    if (worker->ring == NULL
+            || uring_recv(worker->ring, node->socket, IMAP_RING_DATA(IMAP_OP_RECV, node)) < 0) {
+        return -1;
     }
+    node->ring = IMAP_RING_ON | IMAP_RING_RECV;
 
-    return max_fd > master ? max_fd : master;
+    return 0;
 }
 
-client_list *imap_add_client(imap_t *instance, client_list *list, int sock)
+/* What the ring received for node, handed out the way read(2) would */
+static ssize_t imap_ring_read(client_t *node, char *buffer, size_t len)
 {
-    client_list *node = (client_list *) malloc(sizeof(client_list));
-    /* Check if TLS is active */
-    if (instance->ssl) {
-        node->ssl = SSL_new(instance->ssl_ctx);
-        SSL_set_fd(node->ssl, sock);
-        SSL_set_accept_state(node->ssl);
-        SSL_do_handshake(node->ssl);
-        node->fd = SSL_get_fd(node->ssl);
-    } else {
-        node->fd = sock;
+    buf_t *rx = &node->rx;
+    size_t n;
+
+    if (buf_used(rx) > 0) {
+        n = len < buf_used(rx) ? len : buf_used(rx);
+        memcpy(buffer, rx->data + rx->off, n);
+        buf_consume(rx, n);
+        /* Caught up, take more */
+        if (buf_used(rx) == 0 && (node->ring & IMAP_RING_HOLD)) {
+            node->ring &= ~IMAP_RING_HOLD;
+            imap_ring_recv_arm(node);
+        }
+        return n;
     }
 
-    node->socket = sock;
-    node->next = list;
-    node->prev = NULL;
-    if (list != NULL) {
-        list->prev = node;
+    if (node->rx_len > 0) {
+        n = len < node->rx_len ? len : node->rx_len;
+        memcpy(buffer, node->rx_view, n);
+        node->rx_view += n;
+        node->rx_len -= n;
+        return n;
     }
 
-    return node; 
+    if (node->ring & IMAP_RING_EOF) {
+        return 0;
+    }
+    errno = node->rx_err != 0 ? node->rx_err : EAGAIN;
+    return -1;
 }
 
-client_list *imap_remove_client(imap_t *instance, client_list *list, client_list *node)
+/*-
+ * Sends of node->out go through the ring one at a time. The first
+ * call queues it and reports EAGAIN, the one after its completion
+ * (see imap_ring_sent) gets how much went. out is pinned meanwhile.
+ */
+static ssize_t imap_ring_send(client_t *node, const char *data, size_t len)
 {
-    if (node->next != NULL) {
-        node->next->prev = node->prev;
+    imap_worker *worker = node->worker;
+
+    if (uring_send(worker->ring, node->socket, data, len, IMAP_RING_DATA(IMAP_OP_SEND, node)) < 0) {
+        return write(node->socket, data, len);
     }
+    buf_pin(&node->out);
+    node->ring |= IMAP_RING_SEND;
 
-    if (node->prev != NULL) {
-        node->prev->next = node->next;
+    errno = EAGAIN;
+    return -1;
+}
+
+/* Only issue ev_mod when the interest set actually changes */
+static int imap_want(imap_worker *worker, client_t *node, uint8_t events)
+{
+    /* The ring receives all along and tells when a send is done */
+    if (node->ring & IMAP_RING_ON) {
+        if ((events & EV_WRITE) && !(node->ring & (IMAP_RING_SEND | IMAP_RING_POLL))
+                && uring_poll(worker->ring, node->socket, POLLOUT, 0, IMAP_RING_DATA(IMAP_OP_POLL, node)) == 0) {
+            node->ring |= IMAP_RING_POLL;
+        }
+        return 0;
     }
 
-    /* Check if TLS is active */
-    if (instance->ssl) {
-        SSL_shutdown(node->ssl);
-        SSL_free(node->ssl);
+    if (node->events == events) {
+        return 0;
     }
 
-    close(node->socket);
+    node->events = events;
+    return ev_mod(worker->ev, node->socket, events, node);
+}
+
+/* Output of node now waiting for the socket, 0 once it could all leave */
+static void imap_backlog(client_t *node, size_t bytes)
+{
+    metrics_t *m = &node->worker->metrics;
+
+    if (node->backlog != bytes) {
+        metrics_sub(&m->backlog, node->backlog);
+        metrics_add(&m->backlog, bytes);
+        node->backlog = bytes;
+    }
+}
+
+client_t *imap_add_client(imap_worker *worker, int sock)
+{
+    imap_t *instance = worker->imap;
+    client_t *node;
+
+    if (worker->free_slot < 0) {
+        return NULL;
+    }
+    node = &worker->clients[worker->free_slot];
+
+    if (imap_set_nonblock(sock) < 0) {
+        return NULL;
+    }
 
-    if (node == list) {
+    node->socket = sock;
+    node->ssl = NULL;
+    buf_init(&node->in, node->ibuf, sizeof(node->ibuf));
+    buf_init(&node->out, node->obuf, sizeof(node->obuf));
+    node->corked = 0;
+    node->ktls = 0;
+    node->z = NULL;
+    node->ring = 0;
+    node->rx_view = NULL;
+    node->rx_len = 0;
+    buf_init(&node->rx, NULL, 0);
+    node->sent = 0;
+    node->rx_err = 0;
+    node->watch = -1;
+    node->scan = node->line = node->literal = 0;
+    node->nsegs = 0;
+    node->out_tail = 0;
+    node->backlog = 0;
+    node->cont = IMAP_CONT_NONE;
+    node->user[0] = '\0';
+    node->mbox = NULL;
+    node->job = NULL;
+    node->serial = ++worker->serial;
+    node->conn = IMAP_CONN_ESTABLISHED;
+    node->events = EV_READ;
+    node->state = IMAP_STATE_NO_AUTH;
+    node->worker = worker;
+
+    /* Plaintext goes to the ring right away, TLS once the kernel took it over */
+    if ((instance->ssl || imap_ring_attach(worker, node) < 0)
+            && ev_add(worker->ev, sock, EV_READ, node) < 0) {
+        node->socket = -1;
         return NULL;
     }
+    worker->free_slot = node->next_free;
+    worker->nclients++;
+    metrics_add(&worker->metrics.accepted, 1);
+
+    /* Implicit TLS, the handshake is driven by the event loop */
+    if (instance->ssl) {
+        imap_starttls(instance, node);
+    }
 
-    return list;
+    return node; 
 }
 
-client_list *imap_remove_sock(imap_t *instance, client_list *list, int sock)
+void imap_remove_client(imap_worker *worker, client_t *node)
 {
-    client_list *node = list;
+    /* close_notify, if any, was already sent by imap_shutdown */
+    if (node->ssl != NULL) {
+        SSL_free(node->ssl);
+        node->ssl = NULL;
+    }
 
-    while (node != NULL && node->socket != sock) {
-        node = node->next;
+    for (uint8_t i=0; i < node->nsegs; i++) {
+        close(node->segs[i].fd);
+    }
+    node->nsegs = 0;
+    imap_idle_stop(node);
+    imap_job_drop(node);
+    if (node->mbox != NULL) {
+        store_close(node->mbox);
+        node->mbox = NULL;
+    }
+    if (node->z != NULL) {
+        compress_free(node->z);
+        node->z = NULL;
     }
 
-    if (node != NULL) {
-        imap_remove_client(instance, list, node);
+    /* A send still in flight must fail rather than read freed memory */
+    if (node->ring & IMAP_RING_SEND) {
+        shutdown(node->socket, SHUT_RDWR);
+        uring_cancel(worker->ring, IMAP_RING_DATA(IMAP_OP_SEND, node));
+    }
+    if (node->ring & IMAP_RING_RECV) {
+        uring_cancel(worker->ring, IMAP_RING_DATA(IMAP_OP_RECV, node));
+    }
+    if (node->ring & IMAP_RING_POLL) {
+        uring_cancel(worker->ring, IMAP_RING_DATA(IMAP_OP_POLL, node));
     }
+    if (!(node->ring & IMAP_RING_ON)) {
+        ev_del(worker->ev, node->socket);
+    }
+    node->ring = 0;
+    node->sent = 0;
+    node->rx_err = 0;
+    imap_backlog(node, 0);
+    buf_free(&node->rx);
+    buf_free(&node->in);
+    buf_free(&node->out);
+    close(node->socket);
+    node->socket = -1;
 
-    return node;
+    node->next_free = worker->free_slot;
+    worker->free_slot = node - worker->clients;
+    worker->nclients--;
+    metrics_add(&worker->metrics.closed, 1);
 }
 
-void imap_starttls(imap_t *imap, client_list *list)
+int imap_starttls(imap_t *imap, client_t *node)
 {
-    imap->ssl = 1;
-
-    while (list != NULL) {
-        list->ssl = SSL_new(imap->ssl_ctx);
-        list->fd = SSL_get_fd(list->ssl);
-        SSL_set_fd(list->ssl, list->socket);
-        list = list->next;
+    if ((node->ssl = SSL_new(imap->ssl_ctx)) == NULL) {
+        return -1;
     }
+
+    SSL_set_fd(node->ssl, node->socket);
+    SSL_set_accept_state(node->ssl);
+    node->conn = IMAP_CONN_HANDSHAKE;
+    node->since = metrics_now();
+
+    return 0;
 }
 
-void imap_start(imap_t *instance)
+/* Take a connection accept(2) or the ring returned */
+static void imap_accepted(imap_worker *worker, int connection)
 {
-    int activity, max_fd, connection;
-    size_t bytes_read;
-    /* List of all the file descriptors (sockets) being used. */
-    fd_set fds;
-    instance->clients = NULL;
-    client_list *node = instance->clients;
-    client_list *tmp = instance->clients;
+    if (worker->nclients >= worker->max_clients) {
+        close(connection);
+        metrics_add(&worker->metrics.refused, 1);
+        logger_push(worker->log, LOG_WARNING, "Too many clients, connection refused.");
+        return;
+    }
 
-    listen(instance->socket, BACKLOG);
-    syslog(LOG_INFO, "Listening on %d.", IMAP_PORT);
+    if (imap_add_client(worker, connection) == NULL) {
+        close(connection);
+        metrics_add(&worker->metrics.refused, 1);
+        logger_push(worker->log, LOG_ERR, "Failed to register connection.");
+        return;
+    }
 
-    for (;;) {
-        FD_ZERO(&fds);
-        FD_SET(instance->socket, &fds);
-        node = instance->clients;
+    logger_push(worker->log, LOG_INFO, "Connection enstablished.");
+}
+
+/*-
+ * Edge-triggered, drain the whole accept queue. When accept(2) fails
+ * for lack of descriptors or memory the connections left in the queue
+ * won't make another edge, the timer brings us back here instead.
+ */
+static void imap_accept(imap_worker *worker)
+{
+    struct itimerspec later = { { 0, 0 }, { 0, IMAP_ACCEPT_RETRY * 1000000L } };
+    int connection;
 
-        while (node != NULL) {
-            FD_SET(node->socket, &fds);
-            node = node->next;
+    for (;;) {
+        if ((connection = accept(worker->socket, NULL, NULL)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                worker->accept_paused = 0;
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            /* Once per pause, not on every retry */
+            if (!worker->accept_paused) {
+                logger_push(worker->log, LOG_ERR, "Connection failed: %s.", strerror(errno));
+            }
+            worker->accept_paused = 1;
+            timerfd_settime(worker->accept_retry, 0, &later, NULL);
+            return;
         }
+        imap_accepted(worker, connection);
+    }
+}
 
-        max_fd = imap_get_max_fd(instance->clients, instance->socket);
-        activity = select(max_fd + 1, &fds, NULL, NULL, NULL);
+static void imap_drop_client(imap_worker *worker, client_t *node)
+{
+    imap_remove_client(worker, node);
+}
 
-        if ((activity < 0) && (errno!=EINTR)) {
-            perror("select");
-        }
+/*-
+ * Flush what is left, then send close_notify without waiting for
+ * the peer's one. The connection stays in IMAP_CONN_SHUTDOWN until
+ * both could be written.
+ */
+static void imap_shutdown(imap_worker *worker, client_t *node)
+{
+    int pending;
 
-        /* New connection. */
-        if (FD_ISSET(instance->socket, &fds)) {
-            if ((connection = accept(instance->socket, NULL, NULL)) < 0) {
-                perror("accept");
-                syslog(LOG_ERR, "Connection failed.");
-                imap_close(instance);
-                exit(EXIT_FAILURE);
-            }
+    node->conn = IMAP_CONN_SHUTDOWN;
+    node->corked = 0;
 
-            instance->clients = imap_add_client(instance, instance->clients, connection);
-            syslog(LOG_INFO, "Connection enstablished.");
-            FD_SET(connection, &fds);
-        }
-
-        node = instance->clients;
-        tmp = node;
-        while (node != NULL) {
-            connection = node->socket;
-            tmp = node->next;
-            
-            if (FD_ISSET(connection, &fds)) {
-                /* Error occured. */
-                 if ((bytes_read = imap_read(node, buf, CMD_MAX_SIZE, instance->ssl)) < 0) {
-                    perror("recv");
-                    instance->clients = imap_remove_client(instance, instance->clients, node);
-                    free(node);
-                    FD_CLR(connection, &fds);
-                    syslog(LOG_ERR, "Failed to receive data.");
-                /* Somebody disconnected */
-                }  else if (bytes_read == 0) {
-                    instance->clients = imap_remove_client(instance, instance->clients, node);
-                    free(node);
-                    FD_CLR(connection, &fds);
-                    syslog(LOG_INFO, "Connection closed.");
-                } else {
-                    buf[bytes_read] = '\0';
-                    imap_cmd cmd = imap_parse_cmd(buf);
-                    uint8_t res = imap_cmd_exec(cmd, node, instance->ssl, instance->state);
-                    if (res == IMAP_LOGOUT) {
-                        instance->clients = imap_remove_client(instance, instance->clients, node);
-                        free(node);
-                        FD_CLR(connection, &fds);
-                        syslog(LOG_INFO, "Client logout.");   
-                    } else if (res == IMAP_STARTTLS) {
-                        imap_starttls(instance, instance->clients);
-                    }
-                    if (cmd.params != NULL) {
-                        free(cmd.params);
-                    }
-                }
-            }
+    /* Let the pending responses, BYE included, leave first */
+    if ((pending = imap_flush(node, node->ssl != NULL)) > 0) {
+        return;
+    }
 
-            node = tmp;
+    if (pending == 0 && node->ssl != NULL && SSL_shutdown(node->ssl) < 0) {
+        switch (SSL_get_error(node->ssl, -1)) {
+            case SSL_ERROR_WANT_WRITE:
+                imap_want(worker, node, EV_WRITE);
+                return;
+            case SSL_ERROR_WANT_READ:
+                imap_want(worker, node, EV_READ);
+                return;
         }
     }
+
+    imap_drop_client(worker, node);
 }
 
-void imap_close(imap_t *instance)
+/*-
+ * Advance the TLS handshake as far as the socket allows. Returns
+ * IMAP_CONN_ESTABLISHED once done, IMAP_CONN_HANDSHAKE while it waits
+ * for readiness and IMAP_CONN_SHUTDOWN if the client was dropped.
+ */
+static uint8_t imap_handshake(imap_worker *worker, client_t *node)
 {
-    client_list *node = instance->clients;
-    client_list *tmp = node;
-    while (node != NULL) {
-        if (instance->ssl) {
-            SSL_shutdown(node->ssl);
-            SSL_free(node->ssl);
+    int ret;
+
+    if ((ret = SSL_do_handshake(node->ssl)) == 1) {
+        metrics_record(&worker->metrics.tls, metrics_now() - node->since);
+        if (SSL_session_reused(node->ssl)) {
+            metrics_add(&worker->metrics.tls_resumed, 1);
+        } else {
+            metrics_add(&worker->metrics.tls_full, 1);
         }
-        close(node->socket);
-        tmp = node->next;
-        free(node);
-        node = tmp;
+#ifndef OPENSSL_NO_KTLS
+        /* Records are now sealed by the kernel, files can skip userspace */
+        node->ktls = BIO_get_ktls_send(SSL_get_wbio(node->ssl));
+        /* Both ways and nothing left inside OpenSSL, the ring can serve it */
+        if (node->ktls && BIO_get_ktls_recv(SSL_get_rbio(node->ssl))
+                && !SSL_has_pending(node->ssl) && imap_ring_attach(worker, node) == 0) {
+            ev_del(worker->ev, node->socket);
+        }
+#endif
+        node->conn = IMAP_CONN_ESTABLISHED;
+        imap_want(worker, node, EV_READ);
+        return IMAP_CONN_ESTABLISHED;
     }
 
-    imap_trie_free(trie);
-    close(instance->socket);
-    if (instance->ssl) {
-        SSL_CTX_free(instance->ssl_ctx);
+    switch (SSL_get_error(node->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            imap_want(worker, node, EV_READ);
+            return IMAP_CONN_HANDSHAKE;
+        case SSL_ERROR_WANT_WRITE:
+            imap_want(worker, node, EV_READ | EV_WRITE);
+            return IMAP_CONN_HANDSHAKE;
+        default:
+            metrics_add(&worker->metrics.tls_failed, 1);
+            logger_push(worker->log, LOG_INFO, "TLS handshake failed.");
+            imap_drop_client(worker, node);
+            return IMAP_CONN_SHUTDOWN;
     }
-    free(instance);
 }
 
-uint8_t imap_match_cmd(char *cmd, size_t len)
+/*-
+ * Look for the next complete command at the head of node->in,
+ * literals included. Returns the number of bytes it spans, 0 if
+ * more data is needed and -1 if a line exceeds CMD_MAX_SIZE or a
+ * literal LITERAL_MAX_SIZE. The command is NUL terminated in place
+ * and *len excludes the final CRLF. Scanning resumes where the
+ * previous call stopped.
+ */
+static ssize_t imap_frame(client_t *node, size_t *len)
 {
-    strnlower(cmd, len);
-
-    trie_node *node = trie;
-    do {
-        node = node->children[*cmd - 'a'];
-        if (node->id == 0xff) {
-            cmd++;
+    buf_t *in = &node->in;
+    char *p = in->data + in->off, *nl;
+    size_t end = buf_used(in), i = node->scan, j, n, lit, mul;
+
+    while (i < end) {
+        /* Literal data is opaque, skip it without looking */
+        if (node->literal > 0) {
+            n = end - i < node->literal ? end - i : node->literal;
+            i += n;
+            node->literal -= n;
+            node->line = i;
             continue;
-        } else {
-            return node->id;
         }
 
-        cmd++;
-    } while (*cmd != '\0');
+        if ((nl = memchr(p + i, '\n', end - i)) == NULL) {
+            i = end;
+            break;
+        }
 
-    return 0xff;
-}
+        i = nl - p + 1;
+        j = nl - p;
+        if (j > node->line && p[j-1] == '\r') {
+            j--;
+        }
 
-imap_cmd imap_parse_cmd(char *s)
-{
-    imap_cmd cmd;
-    strstrip(s);
-    size_t params = 0, id_len = 0, i = 0;
-    char *cpy;
-    printf("%s\n", s);
+        if (j - node->line > CMD_MAX_SIZE) {
+            return -1;
+        }
 
-    cmd.params = NULL;    
-    /* Copy the first 4 characters of the command in the tag field */ 
-    memcpy(cmd.tag, s, 4);
-    s += 5; 
+        /* {n} or {n+} right before CRLF announces a literal */
+        if (j > node->line && p[j-1] == '}') {
+            size_t k = j - 1;
+            uint8_t plus = 0;
 
-    while (*s != '\n' && *s != '\0' && *s != ' ' && *s > 0) {
-        s++;
-        id_len++;
+            if (k > node->line && p[k-1] == '+') {
+                plus = 1;
+                k--;
+            }
+
+            for (lit = 0, mul = 1; k > node->line && p[k-1] >= '0' && p[k-1] <= '9'; k--) {
+                lit += (p[k-1] - '0') * mul;
+                mul *= 10;
+                if (mul > LITERAL_MAX_SIZE * 10UL) {
+                    return -1;
+                }
+            }
+
+            if (k > node->line && p[k-1] == '{' && k < j - 1 - plus) {
+                if (lit > LITERAL_MAX_SIZE) {
+                    return -1;
+                }
+                node->literal = lit;
+                node->line = i;
+                /* Synchronizing literals wait for our go-ahead */
+                if (!plus) {
+                    imap_write(node, node->ssl != NULL, "+ Ready for literal data\r\n");
+                }
+                continue;
+            }
+        }
+
+        p[j] = '\0';
+        *len = j;
+        node->scan = node->line = 0;
+        return i;
     }
 
-    if (id_len == 0) {
-        cmd.id = 0xff;
-        return cmd;
+    node->scan = i;
+    if (node->literal == 0 && i - node->line > CMD_MAX_SIZE) {
+        return -1;
     }
 
-    id_len -= 1;
-    s -= id_len+1;
-    cmd.id = imap_match_cmd(s, id_len);
-    s += id_len+2;
+    return 0;
+}
+
+/* imap_read, through inflate once COMPRESS is active */
+static ssize_t imap_recv(client_t *node, char *buffer, size_t len, uint8_t ssl)
+{
+    ssize_t n;
+    size_t cap;
+    char *raw;
 
-    char *tok;
-    cpy = (char *) calloc(strlen(s), sizeof(char));
-    strcpy(cpy, s);
-    for (tok = strtok(cpy, " "); tok; tok = strtok(NULL, " ")) {
-        params++;
+    if (node->z == NULL) {
+        return imap_read(node, buffer, len, ssl);
     }
 
-    free(cpy);
-
-    if (params > 0) {
-        cmd.params = (char **) calloc(params, sizeof(char **));
-        for (tok = strtok(s, " "); tok; tok = strtok(NULL, " ")) {
-            cmd.params[i] = tok;
-            i++;
+    for (;;) {
+        if ((n = compress_inflate(node->z, buffer, len)) != 0) {
+            if (n < 0) {
+                errno = EIO;
+            }
+            return n;
         }
-        cmd.p_count = params;
+        raw = compress_raw(node->z, &cap);
+        if ((n = imap_read(node, raw, cap, ssl)) <= 0) {
+            return n;
+        }
+        compress_fill(node->z, n);
     }
-    
-    return cmd;
 }
 
-#include <imap.routines>
-
-uint8_t imap_cmd_exec(imap_cmd cmd, client_list *node, uint8_t ssl, uint8_t state)
+/*-
+ * The OK to COMPRESS has left uncompressed, from here on both ways
+ * are deflated. Whatever follows the command in node->in already is.
+ */
+static int imap_compress(imap_worker *worker, client_t *node)
 {
-    if (cmd.id < 0x0 || cmd.id > CMD_MAP_LAST) {
-        return IMAP_FAIL;
+    buf_t *in = &node->in;
+
+    if ((node->z = compress_new(in->data + in->off, buf_used(in))) == NULL) {
+        logger_push(worker->log, LOG_ERR, "Failed to start compression.");
+        imap_drop_client(worker, node);
+        return -1;
     }
-    void *routines[] = {
-        &&capability,
-        &&noop,
-        &&logout,
-        &&starttls,
-        &&auth,
-        &&login
-    };
-    goto *routines[cmd.id];
-    IMAP_ROUTINE(capability)
-    IMAP_ROUTINE(noop)
-    IMAP_ROUTINE(logout)
-    IMAP_ROUTINE(starttls)
-    IMAP_ROUTINE(auth)
-    IMAP_ROUTINE(login)
+    buf_consume(in, buf_used(in));
+    node->scan = node->line = node->literal = 0;
+    node->cont = IMAP_CONT_NONE;
 
-    return IMAP_SUCCESS;
+    return 0;
 }
 
-void imap_create_ssl_ctx(imap_t *imap)
+/*-
+ * Serve every complete command in node->in and flush the answers.
+ * Returns 0 if more input can be taken, -1 if the client is gone,
+ * waiting for the socket to be writable or parked.
+ */
+static int imap_run(imap_worker *worker, client_t *node)
 {
-    const SSL_METHOD *method;
+    imap_t *instance = worker->imap;
+    buf_t *in = &node->in;
+    uint8_t ssl = node->ssl != NULL, res;
+    ssize_t n = 0;
+    size_t len;
+    uint64_t start;
+    int pending;
+
+    node->corked = 1;
+resume:
+    /* A FETCH or STORE that stopped for the socket comes first */
+    if (node->cont == IMAP_CONT_JOB) {
+        imap_job_run(node, ssl);
+        if (node->conn == IMAP_CONN_ERROR) {
+            imap_drop_client(worker, node);
+            return -1;
+        }
+    }
 
-    method = TLS_server_method();
-    imap->ssl_ctx = SSL_CTX_new(method);
-    if (!imap->ssl_ctx) {
-        perror("Unable to create SSL context");
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+    while (!IMAP_PARKED(node) && (n = imap_frame(node, &len)) > 0) {
+        char *line = in->data + in->off;
+
+        if (node->cont != IMAP_CONT_NONE) {
+            res = imap_cont_exec(line, len, node, ssl, node->state);
+        } else {
+            imap_cmd cmd = imap_parse_cmd(line, len, worker->toks, IMAP_TOK_MAX);
+            start = metrics_now();
+            res = imap_cmd_exec(cmd, node, ssl, node->state);
+            metrics_record(&worker->metrics.cmds[cmd.id < IMAP_CMD_COUNT ? cmd.id : METRICS_CMD_UNKNOWN],
+                    metrics_now() - start);
+        }
+        buf_consume(in, n);
+
+        if (node->conn == IMAP_CONN_ERROR) {
+            imap_drop_client(worker, node);
+            return -1;
+        } else if (res == IMAP_LOGOUT) {
+            logger_push(worker->log, LOG_INFO, "Client logout.");
+            imap_shutdown(worker, node);
+            return -1;
+        } else if (res == IMAP_STARTTLS) {
+            /* The go-ahead must leave in plaintext, the handshake is read by OpenSSL */
+            if (node->ring & IMAP_RING_ON) {
+                imap_ring_detach(worker, node, 0);
+            }
+            node->corked = 0;
+            if (imap_flush(node, ssl) != 0 || imap_starttls(instance, node) < 0) {
+                imap_drop_client(worker, node);
+                return -1;
+            }
+            /* Anything pipelined after STARTTLS is plaintext, drop it */
+            buf_consume(in, buf_used(in));
+            node->scan = node->line = node->literal = 0;
+            imap_handshake(worker, node);
+            return -1;
+        }
     }
 
-    if (SSL_CTX_use_certificate_file(imap->ssl_ctx, "ca-cert.pem", SSL_FILETYPE_PEM) <= 0) {
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+    if (n < 0) {
+        imap_write(node, ssl, "* BYE Command too long\r\n");
+        logger_push(worker->log, LOG_ERR, "Command too long.");
+        imap_shutdown(worker, node);
+        return -1;
     }
 
-    if (SSL_CTX_use_PrivateKey_file(imap->ssl_ctx, "ca-key.pem", SSL_FILETYPE_PEM) <= 0 ) {
-        ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+    /* One write for the whole batch, wait for EV_WRITE if it blocks */
+    node->corked = 0;
+    if ((pending = imap_flush(node, ssl)) != 0) {
+        if (pending < 0) {
+            imap_drop_client(worker, node);
+        }
+        return -1;
     }
+    if (node->cont == IMAP_CONT_COMPRESS && imap_compress(worker, node) < 0) {
+        return -1;
+    }
+    /* Drained before the job noticed, no EV_WRITE is coming for it */
+    if (node->cont == IMAP_CONT_JOB) {
+        node->corked = 1;
+        goto resume;
+    }
+
+    /* Input stays in the socket until the credentials are checked */
+    return IMAP_PARKED(node) ? -1 : 0;
 }
 
-int imap_read(client_list *node, char *buffer, size_t len, uint8_t ssl)
+static void imap_serve(imap_worker *worker, client_t *node)
 {
-    if (ssl) {
-        return SSL_read(node->ssl, buffer, len);
-    } else {
-        return read(node->socket, buffer, len);
+    buf_t *in = &node->in;
+    ssize_t bytes_read;
+    uint8_t ssl;
+    int pending;
+
+    switch (node->conn) {
+        case IMAP_CONN_SHUTDOWN:
+            imap_shutdown(worker, node);
+            return;
+        case IMAP_CONN_HANDSHAKE:
+            if (imap_handshake(worker, node) != IMAP_CONN_ESTABLISHED) {
+                return;
+            }
+            break;
     }
-}
 
-void imap_write(client_list *node, uint8_t ssl, char *fmt, ...)
-{
-    va_list(args);
-    va_start(args, fmt);
-    vsprintf(buf, fmt, args);
+    /* Don't take new commands while the previous answers are stuck */
+    if (IMAP_PENDING(node) && (pending = imap_flush(node, node->ssl != NULL)) != 0) {
+        if (pending < 0) {
+            imap_drop_client(worker, node);
+        }
+        return;
+    }
+    if (node->cont == IMAP_CONT_COMPRESS && imap_compress(worker, node) < 0) {
+        return;
+    }
 
-    if (!ssl) {
-        write(node->socket, buf, strlen(buf));
-    } else {
-        SSL_write(node->ssl, buf, strlen(buf));
+    /* The rest of a FETCH or STORE, then commands pipelined behind it or a parked login */
+    if (node->cont == IMAP_CONT_JOB && imap_run(worker, node) < 0) {
+        return;
+    }
+    if (IMAP_PARKED(node) || (buf_used(in) > 0 && imap_run(worker, node) < 0)) {
+        return;
     }
-}
 
-void imap_flush(client_list *node, uint8_t ssl)
-{
-    FILE *fd;
+    /* Edge-triggered, keep reading until the socket is drained. */
+    for (;;) {
+        ssl = node->ssl != NULL;
+        if (buf_reserve(in, IMAP_READ_CHUNK, IMAP_IN_MAX) < 0) {
+            imap_write(node, ssl, "* BYE Command too long\r\n");
+            logger_push(worker->log, LOG_ERR, "Input buffer exhausted.");
+            imap_shutdown(worker, node);
+            return;
+        }
 
-    if (!ssl) {
-        fd = fdopen(node->socket, "w");
-    } else {
-        fd = fdopen(SSL_get_wfd(node->ssl), "w");    
-    }
+        if ((bytes_read = imap_recv(node, in->data + in->len, in->cap - in->len, ssl)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Error occured. */
+            logger_push(worker->log, LOG_ERR, "Failed to receive data: %s.", strerror(errno));
+            imap_drop_client(worker, node);
+            return;
+        /* Somebody disconnected */
+        } else if (bytes_read == 0) {
+            /* Not a failure, the session stays in the resumption cache */
+            if (node->ssl != NULL) {
+                SSL_set_shutdown(node->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+            }
+            imap_drop_client(worker, node);
+            logger_push(worker->log, LOG_INFO, "Connection closed.");
+            return;
+        }
 
-    fflush(fd);
+        in->len += bytes_read;
+        metrics_add(&worker->metrics.bytes_in, bytes_read);
+
+        if (imap_run(worker, node) < 0) {
+            return;
+        }
+    }
+}
+
+/* Credentials checked by the auth pool, resume whoever waits for them */
+static void imap_auth_done(imap_worker *worker)
+{
+    auth_req *reqs[64];
+    client_t *node;
+    ssize_t n;
+
+    /* Writes are whole pointers, so are reads */
+    while ((n = read(worker->auth_done[0], reqs, sizeof(reqs))) > 0) {
+        for (size_t i=0; i < n / sizeof(auth_req *); i++) {
+            node = reqs[i]->data;
+            /* The client may have left, and somebody else taken the slot */
+            if (node->socket >= 0 && node->serial == reqs[i]->serial && IMAP_PARKED(node)) {
+                imap_login_done(node, node->ssl != NULL, reqs[i]->user, reqs[i]->result);
+                imap_serve(worker, node);
+            }
+            auth_req_free(reqs[i]);
+        }
+    }
+}
+
+/* Searches run by the search pool, answer whoever is still there */
+static void imap_search_done(imap_worker *worker)
+{
+    search_req *reqs[64];
+    client_t *node;
+    ssize_t n;
+
+    while ((n = read(worker->search_done[0], reqs, sizeof(reqs))) > 0) {
+        for (size_t i=0; i < n / sizeof(search_req *); i++) {
+            node = reqs[i]->data;
+            if (node->socket >= 0 && node->serial == reqs[i]->serial && node->cont == IMAP_CONT_SEARCH) {
+                imap_search_finish(node, node->ssl != NULL, reqs[i]);
+                /* May drop it, imap_dispatch then skips its events left in the batch */
+                imap_serve(worker, node);
+            } else {
+                search_req_free(reqs[i]);
+            }
+        }
+    }
+}
+
+/* Batches synced by the commit thread, answer the commands waiting on them */
+static void imap_commit_done(imap_worker *worker)
+{
+    commit_req *reqs[64];
+    client_t *node;
+    uint32_t serial;
+    ssize_t n;
+    int failed;
+
+    while ((n = read(worker->commit_done[0], reqs, sizeof(reqs))) > 0) {
+        for (size_t i=0; i < n / sizeof(commit_req *); i++) {
+            node = reqs[i]->data;
+            serial = reqs[i]->serial;
+            failed = reqs[i]->failed;
+            commit_req_free(reqs[i]);
+            if (node->socket >= 0 && node->serial == serial && node->cont == IMAP_CONT_COMMIT) {
+                imap_commit_finish(node, node->ssl != NULL, failed);
+                /* May drop it, imap_dispatch then skips its events left in the batch */
+                imap_serve(worker, node);
+            }
+        }
+    }
+}
+
+/*-
+ * Data received for node on the ring, read by the commands straight
+ * from the provided buffer. What they don't take, node being parked
+ * or behind on its output, is copied to rx before the buffer goes
+ * back, and receiving pauses until rx is read.
+ */
+static void imap_ring_recv(imap_worker *worker, client_t *node, const uring_cqe *c)
+{
+    buf_t *rx = &node->rx;
+    uint32_t serial = node->serial;
+
+    if (!(c->flags & URING_MORE)) {
+        node->ring &= ~IMAP_RING_RECV;
+    }
+
+    if (c->res > 0) {
+        node->rx_view = uring_data(worker->ring, c);
+        node->rx_len = c->res;
+    } else if (c->res == 0) {
+        node->ring |= IMAP_RING_EOF;
+    } else if (c->res == -EIO && node->ssl != NULL) {
+        /* A TLS record other than data, OpenSSL has to read it */
+        imap_ring_detach(worker, node, 1);
+        return;
+    } else if (c->res == -ENOBUFS || c->res == -ECANCELED) {
+        /* Out of buffers for a moment, or paused by imap_ring_recv */
+        imap_ring_recv_arm(node);
+        return;
+    } else {
+        node->rx_err = -c->res;
+    }
+
+    imap_serve(worker, node);
+    if (node->socket < 0 || node->serial != serial) {
+        return;
+    }
+
+    if (node->rx_len > 0) {
+        if (buf_reserve(rx, node->rx_len, IMAP_IN_MAX) < 0) {
+            node->rx_view = NULL;
+            node->rx_len = 0;
+            imap_write(node, node->ssl != NULL, "* BYE Command too long\r\n");
+            logger_push(worker->log, LOG_ERR, "Input buffer exhausted.");
+            imap_shutdown(worker, node);
+            return;
+        }
+        memcpy(rx->data + rx->len, node->rx_view, node->rx_len);
+        rx->len += node->rx_len;
+        if ((node->ring & IMAP_RING_RECV) && !(node->ring & IMAP_RING_HOLD)) {
+            uring_cancel(worker->ring, IMAP_RING_DATA(IMAP_OP_RECV, node));
+        }
+        node->ring |= IMAP_RING_HOLD;
+    }
+    node->rx_view = NULL;
+    node->rx_len = 0;
+    imap_ring_recv_arm(node);
+}
+
+/* A send of node->out completed, imap_flush picks up the outcome */
+static void imap_ring_sent(imap_worker *worker, client_t *node, int32_t res)
+{
+    buf_unpin(&node->out);
+    node->ring &= ~IMAP_RING_SEND;
+    /* Nothing sent is no progress either */
+    node->sent = res != 0 ? res : -EPIPE;
+    imap_serve(worker, node);
+}
+
+/* Is a completion for the current user of the slot, with flag still set */
+static int imap_ring_live(client_t *node, uint64_t data, uint8_t flag)
+{
+    return node->socket >= 0 && node->serial == (uint32_t) data && (node->ring & flag);
+}
+
+int imap_idle_start(client_t *node)
+{
+    imap_worker *worker = node->worker;
+    imap_watch *w = NULL, *grown;
+    size_t i;
+
+    for (i=0; i < worker->nwatches; i++) {
+        if (!strcmp(worker->watches[i].path, node->mbox->box->path)) {
+            w = &worker->watches[i];
+            break;
+        }
+    }
+
+    /* First one to idle there, reuse an entry or make room for one */
+    if (w == NULL) {
+        for (i=0; i < worker->nwatches && worker->watches[i].path[0] != '\0'; i++);
+        if (i == worker->nwatches) {
+            grown = realloc(worker->watches, (worker->nwatches + 1) * sizeof(imap_watch));
+            if (grown == NULL) {
+                return -1;
+            }
+            worker->watches = grown;
+            worker->nwatches++;
+            worker->watches[i].path[0] = '\0';
+        }
+        w = &worker->watches[i];
+        if ((w->nwds = store_watch(worker->inotify, node->mbox->box->path, w->wds)) < 0) {
+            return -1;
+        }
+        snprintf(w->path, sizeof(w->path), "%s", node->mbox->box->path);
+        w->dirty = 0;
+        w->idlers = NULL;
+    }
+
+    node->watch = i;
+    node->idle_prev = NULL;
+    if ((node->idle_next = w->idlers) != NULL) {
+        w->idlers->idle_prev = node;
+    }
+    w->idlers = node;
+
+    return 0;
+}
+
+void imap_idle_stop(client_t *node)
+{
+    imap_worker *worker = node->worker;
+    imap_watch *w;
+
+    if (node->watch < 0) {
+        return;
+    }
+    w = &worker->watches[node->watch];
+
+    if (node->idle_prev != NULL) {
+        node->idle_prev->idle_next = node->idle_next;
+    } else {
+        w->idlers = node->idle_next;
+    }
+    if (node->idle_next != NULL) {
+        node->idle_next->idle_prev = node->idle_prev;
+    }
+    node->watch = -1;
+
+    /* Nobody left to tell, stop watching */
+    if (w->idlers == NULL) {
+        for (int i=0; i < w->nwds; i++) {
+            inotify_rm_watch(worker->inotify, w->wds[i]);
+        }
+        w->path[0] = '\0';
+    }
+}
+
+/*-
+ * Something changed in watched mailboxes. Events are collected first
+ * so a burst of them costs a single rescan, then every client idling
+ * on a mailbox that changed is told about it.
+ */
+static void imap_idle_notify(imap_worker *worker)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    client_t *node, *next;
+    imap_watch *w;
+    uint8_t all = 0;
+    ssize_t n;
+    int pending;
+
+    while ((n = read(worker->inotify, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) p;
+            /* Events were lost, anything may have changed */
+            if (ev->mask & IN_Q_OVERFLOW) {
+                all = 1;
+                continue;
+            }
+            for (size_t i=0; i < worker->nwatches; i++) {
+                w = &worker->watches[i];
+                for (int j=0; w->path[0] != '\0' && j < w->nwds; j++) {
+                    if (w->wds[j] == ev->wd) {
+                        w->dirty = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    for (size_t i=0; i < worker->nwatches; i++) {
+        w = &worker->watches[i];
+        if (w->path[0] == '\0' || !(w->dirty || all)) {
+            continue;
+        }
+        w->dirty = 0;
+        /* A client dropped below unlinks itself, the entry may go with it */
+        for (node = w->idlers; node != NULL; node = next) {
+            next = node->idle_next;
+            imap_rescan(node, node->ssl != NULL);
+            if ((pending = imap_flush(node, node->ssl != NULL)) < 0 || node->conn == IMAP_CONN_ERROR) {
+                /* Its own events, if still in the batch, are skipped by imap_dispatch */
+                imap_drop_client(worker, node);
+            }
+        }
+    }
+}
+
+/* The pause imap_accept took is over, try the queue again */
+static void imap_accept_retry(imap_worker *worker)
+{
+    uint64_t expired;
+
+    if (read(worker->accept_retry, &expired, sizeof(expired)) == sizeof(expired)) {
+        imap_accept(worker);
+    }
+}
+
+/*-
+ * Hand ready events to whoever they are for, -1 once told to stop.
+ * Handlers earlier in the batch may have dropped a client that still
+ * has an event further down: its slot is free (socket -1) and must
+ * not be served, that would free it a second time.
+ */
+static int imap_dispatch(imap_worker *worker, ev_event *events, int n)
+{
+    client_t *node;
+
+    /* Ready events map straight to their connection. */
+    for (int i=0; i < n; i++) {
+        if (events[i].data == NULL) {
+            imap_accept(worker);
+        } else if (events[i].data == worker->imap) {
+            return -1;
+        } else if (events[i].data == worker->auth_done) {
+            imap_auth_done(worker);
+        } else if (events[i].data == worker->search_done) {
+            imap_search_done(worker);
+        } else if (events[i].data == worker->commit_done) {
+            imap_commit_done(worker);
+        } else if (events[i].data == &worker->inotify) {
+            imap_idle_notify(worker);
+        } else if (events[i].data == &worker->accept_retry) {
+            imap_accept_retry(worker);
+        } else if ((node = events[i].data)->socket >= 0) {
+            imap_serve(worker, node);
+        }
+    }
+
+    return 0;
+}
+
+/*-
+ * Loop of a worker with a ring. Client sockets and the listener
+ * complete on it, so does the event loop, still watching the pipes,
+ * inotify and the clients OpenSSL reads itself. A single system call
+ * submits the sends and receives queued while serving a batch and
+ * waits for the next one.
+ */
+static void imap_ring_run(imap_worker *worker)
+{
+    uring_cqe cqes[EVENTS_MAX];
+    ev_event events[EVENTS_MAX];
+    client_t *node;
+    uring_cqe *c;
+    int n, ready;
+
+    for (;;) {
+        if ((n = uring_wait(worker->ring, cqes, EVENTS_MAX)) < 0) {
+            if (errno != EINTR) {
+                perror("io_uring_enter");
+            }
+            continue;
+        }
+
+        for (int i=0; i < n; i++) {
+            c = &cqes[i];
+            node = &worker->clients[IMAP_RING_SLOT(c->data)];
+            switch (IMAP_RING_OP(c->data)) {
+                case IMAP_OP_EV:
+                    do {
+                        ready = ev_wait(worker->ev, events, EVENTS_MAX, 0);
+                        if (ready > 0 && imap_dispatch(worker, events, ready) < 0) {
+                            return;
+                        }
+                    } while (ready == EVENTS_MAX);
+                    if (!(c->flags & URING_MORE)) {
+                        uring_poll(worker->ring, ev_fd(worker->ev), POLLIN, 1, c->data);
+                    }
+                    break;
+                case IMAP_OP_ACCEPT:
+                    if (c->res >= 0) {
+                        imap_accepted(worker, c->res);
+                    }
+                    if (c->flags & URING_MORE) {
+                        break;
+                    }
+                    /* Out of descriptors or such, the event loop takes the listener back */
+                    if ((c->res < 0 && c->res != -ECONNABORTED && c->res != -EINTR)
+                            || uring_accept(worker->ring, worker->socket, c->data) < 0) {
+                        logger_push(worker->log, LOG_ERR, "Accepting on the ring failed, back to %s.", ev_backend());
+                        ev_add(worker->ev, worker->socket, EV_READ, NULL);
+                        imap_accept(worker);
+                    }
+                    break;
+                case IMAP_OP_RECV:
+                    if (imap_ring_live(node, c->data, IMAP_RING_ON)) {
+                        imap_ring_recv(worker, node, c);
+                    }
+                    break;
+                case IMAP_OP_SEND:
+                    if (imap_ring_live(node, c->data, IMAP_RING_SEND)) {
+                        imap_ring_sent(worker, node, c->res);
+                    }
+                    break;
+                case IMAP_OP_POLL:
+                    if (imap_ring_live(node, c->data, IMAP_RING_POLL)) {
+                        node->ring &= ~IMAP_RING_POLL;
+                        imap_serve(worker, node);
+                    }
+                    break;
+            }
+            /* Stale or not, whatever buffer it holds goes back */
+            uring_release(worker->ring, c);
+        }
+    }
+}
+
+static void *imap_worker_run(void *arg)
+{
+    imap_worker *worker = (imap_worker *) arg;
+    ev_event events[EVENTS_MAX];
+    int n;
+
+    /* Here, only the thread that made a ring may submit to it */
+    if (worker->imap->uring
+            && (worker->ring = uring_new(URING_ENTRIES, URING_BUFS, URING_BUF_SIZE)) == NULL) {
+        logger_push(worker->log, LOG_WARNING, "Failed to set up io_uring, worker uses %s.", ev_backend());
+    }
+
+    if (imap_set_nonblock(worker->socket) < 0
+            || (worker->ring == NULL && ev_add(worker->ev, worker->socket, EV_READ, NULL) < 0)
+            || ev_add(worker->ev, worker->imap->wake[0], EV_READ, worker->imap) < 0
+            || ev_add(worker->ev, worker->auth_done[0], EV_READ, worker->auth_done) < 0
+            || ev_add(worker->ev, worker->search_done[0], EV_READ, worker->search_done) < 0
+            || ev_add(worker->ev, worker->commit_done[0], EV_READ, worker->commit_done) < 0
+            || ev_add(worker->ev, worker->inotify, EV_READ, &worker->inotify) < 0
+            || ev_add(worker->ev, worker->accept_retry, EV_READ, &worker->accept_retry) < 0) {
+        perror("ev_add");
+        return NULL;
+    }
+
+    listen(worker->socket, BACKLOG);
+
+    if (worker->ring != NULL) {
+        if (uring_accept(worker->ring, worker->socket, (uint64_t) IMAP_OP_ACCEPT << 56) < 0
+                || uring_poll(worker->ring, ev_fd(worker->ev), POLLIN, 1, (uint64_t) IMAP_OP_EV << 56) < 0) {
+            perror("io_uring");
+            return NULL;
+        }
+        imap_ring_run(worker);
+        return NULL;
+    }
+
+    for (;;) {
+        if ((n = ev_wait(worker->ev, events, EVENTS_MAX, -1)) < 0) {
+            if (errno != EINTR) {
+                perror("ev_wait");
+            }
+            continue;
+        }
+
+        if (imap_dispatch(worker, events, n) < 0) {
+            return NULL;
+        }
+    }
+}
+
+void imap_start(imap_t *instance)
+{
+    sigset_t set, old;
+    metrics_t **sets;
+    uring *probe;
+    int sig;
+
+    /* Only this thread handles termination, workers never see signals. */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    /* First in and last out, everybody else may log */
+    if (logger_start() < 0) {
+        syslog(LOG_ERR, "Failed to start the logger, workers log synchronously.");
+    }
+    if (auth_start() < 0) {
+        logger_push(NULL, LOG_ERR, "Failed to start the auth pool, logins will fail.");
+    }
+    if (search_start() < 0) {
+        logger_push(NULL, LOG_ERR, "Failed to start the search pool, searches run inline.");
+    }
+    if (commit_start() < 0) {
+        logger_push(NULL, LOG_ERR, "Failed to start the commit thread, changes sync inline.");
+    }
+
+    /* The workers make their own rings, see if the kernel can first */
+    if (ev_fd(instance->workers[0].ev) >= 0
+            && (probe = uring_new(URING_ENTRIES, URING_BUFS, URING_BUF_SIZE)) != NULL) {
+        uring_free(probe);
+        instance->uring = 1;
+    }
+
+    for (size_t i=0; i < instance->nworkers; i++) {
+        if (pthread_create(&instance->workers[i].thread, NULL,
+                    imap_worker_run, &instance->workers[i]) != 0) {
+            perror("pthread_create");
+            instance->nworkers = i;
+            break;
+        }
+    }
+
+    /* Counters of the workers that could start */
+    if (ADMIN_SOCKET[0] != '\0' && (sets = calloc(instance->nworkers + 1, sizeof(metrics_t *))) != NULL) {
+        for (size_t i=0; i < instance->nworkers; i++) {
+            sets[i] = &instance->workers[i].metrics;
+        }
+        if (metrics_start(ADMIN_SOCKET, sets, instance->nworkers) < 0) {
+            logger_push(NULL, LOG_ERR, "Failed to open the admin socket %s.", ADMIN_SOCKET);
+        }
+        free(sets);
+    }
+
+    logger_push(NULL, LOG_INFO, "Listening on %d (%zu workers, %s).",
+            TLS_ENABLED ? IMAPS_PORT : IMAP_PORT, instance->nworkers,
+            instance->uring ? "io_uring" : ev_backend());
+
+    if (instance->nworkers > 0) {
+        sigwait(&set, &sig);
+    }
+
+    /* Wake every worker up and wait for them to leave their loop. */
+    write(instance->wake[1], "", 1);
+    for (size_t i=0; i < instance->nworkers; i++) {
+        pthread_join(instance->workers[i].thread, NULL);
+    }
+    /* Checks still running end up in the auth_done pipes */
+    auth_stop();
+    search_stop();
+    commit_stop();
+    metrics_stop();
+    logger_stop();
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void imap_worker_close(imap_t *instance, imap_worker *worker)
+{
+    client_t *node;
+    auth_req *req;
+    search_req *sreq;
+    commit_req *creq;
+
+    for (size_t i=0; worker->clients != NULL && i < worker->max_clients; i++) {
+        node = &worker->clients[i];
+        if (node->socket < 0) {
+            continue;
+        }
+        if (node->ssl != NULL && node->conn == IMAP_CONN_ESTABLISHED) {
+            SSL_shutdown(node->ssl);
+        }
+        imap_remove_client(worker, node);
+    }
+    free(worker->clients);
+    free(worker->chunk);
+    buf_free(&worker->scratch);
+
+    /* Answers nobody is waiting for anymore */
+    if (worker->auth_done[0] >= 0) {
+        while (read(worker->auth_done[0], &req, sizeof(req)) == sizeof(req)) {
+            auth_req_free(req);
+        }
+        close(worker->auth_done[0]);
+        close(worker->auth_done[1]);
+    }
+    if (worker->search_done[0] >= 0) {
+        while (read(worker->search_done[0], &sreq, sizeof(sreq)) == sizeof(sreq)) {
+            search_req_free(sreq);
+        }
+        close(worker->search_done[0]);
+        close(worker->search_done[1]);
+    }
+    if (worker->commit_done[0] >= 0) {
+        while (read(worker->commit_done[0], &creq, sizeof(creq)) == sizeof(creq)) {
+            commit_req_free(creq);
+        }
+        close(worker->commit_done[0]);
+        close(worker->commit_done[1]);
+    }
+    free(worker->watches);
+    free(worker->job);
+    logger_ring_free(worker->log);
+    if (worker->inotify >= 0) {
+        close(worker->inotify);
+    }
+    if (worker->accept_retry >= 0) {
+        close(worker->accept_retry);
+    }
+
+    /* Requests of the clients were cancelled as they were removed */
+    if (worker->ring != NULL) {
+        uring_free(worker->ring);
+    }
+    if (worker->ev != NULL) {
+        ev_free(worker->ev);
+    }
+    if (worker->socket >= 0) {
+        close(worker->socket);
+    }
+}
+
+void imap_close(imap_t *instance)
+{
+    for (size_t i=0; i < instance->nworkers; i++) {
+        imap_worker_close(instance, &instance->workers[i]);
+    }
+    free(instance->workers);
+
+    close(instance->wake[0]);
+    close(instance->wake[1]);
+    if (instance->ssl_ctx != NULL) {
+        SSL_CTX_free(instance->ssl_ctx);
+        tls_cleanup();
+    }
+    free(instance);
+}
+
+uint8_t imap_match_cmd(const char *cmd, size_t len)
+{
+    uint64_t w[2] = { 0, 0 };
+    unsigned char c;
+
+    if (len == 0 || len > 16) {
+        return 0xff;
+    }
+
+    /* Fold case and pack in one pass, names are letters only */
+    for (size_t i=0; i < len; i++) {
+        c = cmd[i] | 0x20;
+        if (c < 'a' || c > 'z') {
+            return 0xff;
+        }
+        w[i >> 3] |= (uint64_t) c << ((i & 7) * 8);
+    }
+
+    return imap_cmd_lookup(len, w[0], w[1]);
+}
+
+/* Skip "{n}CRLF" or "{n+}CRLF" at s and the n bytes after it */
+static char *imap_tok_literal(char *s, char *end, imap_tok *tok)
+{
+    size_t n = 0;
+
+    for (s++; s < end && *s >= '0' && *s <= '9'; s++) {
+        n = n * 10 + (*s - '0');
+        if (n > LITERAL_MAX_SIZE) {
+            return NULL;
+        }
+    }
+    if (s < end && *s == '+') {
+        s++;
+    }
+    if (s >= end || *s++ != '}') {
+        return NULL;
+    }
+    if (s < end && *s == '\r') {
+        s++;
+    }
+    if (s >= end || *s++ != '\n' || (size_t) (end - s) < n) {
+        return NULL;
+    }
+
+    tok->p = s;
+    tok->len = n;
+    tok->type = IMAP_TOK_LITERAL;
+
+    return s + n;
+}
+
+ssize_t imap_tokenize(char *s, size_t len, imap_tok *toks, size_t max)
+{
+    char *end = s + len, *w;
+    size_t count = 0;
+    int depth;
+
+    for (;;) {
+        while (s < end && *s == ' ') {
+            s++;
+        }
+        if (s >= end) {
+            return count;
+        }
+        if (count == max) {
+            return -1;
+        }
+
+        imap_tok *tok = &toks[count++];
+        switch (*s) {
+            case '"':
+                /* Unescaped in place, the span shrinks accordingly */
+                tok->type = IMAP_TOK_QUOTED;
+                tok->p = w = ++s;
+                for (; s < end && *s != '"'; s++) {
+                    if (*s == '\\' && s + 1 < end) {
+                        s++;
+                    }
+                    *w++ = *s;
+                }
+                if (s >= end) {
+                    return -1;
+                }
+                tok->len = w - tok->p;
+                s++;
+                break;
+            case '{':
+                if ((s = imap_tok_literal(s, end, tok)) == NULL) {
+                    return -1;
+                }
+                break;
+            case '(':
+                /* Kept whole, nested items are tokenized on demand */
+                tok->type = IMAP_TOK_LIST;
+                tok->p = ++s;
+                for (depth = 1; s < end && depth > 0; s++) {
+                    if (*s == '(') {
+                        depth++;
+                    } else if (*s == ')') {
+                        depth--;
+                    } else if (*s == '"') {
+                        for (s++; s < end && *s != '"'; s++) {
+                            if (*s == '\\') {
+                                s++;
+                            }
+                        }
+                    } else if (*s == '{') {
+                        imap_tok lit;
+                        if ((s = imap_tok_literal(s, end, &lit)) == NULL) {
+                            return -1;
+                        }
+                        s--;
+                    }
+                }
+                if (depth > 0) {
+                    return -1;
+                }
+                tok->len = s - 1 - tok->p;
+                break;
+            case ')':
+                return -1;
+            default:
+                /* Atoms may carry sections, BODY[HEADER.FIELDS (TO)] */
+                tok->type = IMAP_TOK_ATOM;
+                tok->p = s;
+                for (depth = 0; s < end && (depth > 0 || (*s != ' ' && *s != '(' && *s != ')')); s++) {
+                    if (*s == '[') {
+                        depth++;
+                    } else if (*s == ']' && depth > 0) {
+                        depth--;
+                    }
+                }
+                tok->len = s - tok->p;
+                break;
+        }
+    }
+}
+
+imap_cmd imap_parse_cmd(char *s, size_t len, imap_tok *toks, size_t max)
+{
+    imap_cmd cmd;
+    char *end = s + len, *name;
+    ssize_t count;
+
+    cmd.id = 0xff;
+    cmd.p_count = 0;
+    cmd.params = toks;
+    cmd.tag.p = "*";
+    cmd.tag.len = 1;
+    cmd.tag.type = IMAP_TOK_ATOM;
+
+    /* tag SP command [SP arguments] */
+    for (name = s; name < end && *name != ' '; name++);
+    if (name == s || name >= end || name - s > IMAP_TAG_MAX) {
+        return cmd;
+    }
+    cmd.tag.p = s;
+    cmd.tag.len = name - s;
+
+    for (s = ++name; s < end && *s != ' '; s++);
+    if (s == name) {
+        return cmd;
+    }
+
+    if ((count = imap_tokenize(s, end - s, toks, max)) < 0) {
+        return cmd;
+    }
+
+    cmd.id = imap_match_cmd(name, s - name);
+    cmd.p_count = count;
+
+    return cmd;
+}
+
+#include <imap.routines>
+
+uint8_t imap_cmd_exec(imap_cmd cmd, client_t *node, uint8_t ssl, uint8_t state)
+{
+    /* Generated along with the ids, see imap.commands */
+    static void *routines[] = {
+        IMAP_CMD_LABELS
+    };
+
+    if (cmd.id >= IMAP_CMD_COUNT) {
+        imap_write(node, ssl, "%.*s BAD Invalid command\r\n", (int) cmd.tag.len, cmd.tag.p);
+        IMAP_ROUTINE_END
+        return IMAP_FAIL;
+    }
+
+    goto *routines[cmd.id];
+    IMAP_CMD_ROUTINES
+
+    return IMAP_SUCCESS;
+}
+
+uint8_t imap_cont_exec(char *line, size_t len, client_t *node, uint8_t ssl, uint8_t state)
+{
+    switch (node->cont) {
+        case IMAP_CONT_AUTH:
+            return imap_routine_auth_cont(line, len, node, ssl, state);
+        case IMAP_CONT_IDLE:
+            return imap_routine_idle_done(line, len, node, ssl, state);
+        default:
+            node->cont = IMAP_CONT_NONE;
+            return IMAP_FAIL;
+    }
+}
+
+void imap_create_ssl_ctx(imap_t *imap)
+{
+    const SSL_METHOD *method;
+
+    method = TLS_server_method();
+    imap->ssl_ctx = SSL_CTX_new(method);
+    if (!imap->ssl_ctx) {
+        perror("Unable to create SSL context");
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    if (SSL_CTX_use_certificate_file(imap->ssl_ctx, "ca-cert.pem", SSL_FILETYPE_PEM) <= 0) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(imap->ssl_ctx, "ca-key.pem", SSL_FILETYPE_PEM) <= 0 ) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    if (tls_setup(imap->ssl_ctx) < 0) {
+        perror("Unable to set up TLS session resumption");
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+
+    /* imap_flush writes what it can and compacts the buffer in between */
+    SSL_CTX_set_mode(imap->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#if KTLS_ENABLED && defined(SSL_OP_ENABLE_KTLS)
+    /* Only taken up if the tls module is loaded and the cipher is known */
+    SSL_CTX_set_options(imap->ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+int imap_read(client_t *node, char *buffer, size_t len, uint8_t ssl)
+{
+    int n;
+
+    /* Left over from the ring by a kTLS client handed back to OpenSSL too */
+    if ((node->ring & IMAP_RING_ON) || buf_used(&node->rx) > 0) {
+        return imap_ring_read(node, buffer, len);
+    }
+
+    if (!ssl) {
+        return read(node->socket, buffer, len);
+    }
+
+    if ((n = SSL_read(node->ssl, buffer, len)) > 0) {
+        return n;
+    }
+
+    /* Map TLS conditions onto read(2) semantics. */
+    switch (SSL_get_error(node->ssl, n)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            errno = EIO;
+            return -1;
+    }
+}
+
+void imap_write(client_t *node, uint8_t ssl, char *fmt, ...)
+{
+    buf_t *out = &node->out;
+    va_list(args);
+    int n;
+
+    /* Nothing will ever be sent, don't bother formatting */
+    if (node->conn == IMAP_CONN_ERROR) {
+        return;
+    }
+
+    for (;;) {
+        va_start(args, fmt);
+        n = vsnprintf(out->data + out->len, out->cap - out->len, fmt, args);
+        va_end(args);
+
+        if (n < 0) {
+            return;
+        }
+        if ((size_t) n < out->cap - out->len) {
+            break;
+        }
+        /* Room for the NUL vsnprintf insists on writing */
+        if (buf_reserve(out, n + 1, IMAP_OUT_MAX) < 0) {
+            logger_push(node->worker->log, LOG_ERR, "Output buffer exhausted.");
+            node->conn = IMAP_CONN_ERROR;
+            return;
+        }
+    }
+
+    out->len += n;
+    if (node->nsegs > 0) {
+        node->out_tail += n;
+    }
+    if (buf_used(out) >= IMAP_OUT_HIGH) {
+        imap_flush(node, ssl);
+    }
+}
+
+void imap_write_raw(client_t *node, uint8_t ssl, const char *data, size_t len)
+{
+    buf_t *out = &node->out;
+    size_t n;
+
+    if (node->conn == IMAP_CONN_ERROR) {
+        return;
+    }
+
+    /* A piece at a time, the buffer stays small if the socket keeps up */
+    for (; len > 0; data += n, len -= n) {
+        n = len < IMAP_OUT_HIGH ? len : IMAP_OUT_HIGH;
+        if (buf_reserve(out, n, IMAP_OUT_MAX) < 0) {
+            logger_push(node->worker->log, LOG_ERR, "Output buffer exhausted.");
+            node->conn = IMAP_CONN_ERROR;
+            return;
+        }
+
+        memcpy(out->data + out->len, data, n);
+        out->len += n;
+        if (node->nsegs > 0) {
+            node->out_tail += n;
+        }
+        if (buf_used(out) >= IMAP_OUT_HIGH) {
+            imap_flush(node, ssl);
+        }
+    }
+}
+
+int imap_write_file(client_t *node, int fd, off_t off, size_t len)
+{
+    imap_seg *seg;
+
+    if (node->nsegs == IMAP_SEG_MAX) {
+        return -1;
+    }
+
+    seg = &node->segs[node->nsegs];
+    if ((seg->fd = dup(fd)) < 0) {
+        return -1;
+    }
+    seg->off = off;
+    seg->len = len;
+    seg->before = node->nsegs > 0 ? node->out_tail : buf_used(&node->out);
+    node->out_tail = 0;
+    node->nsegs++;
+
+    return 0;
+}
+
+/* TLS conditions mapped onto errno */
+static ssize_t imap_ssl_error(client_t *node, int n)
+{
+    switch (SSL_get_error(node->ssl, n)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            break;
+        default:
+            errno = EIO;
+            break;
+    }
+
+    return -1;
+}
+
+/* write(2) or SSL_write */
+static ssize_t imap_send_raw(client_t *node, uint8_t ssl, const char *data, size_t len)
+{
+    ssize_t sent;
+    int n;
+
+    /* The outcome of a send through the ring, or one still in flight */
+    if ((sent = node->sent) != 0) {
+        node->sent = 0;
+        if (sent < 0) {
+            errno = -sent;
+            return -1;
+        }
+        return sent;
+    }
+    if (node->ring & IMAP_RING_SEND) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if ((node->ring & IMAP_RING_ON) && node->z == NULL) {
+        return imap_ring_send(node, data, len);
+    }
+
+    if (!ssl) {
+        return write(node->socket, data, len);
+    }
+
+    if ((n = SSL_write(node->ssl, data, len)) > 0) {
+        return n;
+    }
+
+    return imap_ssl_error(node, n);
+}
+
+/* Write out what deflate produced so far, -1 if it didn't all go */
+static int imap_zdrain(client_t *node, uint8_t ssl)
+{
+    compress_t *z = node->z;
+    ssize_t n;
+
+    while (z->pend_len > 0) {
+        if ((n = imap_send_raw(node, ssl, z->pend + z->pend_off, z->pend_len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        compress_consume(z, n);
+    }
+
+    return 0;
+}
+
+/* End of a batch, the peer gets everything deflated up to here */
+static int imap_zflush(client_t *node, uint8_t ssl)
+{
+    int more;
+
+    do {
+        more = compress_sync(node->z);
+        if (imap_zdrain(node, ssl) < 0) {
+            return -1;
+        }
+    } while (more);
+
+    return 0;
+}
+
+/*-
+ * Bytes of a response, deflated first once COMPRESS is active. The
+ * compressed stream is only written when pend fills up or the batch
+ * is flushed by imap_zflush.
+ */
+static ssize_t imap_send(client_t *node, uint8_t ssl, const char *data, size_t len)
+{
+    size_t n;
+
+    if (node->z == NULL) {
+        return imap_send_raw(node, ssl, data, len);
+    }
+
+    while ((n = compress_deflate(node->z, data, len)) == 0) {
+        if (imap_zdrain(node, ssl) < 0) {
+            return -1;
+        }
+    }
+
+    return n;
+}
+
+/*-
+ * Next piece of the file at the head of the queue. Without TLS, or
+ * with the kernel doing it, pages go from the page cache to the
+ * socket with sendfile(2). Otherwise they take a trip through the
+ * chunk buffer of the worker to be encrypted by SSL_write.
+ */
+static ssize_t imap_send_file(client_t *node, uint8_t ssl, imap_seg *seg)
+{
+    off_t off = seg->off;
+    ssize_t n;
+
+    if (!ssl && node->z == NULL) {
+        n = sendfile(node->socket, seg->fd, &off, seg->len);
+#ifndef OPENSSL_NO_KTLS
+    } else if (node->ktls && node->z == NULL) {
+        if ((n = SSL_sendfile(node->ssl, seg->fd, seg->off, seg->len, 0)) < 0) {
+            return imap_ssl_error(node, n);
+        }
+#endif
+    } else {
+        /* A partial write reads the rest again, files don't change */
+        n = pread(seg->fd, node->worker->chunk, seg->len < IMAP_CHUNK ? seg->len : IMAP_CHUNK, seg->off);
+        if (n > 0) {
+            return imap_send(node, ssl, node->worker->chunk, n);
+        }
+    }
+
+    /* The file shrank under us, the literal can't be completed */
+    if (n == 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    return n;
+}
+
+int imap_flush(client_t *node, uint8_t ssl)
+{
+    buf_t *out = &node->out;
+    imap_seg *seg = NULL;
+    size_t avail;
+    ssize_t n;
+
+    /* Responses to a batch of pipelined commands leave together */
+    if (node->corked && buf_used(out) < IMAP_OUT_HIGH) {
+        return IMAP_PENDING(node);
+    }
+
+    for (;;) {
+        /* Buffered bytes up to the next file, then the file itself */
+        avail = node->nsegs > 0 ? node->segs[0].before : buf_used(out);
+
+        if (avail > 0) {
+            n = imap_send(node, ssl, out->data + out->off, avail);
+        } else if (node->nsegs == 0) {
+            if (node->z == NULL || imap_zflush(node, ssl) == 0) {
+                break;
+            }
+            n = -1;
+        } else if ((seg = &node->segs[0])->len == 0) {
+            close(seg->fd);
+            memmove(node->segs, node->segs + 1, --node->nsegs * sizeof(imap_seg));
+            continue;
+        } else {
+            n = imap_send_file(node, ssl, seg);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* Resumed by imap_serve once the socket is writable */
+                imap_want(node->worker, node, EV_READ | EV_WRITE);
+                /* Not so for a send the ring took */
+                if (!(node->ring & IMAP_RING_SEND)) {
+                    metrics_add(&node->worker->metrics.blocked, 1);
+                }
+                imap_backlog(node, buf_used(out));
+                return 1;
+            }
+            node->conn = IMAP_CONN_ERROR;
+            imap_backlog(node, 0);
+            return -1;
+        }
+
+        metrics_add(&node->worker->metrics.bytes_out, n);
+        if (avail > 0) {
+            buf_consume(out, n);
+            if (node->nsegs > 0) {
+                node->segs[0].before -= n;
+            }
+        } else {
+            seg->off += n;
+            seg->len -= n;
+        }
+    }
+
+    imap_want(node->worker, node, EV_READ);
+    imap_backlog(node, 0);
+    return 0;
 }
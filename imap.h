@@ -30,11 +30,21 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/types.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <ev.h>
+#include <buf.h>
+#include <auth.h>
+#include <compress.h>
+#include <store.h>
+#include <metrics.h>
 
-#define BACKLOG 4
+#define BACKLOG SOMAXCONN
+/* Events handled per loop wakeup. */
+#define EVENTS_MAX 256
 #define IMAP_SUCCESS 0x0
 #define IMAP_FAIL 0x1
 #define IMAP_LOGOUT 0x2
@@ -44,56 +54,266 @@
 #define IMAP_STATE_AUTH 0x1
 #define IMAP_STATE_SELECTED 0x2
 
-typedef struct _client_list {
-    int32_t socket, fd;
+/* Transport state of a connection */
+#define IMAP_CONN_HANDSHAKE 0x0
+#define IMAP_CONN_ESTABLISHED 0x1
+#define IMAP_CONN_SHUTDOWN 0x2
+/* Unrecoverable I/O error, dropped as soon as possible */
+#define IMAP_CONN_ERROR 0x3
+
+/* What the next line from the client answers to */
+#define IMAP_CONT_NONE 0x0
+#define IMAP_CONT_AUTH 0x1
+/* IDLE until DONE */
+#define IMAP_CONT_IDLE 0x2
+/* Parked until the auth pool has checked LOGIN or AUTHENTICATE */
+#define IMAP_CONT_LOGIN 0x3
+#define IMAP_CONT_PLAIN 0x4
+/* COMPRESS accepted, compression starts once the OK is out */
+#define IMAP_CONT_COMPRESS 0x5
+/* FETCH or STORE halfway through its set, waiting for the socket */
+#define IMAP_CONT_JOB 0x6
+/* SEARCH handed to the search pool */
+#define IMAP_CONT_SEARCH 0x7
+/* APPEND, STORE or EXPUNGE done, answered once the commit thread synced it */
+#define IMAP_CONT_COMMIT 0x8
+#define IMAP_PARKED(node) ((node)->cont >= IMAP_CONT_LOGIN)
+
+/* Served by the io_uring of the worker instead of its event loop */
+#define IMAP_RING_ON 0x01
+/* Multishot receive armed, send in flight, waiting for POLLOUT */
+#define IMAP_RING_RECV 0x02
+#define IMAP_RING_SEND 0x04
+#define IMAP_RING_POLL 0x08
+/* The peer closed its side */
+#define IMAP_RING_EOF 0x10
+/* Received data piles up in rx, receiving resumes once it is read */
+#define IMAP_RING_HOLD 0x20
+/* Anything left to write, deflated or not */
+#define IMAP_PENDING(node) (buf_used(&(node)->out) > 0 || (node)->nsegs > 0 \
+        || ((node)->z != NULL && ((node)->z->pend_len > 0 || !(node)->z->synced)))
+
+/* Free room wanted before a read() and the input buffer ceiling */
+#define IMAP_READ_CHUNK 1024
+#define IMAP_IN_MAX (CMD_MAX_SIZE + LITERAL_MAX_SIZE + IMAP_READ_CHUNK)
+/* Output is flushed once this much is pending, about one TLS record */
+#define IMAP_OUT_HIGH 16384
+#define IMAP_OUT_MAX (CMD_MAX_SIZE + LITERAL_MAX_SIZE + IMAP_OUT_HIGH)
+/*-
+ * Message data above IMAP_STREAM_MIN is not copied into the output
+ * buffer, it is read from the file IMAP_CHUNK bytes at a time while
+ * being written. Up to IMAP_SEG_MAX files may be queued that way.
+ * When no userspace encryption is involved (plain text or kernel
+ * TLS) files go out with sendfile(2) and IMAP_SENDFILE_MIN applies.
+ */
+#define IMAP_STREAM_MIN (256 * 1024)
+#define IMAP_SENDFILE_MIN (16 * 1024)
+#define IMAP_CHUNK (64 * 1024)
+#define IMAP_SEG_MAX 8
+
+/* Pause before accept(2) is tried again after failing for lack of descriptors or memory, ms */
+#define IMAP_ACCEPT_RETRY 100
+
+/* Per-connection storage used before spilling to the heap */
+#define IMAP_IN_INLINE 2048
+#define IMAP_OUT_INLINE 4096
+#define IMAP_CACHELINE 64
+
+/* Arguments accepted per command and longest tag */
+#define IMAP_TOK_MAX 64
+#define IMAP_TAG_MAX 32
+
+/* Token kinds, quoted strings are unescaped in place */
+#define IMAP_TOK_ATOM 0x0
+#define IMAP_TOK_QUOTED 0x1
+#define IMAP_TOK_LITERAL 0x2
+/* Parenthesized list, the span excludes the outer parentheses */
+#define IMAP_TOK_LIST 0x3
+
+/* Span inside the input buffer, not NUL terminated */
+typedef struct {
+    char *p;
+    size_t len;
+    uint8_t type;
+} imap_tok;
+
+struct imap_worker;
+struct imap_job;
+
+/* Part of a file sent after before more bytes of the output buffer */
+typedef struct {
+    int fd;
+    off_t off;
+    size_t len, before;
+} imap_seg;
+
+/*-
+ * Connection slot, preallocated in the table of its worker. The
+ * first cache line holds what every event looks at, small commands
+ * and responses fit in the inline buffers and never hit the heap.
+ */
+typedef struct client {
+    int32_t socket;
+    uint8_t state, conn, events, cont, corked, ktls, ring;
     SSL *ssl;
-    struct _client_list *next;
-    struct _client_list *prev;
-} client_list;
+    struct imap_worker *worker;
+    /* Framer position inside in */
+    size_t scan, line, literal;
+    /* Raw input and responses not written yet */
+    buf_t in, out;
+    /* Next free slot, -1 ends the list */
+    int32_t next_free;
+    /* Tells a new client from the previous user of the slot */
+    uint32_t serial;
+    /* Tag of the command waiting for a continuation */
+    size_t cont_tag_len;
+    char cont_tag[IMAP_TAG_MAX];
+    /* Files queued behind out, out_tail bytes follow the last one */
+    imap_seg segs[IMAP_SEG_MAX];
+    uint8_t nsegs;
+    size_t out_tail;
+    /* Output stuck behind the socket, counted in the backlog of the worker */
+    size_t backlog;
+    /* Start of the TLS handshake, ns */
+    uint64_t since;
+    /* Both directions once COMPRESS DEFLATE is active */
+    compress_t *z;
+    /*-
+     * On the ring: the buffer a receive completion landed in and what
+     * of it is left, rx what the commands didn't take yet. sent is the
+     * result of the last send, 0 until it completes.
+     */
+    const char *rx_view;
+    size_t rx_len;
+    buf_t rx;
+    int32_t sent;
+    int rx_err;
+    /* Entry of worker->watches while idling, -1 otherwise */
+    int32_t watch;
+    struct client *idle_next, *idle_prev;
+    /* Taken from the worker while parked in IMAP_CONT_JOB, SEARCH or COMMIT */
+    struct imap_job *job;
+    /* Set once authenticated, mbox while in IMAP_STATE_SELECTED */
+    char user[AUTH_USER_MAX];
+    mailbox *mbox;
+    char ibuf[IMAP_IN_INLINE];
+    char obuf[IMAP_OUT_INLINE];
+} __attribute__((aligned(IMAP_CACHELINE))) client_t;
 
-typedef struct _trie_node {
-    struct _trie_node *children[26];
-    uint8_t id;
-} trie_node;
+/*-
+ * A mailbox somebody idles on, the clients doing it are chained
+ * from idlers. Unused entries have an empty path.
+ */
+typedef struct {
+    char path[STORE_PATH_MAX];
+    int wds[STORE_WATCH_MAX];
+    int nwds;
+    uint8_t dirty;
+    client_t *idlers;
+} imap_watch;
 
-typedef struct imap {
+/*-
+ * Every worker owns a listening socket bound with SO_REUSEPORT,
+ * an event loop and its clients. Nothing in here is touched by
+ * other threads.
+ */
+typedef struct imap_worker {
     int32_t socket;
-    client_list *clients;
+    /* max_clients slots, free ones are chained from free_slot */
+    client_t *clients;
+    size_t nclients, max_clients;
+    int32_t free_slot;
+    ev_loop *ev;
+    /* Takes over the sockets from ev when imap->uring is set, see imap_ring_run */
+    struct uring *ring;
+    pthread_t thread;
+    struct imap *imap;
+    /* Arguments of the command being executed */
+    imap_tok toks[IMAP_TOK_MAX];
+    /* Reads of streamed files and responses built before sending */
+    char *chunk;
+    buf_t scratch;
+    /* The auth and search pools and the commit thread hand requests back through these */
+    int auth_done[2];
+    int search_done[2];
+    int commit_done[2];
+    uint32_t serial;
+    /* inotify instance for the mailboxes of idling clients */
+    int inotify;
+    /* timerfd, armed while connections wait in the accept queue, see imap_accept */
+    int accept_retry;
+    uint8_t accept_paused;
+    imap_watch *watches;
+    size_t nwatches;
+    /* Kept for the next FETCH or STORE, made on first use */
+    struct imap_job *job;
+    /* Read by the admin socket thread, see metrics.h */
+    metrics_t metrics;
+    /* Messages for the logger thread */
+    struct logger_ring *log;
+} imap_worker;
+
+/* Shared by all workers, read-only once imap_start is called. */
+typedef struct imap {
     struct sockaddr_in addr;
-    uint8_t state, ssl;
+    uint8_t ssl;
+    /* The kernel supports what uring.c needs, workers make a ring each */
+    uint8_t uring;
     SSL_CTX *ssl_ctx;
+    size_t nworkers;
+    imap_worker *workers;
+    int wake[2];
 } imap_t;
 
 typedef struct {
-    char tag[4];
+    imap_tok tag;
     uint8_t id;
     size_t p_count;
-    char **params;
+    imap_tok *params;
 } imap_cmd;
 
 /* Create a new imap_t instance and initialize the server. */
 uint8_t imap_init(uint8_t daemon, imap_t *instance);
-/* Start the IMAP server. */
+/* Start the workers, returns on SIGINT or SIGTERM. */
 void imap_start(imap_t *instance);
 /* Close all connections and free the allocated memory. */
 void imap_close(imap_t *instance);
 /* Add client to client list */
-client_list *imap_add_client(imap_t *instance, client_list *list, int sock);
-/* Close connection with client */
-client_list *imap_remove_client(imap_t *instance, client_list *list, client_list *node);
-client_list *imap_remove_sock(imap_t *instance, client_list *list, int sock);
-/* Get the higher file descriptor in the client list */
-int imap_get_max_fd(client_list *list, int master);
-imap_cmd imap_parse_cmd(char *s);
-uint8_t imap_match_cmd(char *cmd, size_t len);
+client_t *imap_add_client(imap_worker *worker, int sock);
+/* Close connection with client and give its slot back */
+void imap_remove_client(imap_worker *worker, client_t *node);
+/*-
+ * Split s in place into at most max tokens, returns how many were
+ * found or -1 if s is malformed or has too many of them.
+ */
+ssize_t imap_tokenize(char *s, size_t len, imap_tok *toks, size_t max);
+/* Parse a framed command, arguments are stored in toks. */
+imap_cmd imap_parse_cmd(char *s, size_t len, imap_tok *toks, size_t max);
+/* Command id of the name cmd, 0xff if unknown, see imap.commands */
+uint8_t imap_match_cmd(const char *cmd, size_t len);
 void imap_create_ssl_ctx(imap_t *imap);
-void imap_starttls(imap_t *imap, client_list *list);
-int imap_read(client_list *node, char *buf, size_t len, uint8_t ssl);
-void imap_write(client_list *node, uint8_t ssl, char *fmt, ...);
-void imap_flush(client_list *node, uint8_t ssl);
-uint8_t imap_cmd_exec(imap_cmd cmd, client_list *node, uint8_t ssl, uint8_t state);
-void imap_trie_populate(void);
-void imap_trie_encode(char *str, uint8_t cmd);
-void imap_trie_free(trie_node *node);
+/* Report changes to the selected mailbox of node until imap_idle_stop */
+int imap_idle_start(client_t *node);
+void imap_idle_stop(client_t *node);
+/* Attach a TLS session to node and enter IMAP_CONN_HANDSHAKE */
+int imap_starttls(imap_t *imap, client_t *node);
+int imap_read(client_t *node, char *buf, size_t len, uint8_t ssl);
+/* Append a response to the output buffer of node */
+void imap_write(client_t *node, uint8_t ssl, char *fmt, ...);
+/* Append len bytes as they are, literal data */
+void imap_write_raw(client_t *node, uint8_t ssl, const char *data, size_t len);
+/*-
+ * Queue len bytes of fd from off after what was written so far, fd
+ * is duplicated. Returns -1 if too many files are queued already.
+ */
+int imap_write_file(client_t *node, int fd, off_t off, size_t len);
+/*-
+ * Write the output buffer of node at once. Returns 0 once empty, 1 if
+ * the rest waits for EV_WRITE and -1 on error.
+ */
+int imap_flush(client_t *node, uint8_t ssl);
+uint8_t imap_cmd_exec(imap_cmd cmd, client_t *node, uint8_t ssl, uint8_t state);
+/* Hand a line to the command waiting for it, see node->cont */
+uint8_t imap_cont_exec(char *line, size_t len, client_t *node, uint8_t ssl, uint8_t state);
 
 #endif /* ifndef IMAP_H */
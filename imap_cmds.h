@@ -0,0 +1,264 @@
+/* Generated from imap.commands by mkcmds.awk, do not edit. */
+
+#ifndef IMAP_CMDS_H
+#define IMAP_CMDS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define IMAP_CMD_CAPABILITY 0x00
+#define IMAP_CMD_NOOP 0x01
+#define IMAP_CMD_LOGOUT 0x02
+#define IMAP_CMD_STARTTLS 0x03
+#define IMAP_CMD_AUTHENTICATE 0x04
+#define IMAP_CMD_LOGIN 0x05
+#define IMAP_CMD_ENABLE 0x06
+#define IMAP_CMD_SELECT 0x07
+#define IMAP_CMD_EXAMINE 0x08
+#define IMAP_CMD_CREATE 0x09
+#define IMAP_CMD_DELETE 0x0a
+#define IMAP_CMD_RENAME 0x0b
+#define IMAP_CMD_SUBSCRIBE 0x0c
+#define IMAP_CMD_UNSUBSCRIBE 0x0d
+#define IMAP_CMD_LIST 0x0e
+#define IMAP_CMD_LSUB 0x0f
+#define IMAP_CMD_NAMESPACE 0x10
+#define IMAP_CMD_STATUS 0x11
+#define IMAP_CMD_APPEND 0x12
+#define IMAP_CMD_IDLE 0x13
+#define IMAP_CMD_CHECK 0x14
+#define IMAP_CMD_CLOSE 0x15
+#define IMAP_CMD_UNSELECT 0x16
+#define IMAP_CMD_EXPUNGE 0x17
+#define IMAP_CMD_SEARCH 0x18
+#define IMAP_CMD_FETCH 0x19
+#define IMAP_CMD_STORE 0x1a
+#define IMAP_CMD_COPY 0x1b
+#define IMAP_CMD_MOVE 0x1c
+#define IMAP_CMD_UID 0x1d
+#define IMAP_CMD_COMPRESS 0x1e
+#define IMAP_CMD_COUNT 31
+
+/* Labels of imap_cmd_exec, indexed by command id */
+#define IMAP_CMD_LABELS \
+    &&cmd_capability, \
+    &&cmd_noop, \
+    &&cmd_logout, \
+    &&cmd_starttls, \
+    &&cmd_authenticate, \
+    &&cmd_login, \
+    &&cmd_enable, \
+    &&cmd_select, \
+    &&cmd_examine, \
+    &&cmd_create, \
+    &&cmd_delete, \
+    &&cmd_rename, \
+    &&cmd_subscribe, \
+    &&cmd_unsubscribe, \
+    &&cmd_list, \
+    &&cmd_lsub, \
+    &&cmd_namespace, \
+    &&cmd_status, \
+    &&cmd_append, \
+    &&cmd_idle, \
+    &&cmd_check, \
+    &&cmd_close, \
+    &&cmd_unselect, \
+    &&cmd_expunge, \
+    &&cmd_search, \
+    &&cmd_fetch, \
+    &&cmd_store, \
+    &&cmd_copy, \
+    &&cmd_move, \
+    &&cmd_uid, \
+    &&cmd_compress
+
+/* Names, lowercase, indexed by command id */
+#define IMAP_CMD_NAMES \
+    "capability", \
+    "noop", \
+    "logout", \
+    "starttls", \
+    "authenticate", \
+    "login", \
+    "enable", \
+    "select", \
+    "examine", \
+    "create", \
+    "delete", \
+    "rename", \
+    "subscribe", \
+    "unsubscribe", \
+    "list", \
+    "lsub", \
+    "namespace", \
+    "status", \
+    "append", \
+    "idle", \
+    "check", \
+    "close", \
+    "unselect", \
+    "expunge", \
+    "search", \
+    "fetch", \
+    "store", \
+    "copy", \
+    "move", \
+    "uid", \
+    "compress"
+
+#define IMAP_CMD_ROUTINES \
+    IMAP_ROUTINE(cmd_capability, capability) \
+    IMAP_ROUTINE(cmd_noop, noop) \
+    IMAP_ROUTINE(cmd_logout, logout) \
+    IMAP_ROUTINE(cmd_starttls, starttls) \
+    IMAP_ROUTINE(cmd_authenticate, auth) \
+    IMAP_ROUTINE(cmd_login, login) \
+    IMAP_ROUTINE(cmd_enable, unimpl) \
+    IMAP_ROUTINE(cmd_select, select) \
+    IMAP_ROUTINE(cmd_examine, examine) \
+    IMAP_ROUTINE(cmd_create, create) \
+    IMAP_ROUTINE(cmd_delete, unimpl) \
+    IMAP_ROUTINE(cmd_rename, unimpl) \
+    IMAP_ROUTINE(cmd_subscribe, unimpl) \
+    IMAP_ROUTINE(cmd_unsubscribe, unimpl) \
+    IMAP_ROUTINE(cmd_list, list) \
+    IMAP_ROUTINE(cmd_lsub, lsub) \
+    IMAP_ROUTINE(cmd_namespace, unimpl) \
+    IMAP_ROUTINE(cmd_status, unimpl) \
+    IMAP_ROUTINE(cmd_append, append) \
+    IMAP_ROUTINE(cmd_idle, idle) \
+    IMAP_ROUTINE(cmd_check, check) \
+    IMAP_ROUTINE(cmd_close, close) \
+    IMAP_ROUTINE(cmd_unselect, unselect) \
+    IMAP_ROUTINE(cmd_expunge, expunge) \
+    IMAP_ROUTINE(cmd_search, search) \
+    IMAP_ROUTINE(cmd_fetch, fetch) \
+    IMAP_ROUTINE(cmd_store, store) \
+    IMAP_ROUTINE(cmd_copy, copy) \
+    IMAP_ROUTINE(cmd_move, unimpl) \
+    IMAP_ROUTINE(cmd_uid, uid) \
+    IMAP_ROUTINE(cmd_compress, compress)
+
+static inline uint8_t imap_cmd_lookup(size_t len, uint64_t lo, uint64_t hi)
+{
+    switch (len) {
+        case 3:
+            if (lo == 0x0000000000646975ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_UID;
+            }
+            break;
+        case 4:
+            if (lo == 0x00000000706f6f6eULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_NOOP;
+            }
+            if (lo == 0x000000007473696cULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_LIST;
+            }
+            if (lo == 0x000000006275736cULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_LSUB;
+            }
+            if (lo == 0x00000000656c6469ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_IDLE;
+            }
+            if (lo == 0x0000000079706f63ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_COPY;
+            }
+            if (lo == 0x0000000065766f6dULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_MOVE;
+            }
+            break;
+        case 5:
+            if (lo == 0x0000006e69676f6cULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_LOGIN;
+            }
+            if (lo == 0x0000006b63656863ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_CHECK;
+            }
+            if (lo == 0x00000065736f6c63ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_CLOSE;
+            }
+            if (lo == 0x0000006863746566ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_FETCH;
+            }
+            if (lo == 0x00000065726f7473ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_STORE;
+            }
+            break;
+        case 6:
+            if (lo == 0x000074756f676f6cULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_LOGOUT;
+            }
+            if (lo == 0x0000656c62616e65ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_ENABLE;
+            }
+            if (lo == 0x00007463656c6573ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_SELECT;
+            }
+            if (lo == 0x0000657461657263ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_CREATE;
+            }
+            if (lo == 0x00006574656c6564ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_DELETE;
+            }
+            if (lo == 0x0000656d616e6572ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_RENAME;
+            }
+            if (lo == 0x0000737574617473ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_STATUS;
+            }
+            if (lo == 0x0000646e65707061ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_APPEND;
+            }
+            if (lo == 0x0000686372616573ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_SEARCH;
+            }
+            break;
+        case 7:
+            if (lo == 0x00656e696d617865ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_EXAMINE;
+            }
+            if (lo == 0x0065676e75707865ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_EXPUNGE;
+            }
+            break;
+        case 8:
+            if (lo == 0x736c747472617473ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_STARTTLS;
+            }
+            if (lo == 0x7463656c65736e75ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_UNSELECT;
+            }
+            if (lo == 0x73736572706d6f63ULL && hi == 0x0000000000000000ULL) {
+                return IMAP_CMD_COMPRESS;
+            }
+            break;
+        case 9:
+            if (lo == 0x6269726373627573ULL && hi == 0x0000000000000065ULL) {
+                return IMAP_CMD_SUBSCRIBE;
+            }
+            if (lo == 0x63617073656d616eULL && hi == 0x0000000000000065ULL) {
+                return IMAP_CMD_NAMESPACE;
+            }
+            break;
+        case 10:
+            if (lo == 0x696c696261706163ULL && hi == 0x0000000000007974ULL) {
+                return IMAP_CMD_CAPABILITY;
+            }
+            break;
+        case 11:
+            if (lo == 0x7263736275736e75ULL && hi == 0x0000000000656269ULL) {
+                return IMAP_CMD_UNSUBSCRIBE;
+            }
+            break;
+        case 12:
+            if (lo == 0x69746e6568747561ULL && hi == 0x0000000065746163ULL) {
+                return IMAP_CMD_AUTHENTICATE;
+            }
+            break;
+    }
+
+    return 0xff;
+}
+
+#endif /* ifndef IMAP_CMDS_H */
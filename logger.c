@@ -0,0 +1,259 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <config.h>
+#include <logger.h>
+
+/* How often the rings are emptied, ms */
+#define LOGGER_PERIOD 100
+
+#ifdef CLOCK_REALTIME_COARSE
+#define LOGGER_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define LOGGER_CLOCK CLOCK_REALTIME
+#endif
+
+static pthread_mutex_t logger_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logger_cond = PTHREAD_COND_INITIALIZER;
+static logger_ring *logger_rings = NULL;
+static unsigned logger_nrings = 0;
+static int logger_stopping = 0;
+/* Set before the workers start and cleared once they are gone */
+static int logger_running = 0;
+static pthread_t logger_thread_id;
+static FILE *logger_file = NULL;
+
+static const char *logger_level(int prio)
+{
+    static const char *names[] = {
+        "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+    };
+
+    return names[LOG_PRI(prio)];
+}
+
+static void logger_write(unsigned id, int64_t t, int prio, const char *msg)
+{
+    struct tm tm;
+    time_t now = t;
+    char stamp[32];
+
+    if (logger_file == NULL) {
+        syslog(prio, "%s", msg);
+        return;
+    }
+
+    gmtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    /* One call per line, stdio keeps lines of other threads apart */
+    fprintf(logger_file, "%s %u %s %s\n", stamp, id, logger_level(prio), msg);
+}
+
+/* Write out everything r holds, with logger_lock held */
+static void logger_drain(logger_ring *r)
+{
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    uint64_t dropped;
+    logger_rec *rec;
+
+    while (r->head != tail) {
+        rec = &r->recs[r->head & (LOG_RING - 1)];
+        logger_write(r->id, rec->time, rec->prio, rec->msg);
+        /* The slot may be reused from here on */
+        __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+    }
+
+    if ((dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED)) != r->reported) {
+        char msg[64];
+        struct timespec ts;
+
+        clock_gettime(LOGGER_CLOCK, &ts);
+        snprintf(msg, sizeof(msg), "Dropped %llu log records.",
+                (unsigned long long) (dropped - r->reported));
+        logger_write(r->id, ts.tv_sec, LOG_WARNING, msg);
+        r->reported = dropped;
+    }
+}
+
+static void logger_drain_all(void)
+{
+    for (logger_ring *r = logger_rings; r != NULL; r = r->next) {
+        logger_drain(r);
+    }
+    if (logger_file != NULL) {
+        fflush(logger_file);
+    }
+}
+
+/*-
+ * Pushing never makes a system call, so nothing wakes this thread up:
+ * it looks at the rings every LOGGER_PERIOD ms.
+ */
+static void *logger_thread(void *arg)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&logger_lock);
+    while (!logger_stopping) {
+        logger_drain_all();
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOGGER_PERIOD * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&logger_cond, &logger_lock, &ts);
+    }
+    logger_drain_all();
+    pthread_mutex_unlock(&logger_lock);
+
+    return NULL;
+}
+
+int logger_start(void)
+{
+    if (LOG_FILE[0] != '\0' && (logger_file = fopen(LOG_FILE, "a")) == NULL) {
+        return -1;
+    }
+
+    logger_stopping = 0;
+    if (pthread_create(&logger_thread_id, NULL, logger_thread, NULL) != 0) {
+        if (logger_file != NULL) {
+            fclose(logger_file);
+            logger_file = NULL;
+        }
+        return -1;
+    }
+    logger_running = 1;
+
+    return 0;
+}
+
+void logger_stop(void)
+{
+    if (!logger_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&logger_lock);
+    logger_stopping = 1;
+    pthread_cond_signal(&logger_cond);
+    pthread_mutex_unlock(&logger_lock);
+
+    pthread_join(logger_thread_id, NULL);
+    logger_running = 0;
+
+    if (logger_file != NULL) {
+        fclose(logger_file);
+        logger_file = NULL;
+    }
+}
+
+logger_ring *logger_ring_new(void)
+{
+    logger_ring *r;
+
+    if (posix_memalign((void **) &r, 64, sizeof(logger_ring) + LOG_RING * sizeof(logger_rec)) != 0) {
+        return NULL;
+    }
+    memset(r, 0, sizeof(logger_ring));
+
+    pthread_mutex_lock(&logger_lock);
+    r->id = ++logger_nrings;
+    r->next = logger_rings;
+    logger_rings = r;
+    pthread_mutex_unlock(&logger_lock);
+
+    return r;
+}
+
+void logger_ring_free(logger_ring *r)
+{
+    logger_ring **p;
+
+    if (r == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&logger_lock);
+    for (p = &logger_rings; *p != NULL; p = &(*p)->next) {
+        if (*p == r) {
+            *p = r->next;
+            break;
+        }
+    }
+    logger_drain(r);
+    pthread_mutex_unlock(&logger_lock);
+
+    free(r);
+}
+
+void logger_push(logger_ring *r, int prio, const char *fmt, ...)
+{
+    struct timespec ts;
+    logger_rec *rec;
+    char msg[LOGGER_MSG_MAX];
+    va_list args;
+
+    clock_gettime(LOGGER_CLOCK, &ts);
+
+    if (r == NULL || !logger_running) {
+        va_start(args, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, args);
+        va_end(args);
+        logger_write(r != NULL ? r->id : 0, ts.tv_sec, prio, msg);
+        return;
+    }
+
+    if (ts.tv_sec != r->second) {
+        r->second = ts.tv_sec;
+        r->burst = 0;
+    }
+    /* Full, or over the rate: counted and left for the logger thread to report */
+    if (r->burst >= LOG_RATE || r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= LOG_RING) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    r->burst++;
+
+    rec = &r->recs[r->tail & (LOG_RING - 1)];
+    rec->time = ts.tv_sec;
+    rec->prio = prio;
+    va_start(args, fmt);
+    vsnprintf(rec->msg, sizeof(rec->msg), fmt, args);
+    va_end(args);
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
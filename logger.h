@@ -0,0 +1,82 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longest message, longer ones are cut */
+#define LOGGER_MSG_MAX 200
+
+typedef struct {
+    /* Wall clock, seconds */
+    int64_t time;
+    int prio;
+    char msg[LOGGER_MSG_MAX];
+} logger_rec;
+
+/*-
+ * Records of one thread waiting for the logger thread, which writes
+ * them to syslog or LOG_FILE. The owner only moves tail and the
+ * logger thread head, neither ever waits for the other: a record that
+ * finds the ring full, or comes past LOG_RATE in a second, is dropped
+ * and counted, the logger thread reports the drops.
+ */
+typedef struct logger_ring {
+    uint32_t tail __attribute__((aligned(64)));
+    /* Rate limiting, second of the last record and records in it */
+    int64_t second;
+    uint32_t burst;
+    uint64_t dropped;
+    uint32_t head __attribute__((aligned(64)));
+    /* Drops already reported, by the logger thread */
+    uint64_t reported;
+    /* In LOG_FILE, 0 is for messages logged without a ring */
+    unsigned id;
+    struct logger_ring *next;
+    logger_rec recs[];
+} logger_ring;
+
+/* Start the logger thread, -1 on failure */
+int logger_start(void);
+/* Write out what the rings hold and stop the thread */
+void logger_stop(void);
+/* A ring for the calling thread to push to, NULL on failure */
+logger_ring *logger_ring_new(void);
+/* Write out what r holds and free it, r may be NULL */
+void logger_ring_free(logger_ring *r);
+
+/*-
+ * Queue a syslog(3) style message, never blocks. Without a ring, or
+ * a logger thread, the message is written out right away: for threads
+ * off the hot path, and before logger_start or after logger_stop.
+ */
+void logger_push(logger_ring *r, int prio, const char *fmt, ...);
+
+#endif /* ifndef LOGGER_H */
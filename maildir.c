@@ -0,0 +1,2016 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <config.h>
+#include <utils.h>
+#include <store.h>
+#include <search.h>
+#include <mime.h>
+
+/*-
+ * Maildir backend. Every message is a file named "unique:2,FLAGS"
+ * under cur/, new deliveries land in new/ and are moved over by the
+ * first session that selects the mailbox. Folders other than INBOX
+ * follow Maildir++, they are ".Name" directories inside the root.
+ */
+
+static const struct {
+    char c;
+    uint8_t flag;
+} maildir_flag_chars[] = {
+    /* Sorted, the info part must list them in ASCII order */
+    { 'D', STORE_DRAFT },
+    { 'F', STORE_FLAGGED },
+    { 'R', STORE_ANSWERED },
+    { 'S', STORE_SEEN },
+    { 'T', STORE_DELETED },
+};
+
+#define MAILDIR_NFLAGS (sizeof(maildir_flag_chars) / sizeof(maildir_flag_chars[0]))
+
+/*-
+ * Every mailbox has an index next to its messages: a header with
+ * UIDVALIDITY and UIDNEXT, one fixed-size record per message and
+ * the packed file names. Changes are appended to a log instead of
+ * rewriting it, the log is folded into a new index generation by a
+ * background thread once it grows past MAILDIR_LOG_MAX. The log is
+ * also the lock, it is flock()ed around every change.
+ */
+#define MAILDIR_INDEX "sis.index"
+#define MAILDIR_LOG "sis.log"
+#define MAILDIR_MAGIC "SISIDX1"
+#define MAILDIR_LOG_MAGIC "SISLOG1"
+#define MAILDIR_LOG_MAX (256 * 1024)
+/* Mailboxes waiting for compaction */
+#define MAILDIR_QUEUE_MAX 16
+
+#define MAILDIR_LOG_APPEND 0x1
+#define MAILDIR_LOG_FLAGS 0x2
+#define MAILDIR_LOG_EXPUNGE 0x3
+
+typedef struct {
+    char magic[8];
+    uint32_t uidvalidity, uidnext;
+    uint32_t gen, pad;
+    uint64_t count, names_len;
+    /* Modification time of cur/ once our own changes were made */
+    int64_t cur_sec, cur_nsec;
+    uint8_t reserved[8];
+} maildir_hdr;
+
+typedef struct {
+    uint32_t uid;
+    uint8_t flags, pad[3];
+    int64_t date;
+    uint64_t size;
+    uint32_t name, pad2;
+} maildir_rec;
+
+typedef struct {
+    char magic[8];
+    uint32_t gen, pad;
+} maildir_loghdr;
+
+/* Followed by the NUL terminated file name, padded to 8 bytes */
+typedef struct {
+    uint32_t len;
+    uint8_t op, flags;
+    uint16_t pad;
+    uint32_t uid, pad2;
+    /* Who made the change, it skips its own ones on replay */
+    uint64_t session;
+    int64_t date;
+    uint64_t size;
+} maildir_logrec;
+
+static pthread_mutex_t maildir_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maildir_queue_cond = PTHREAD_COND_INITIALIZER;
+static char maildir_queue[MAILDIR_QUEUE_MAX][STORE_PATH_MAX];
+static size_t maildir_queued = 0;
+
+static void maildir_compact_later(const char *path);
+static void maildir_detach(store_box *box);
+
+/* Sort key of a file name, the unique part without "cur/" and info */
+static int maildir_basecmp(const char *a, const char *b)
+{
+    a += 4;
+    b += 4;
+    for (; *a == *b && *a != '\0' && *a != ':'; a++, b++);
+
+    if ((*a == ':' || *a == '\0') && (*b == ':' || *b == '\0')) {
+        return 0;
+    }
+    return (*a == ':' ? 0 : (unsigned char) *a) - (*b == ':' ? 0 : (unsigned char) *b);
+}
+
+static uint8_t maildir_flags(const char *name)
+{
+    uint8_t flags = 0;
+
+    if ((name = strstr(name, ":2,")) == NULL) {
+        return 0;
+    }
+    for (name += 3; *name; name++) {
+        for (size_t i=0; i < MAILDIR_NFLAGS; i++) {
+            if (*name == maildir_flag_chars[i].c) {
+                flags |= maildir_flag_chars[i].flag;
+            }
+        }
+    }
+
+    return flags;
+}
+
+/* Info part for flags, keeping the letters we don't know of old */
+static void maildir_info(char *dst, uint8_t flags, const char *old)
+{
+    char *p = dst;
+    char c;
+
+    if (old != NULL && (old = strstr(old, ":2,")) != NULL) {
+        for (old += 3; *old; old++) {
+            size_t i;
+            for (i=0; i < MAILDIR_NFLAGS && *old != maildir_flag_chars[i].c; i++);
+            if (i == MAILDIR_NFLAGS && p - dst < 26) {
+                *p++ = *old;
+            }
+        }
+    }
+    for (size_t i=0; i < MAILDIR_NFLAGS; i++) {
+        if (flags & maildir_flag_chars[i].flag) {
+            *p++ = maildir_flag_chars[i].c;
+        }
+    }
+    *p = '\0';
+
+    /* A handful of letters, insertion sort is plenty */
+    for (char *i = dst + 1; i < p; i++) {
+        c = *i;
+        char *j = i;
+        for (; j > dst && j[-1] > c; j--) {
+            j[0] = j[-1];
+        }
+        *j = c;
+    }
+}
+
+/* A name unique across hosts, processes and threads */
+static void maildir_unique(char *dst, size_t max)
+{
+    static unsigned int counter = 0;
+    struct timespec ts;
+    char host[64];
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (gethostname(host, sizeof(host)) < 0) {
+        strcpy(host, "localhost");
+    }
+    host[sizeof(host) - 1] = '\0';
+    for (char *h = host; *h; h++) {
+        if (*h == '/' || *h == ':') {
+            *h = '_';
+        }
+    }
+
+    snprintf(dst, max, "%lld.M%06ldP%dQ%u.%s", (long long) ts.tv_sec, ts.tv_nsec / 1000,
+            (int) getpid(), __sync_fetch_and_add(&counter, 1), host);
+}
+
+/* Room for n more bytes of file names */
+static int maildir_reserve(store_box *box, size_t n)
+{
+    size_t cap = box->names_cap ? box->names_cap : 4096;
+    char *names;
+
+    if (box->names_len + n <= box->names_cap) {
+        return 0;
+    }
+    while (cap < box->names_len + n) {
+        cap *= 2;
+    }
+    if (cap > UINT32_MAX || (names = realloc(box->names, cap)) == NULL) {
+        return -1;
+    }
+    box->names = names;
+    box->names_cap = cap;
+
+    return 0;
+}
+
+/* Append a file name to the blob, returns its offset or -1 */
+static ssize_t maildir_name(store_box *box, const char *fmt, ...)
+{
+    va_list args;
+    size_t n;
+    ssize_t off;
+
+    va_start(args, fmt);
+    n = vsnprintf(NULL, 0, fmt, args) + 1;
+    va_end(args);
+
+    if (maildir_reserve(box, n) < 0) {
+        return -1;
+    }
+
+    off = box->names_len;
+    va_start(args, fmt);
+    vsnprintf(box->names + off, n, fmt, args);
+    va_end(args);
+    box->names_len += n;
+
+    return off;
+}
+
+/* Room for n records */
+static int maildir_grow(store_box *box, size_t n)
+{
+    store_msg *msgs;
+    size_t cap;
+
+    if (n <= box->cap) {
+        return 0;
+    }
+    for (cap = box->cap ? box->cap : 256; cap < n; cap *= 2);
+    if ((msgs = realloc(box->msgs, cap * sizeof(store_msg))) == NULL) {
+        return -1;
+    }
+    box->msgs = msgs;
+    box->cap = cap;
+
+    return 0;
+}
+
+static void maildir_set_cur(store_box *box, struct stat *st)
+{
+    box->cur_sec = st->st_mtim.tv_sec;
+    box->cur_nsec = st->st_mtim.tv_nsec;
+}
+
+/* Append a change to the log, nothing to do before the index exists */
+static int maildir_log(store_box *box, uint8_t op, store_msg *m)
+{
+    char buf[sizeof(maildir_logrec) + STORE_PATH_MAX + 8];
+    maildir_logrec *rec = (maildir_logrec *) buf;
+    const char *name = op == MAILDIR_LOG_EXPUNGE ? "" : box->names + m->name;
+    size_t n = strlen(name) + 1;
+
+    if (box->disk_gen == 0) {
+        return 0;
+    }
+    if (n > STORE_PATH_MAX) {
+        return -1;
+    }
+
+    memset(buf, 0, sizeof(maildir_logrec) + ((n + 7) & ~7));
+    rec->len = sizeof(maildir_logrec) + ((n + 7) & ~7);
+    rec->op = op;
+    rec->flags = m->flags & STORE_FLAGS;
+    rec->uid = m->uid;
+    rec->session = box->session;
+    rec->date = m->date;
+    rec->size = m->size;
+    memcpy(buf + sizeof(maildir_logrec), name, n);
+
+    box->dirty = 1;
+    /* O_APPEND and a single write, a crash leaves at most a torn tail */
+    return write(box->log, buf, rec->len) == (ssize_t) rec->len ? 0 : -1;
+}
+
+/*-
+ * Take the mailbox lock and learn what the index header says now,
+ * uidnext included. Locks nest, only the outer one does anything.
+ */
+static int maildir_lock(store_box *box)
+{
+    maildir_hdr h;
+    struct stat st;
+    int fd;
+
+    if (box->locked++ > 0) {
+        return 0;
+    }
+    if (flock(box->log, LOCK_EX) < 0) {
+        box->locked = 0;
+        return -1;
+    }
+
+    box->disk_gen = 0;
+    box->clean = box->dirty = 0;
+    if ((fd = openat(box->dir, MAILDIR_INDEX, O_RDONLY)) >= 0) {
+        if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(h.magic, MAILDIR_MAGIC, 8)) {
+            box->disk_gen = h.gen;
+            box->uidvalidity = h.uidvalidity;
+            box->uidnext = h.uidnext;
+            box->cur_sec = h.cur_sec;
+            box->cur_nsec = h.cur_nsec;
+        }
+        close(fd);
+    }
+
+    /* cur/ as we left it, nobody else renamed or removed anything */
+    box->clean = box->disk_gen != 0 && fstatat(box->dir, "cur", &st, 0) == 0
+        && st.st_mtim.tv_sec == box->cur_sec && st.st_mtim.tv_nsec == box->cur_nsec;
+
+    return 0;
+}
+
+static void maildir_unlock(store_box *box)
+{
+    struct stat st;
+    int fd;
+
+    if (box->locked == 0 || --box->locked > 0) {
+        return;
+    }
+
+    if (box->dirty && box->disk_gen != 0) {
+        /* Our own changes don't count as somebody else's */
+        if (box->clean && fstatat(box->dir, "cur", &st, 0) == 0) {
+            maildir_set_cur(box, &st);
+        }
+        if ((fd = openat(box->dir, MAILDIR_INDEX, O_WRONLY)) >= 0) {
+            pwrite(fd, &box->uidnext, sizeof(uint32_t), offsetof(maildir_hdr, uidnext));
+            pwrite(fd, (int64_t[2]) { box->cur_sec, box->cur_nsec }, 2 * sizeof(int64_t), offsetof(maildir_hdr, cur_sec));
+            close(fd);
+        }
+        if (fstat(box->log, &st) == 0 && st.st_size > MAILDIR_LOG_MAX) {
+            maildir_compact_later(box->path);
+        }
+    }
+
+    flock(box->log, LOCK_UN);
+}
+
+/* Read the index into box, -1 if there is none worth reading */
+static int maildir_load(store_box *box)
+{
+    const maildir_hdr *h;
+    const maildir_rec *rec;
+    struct stat st;
+    char *map;
+    int fd, ret = -1;
+
+    if ((fd = openat(box->dir, MAILDIR_INDEX, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(maildir_hdr)
+            || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    h = (const maildir_hdr *) map;
+    rec = (const maildir_rec *) (map + sizeof(maildir_hdr));
+    if (memcmp(h->magic, MAILDIR_MAGIC, 8) != 0 || h->count > (size_t) st.st_size / sizeof(maildir_rec)
+            || sizeof(maildir_hdr) + h->count * sizeof(maildir_rec) + h->names_len > (size_t) st.st_size
+            || maildir_grow(box, h->count) < 0) {
+        goto out;
+    }
+
+    box->names_len = 0;
+    if (maildir_reserve(box, h->names_len) < 0) {
+        goto out;
+    }
+    memcpy(box->names, rec + h->count, h->names_len);
+    box->names_len = h->names_len;
+
+    for (size_t i=0; i < h->count; i++) {
+        if (rec[i].name >= h->names_len) {
+            goto out;
+        }
+        memset(&box->msgs[i], 0, sizeof(store_msg));
+        box->msgs[i].uid = rec[i].uid;
+        box->msgs[i].flags = rec[i].flags & STORE_FLAGS;
+        box->msgs[i].date = rec[i].date;
+        box->msgs[i].size = rec[i].size;
+        box->msgs[i].name = rec[i].name;
+    }
+    box->count = h->count;
+    box->gone = 0;
+    box->uidvalidity = h->uidvalidity;
+    box->uidnext = h->uidnext;
+    box->gen = h->gen;
+    box->log_off = sizeof(maildir_loghdr);
+    ret = 0;
+
+out:
+    munmap(map, st.st_size);
+    close(fd);
+    return ret;
+}
+
+/* Start the log over for generation gen */
+static int maildir_reset_log(store_box *box, uint32_t gen)
+{
+    maildir_loghdr lh;
+
+    memset(&lh, 0, sizeof(lh));
+    memcpy(lh.magic, MAILDIR_LOG_MAGIC, 8);
+    lh.gen = gen;
+    box->log_off = sizeof(lh);
+
+    return ftruncate(box->log, 0) < 0 || write(box->log, &lh, sizeof(lh)) != sizeof(lh) ? -1 : 0;
+}
+
+/*-
+ * Write everything known about box as a new index generation, then
+ * start an empty log for it. File names are packed on the way.
+ */
+static int maildir_write_index(store_box *box)
+{
+    maildir_hdr h;
+    maildir_rec rec;
+    uint32_t off = 0;
+    FILE *f;
+    int fd;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAILDIR_MAGIC, 8);
+    h.uidvalidity = box->uidvalidity;
+    h.uidnext = box->uidnext;
+    h.gen = (box->disk_gen > box->gen ? box->disk_gen : box->gen) + 1;
+    h.count = box->count - box->gone;
+    h.cur_sec = box->cur_sec;
+    h.cur_nsec = box->cur_nsec;
+    for (size_t i=0; i < box->count; i++) {
+        if (box->msgs[i].flags & STORE_EXPUNGED) {
+            continue;
+        }
+        h.names_len += strlen(box->names + box->msgs[i].name) + 1;
+    }
+
+    if ((fd = openat(box->dir, MAILDIR_INDEX ".tmp", O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        return -1;
+    }
+    if ((f = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    fwrite(&h, sizeof(h), 1, f);
+    memset(&rec, 0, sizeof(rec));
+    for (size_t i=0; i < box->count; i++) {
+        if (box->msgs[i].flags & STORE_EXPUNGED) {
+            continue;
+        }
+        rec.uid = box->msgs[i].uid;
+        rec.flags = box->msgs[i].flags & STORE_FLAGS;
+        rec.date = box->msgs[i].date;
+        rec.size = box->msgs[i].size;
+        rec.name = off;
+        off += strlen(box->names + box->msgs[i].name) + 1;
+        fwrite(&rec, sizeof(rec), 1, f);
+    }
+    for (size_t i=0; i < box->count; i++) {
+        const char *name = box->names + box->msgs[i].name;
+        if (box->msgs[i].flags & STORE_EXPUNGED) {
+            continue;
+        }
+        fwrite(name, strlen(name) + 1, 1, f);
+    }
+
+    if (fflush(f) != 0 || fsync(fd) < 0) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    if (renameat(box->dir, MAILDIR_INDEX ".tmp", box->dir, MAILDIR_INDEX) < 0
+            || maildir_reset_log(box, h.gen) < 0) {
+        return -1;
+    }
+    box->gen = box->disk_gen = h.gen;
+
+    return 0;
+}
+
+/* Index of the first record with a uid not below uid */
+static size_t maildir_lower(store_box *box, uint32_t uid)
+{
+    size_t lo = 0, hi = box->count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (box->msgs[mid].uid < uid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* Position of uid in msgs, -1 if it isn't there (any more) */
+static ssize_t maildir_find(store_box *box, uint32_t uid)
+{
+    size_t i = maildir_lower(box, uid);
+
+    return i < box->count && box->msgs[i].uid == uid
+        && !(box->msgs[i].flags & STORE_EXPUNGED) ? (ssize_t) i : -1;
+}
+
+/* Flags of m were changed by session by, 0 for anybody else */
+static void maildir_changed(store_box *box, store_msg *m, uint32_t by)
+{
+    m->modseq = ++box->modseq;
+    m->by = by;
+}
+
+/*-
+ * Message i is gone. Sessions numbering it keep seeing it until they
+ * are told, maildir_purge drops it after the last one was.
+ */
+static void maildir_gone(store_box *box, size_t i)
+{
+    store_msg *m = &box->msgs[i];
+
+    m->flags |= STORE_EXPUNGED;
+    m->pending = 0;
+    for (mailbox *v = box->views; v != NULL; v = v->next) {
+        m->pending += v->known >= m->uid;
+    }
+    box->gone++;
+}
+
+/*-
+ * Apply the log from box->log_off on. Changes of this box are in it
+ * already and skipped, a torn record at the end is left for later.
+ */
+static int maildir_replay(store_box *box)
+{
+    const maildir_logrec *rec;
+    struct stat st;
+    char *buf;
+    size_t off = 0, len;
+    ssize_t i, name;
+
+    if (fstat(box->log, &st) < 0) {
+        return -1;
+    }
+    if (st.st_size <= box->log_off) {
+        return 0;
+    }
+    len = st.st_size - box->log_off;
+    if ((buf = malloc(len)) == NULL || pread(box->log, buf, len, box->log_off) != (ssize_t) len) {
+        free(buf);
+        return -1;
+    }
+
+    for (; off + sizeof(maildir_logrec) <= len; off += rec->len) {
+        rec = (const maildir_logrec *) (buf + off);
+        if (rec->len < sizeof(maildir_logrec) || rec->len > len - off || buf[off + rec->len - 1] != '\0') {
+            break;
+        }
+        if (box->session != 0 && rec->session == box->session) {
+            continue;
+        }
+
+        i = maildir_find(box, rec->uid);
+        switch (rec->op) {
+            case MAILDIR_LOG_APPEND:
+                /* uids only grow, new messages go at the end */
+                if ((box->count > 0 && rec->uid <= box->msgs[box->count - 1].uid)
+                        || maildir_grow(box, box->count + 1) < 0) {
+                    break;
+                }
+                if ((name = maildir_name(box, "%s", (const char *) (rec + 1))) < 0) {
+                    free(buf);
+                    return -1;
+                }
+                memset(&box->msgs[box->count], 0, sizeof(store_msg));
+                box->msgs[box->count].uid = rec->uid;
+                box->msgs[box->count].flags = rec->flags & STORE_FLAGS;
+                box->msgs[box->count].date = rec->date;
+                box->msgs[box->count].size = rec->size;
+                box->msgs[box->count].name = name;
+                box->count++;
+                if (rec->uid >= box->uidnext) {
+                    box->uidnext = rec->uid + 1;
+                }
+                break;
+            case MAILDIR_LOG_FLAGS:
+                if (i < 0 || (name = maildir_name(box, "%s", (const char *) (rec + 1))) < 0) {
+                    break;
+                }
+                box->msgs[i].name = name;
+                box->msgs[i].flags = (box->msgs[i].flags & ~STORE_FLAGS) | (rec->flags & STORE_FLAGS);
+                maildir_changed(box, &box->msgs[i], 0);
+                break;
+            case MAILDIR_LOG_EXPUNGE:
+                if (i >= 0) {
+                    maildir_gone(box, i);
+                }
+                break;
+        }
+    }
+
+    box->log_off += off;
+    free(buf);
+    return 0;
+}
+
+/* Entries of sub/, sorted, dot files left out */
+typedef struct {
+    char **names;
+    char *blob;
+    size_t count;
+} maildir_dirlist;
+
+static int maildir_strcmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int maildir_readdir(store_box *box, const char *sub, maildir_dirlist *l)
+{
+    size_t len = 0, cap = 0, n;
+    struct dirent *e;
+    char *blob;
+    DIR *d;
+    int fd;
+
+    l->names = NULL;
+    l->blob = NULL;
+    l->count = 0;
+
+    if ((fd = openat(box->dir, sub, O_RDONLY | O_DIRECTORY)) < 0) {
+        return -1;
+    }
+    if ((d = fdopendir(fd)) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        n = strlen(e->d_name) + 1;
+        if (len + n > cap) {
+            for (cap = cap ? cap : 4096; cap < len + n; cap *= 2);
+            if ((blob = realloc(l->blob, cap)) == NULL) {
+                closedir(d);
+                return -1;
+            }
+            l->blob = blob;
+        }
+        memcpy(l->blob + len, e->d_name, n);
+        len += n;
+        l->count++;
+    }
+    closedir(d);
+
+    if (l->count > 0 && (l->names = malloc(l->count * sizeof(char *))) == NULL) {
+        return -1;
+    }
+    for (size_t i=0, off=0; i < l->count; i++) {
+        l->names[i] = l->blob + off;
+        off += strlen(l->names[i]) + 1;
+    }
+    qsort(l->names, l->count, sizeof(char *), maildir_strcmp);
+
+    return 0;
+}
+
+static void maildir_dirlist_free(maildir_dirlist *l)
+{
+    free(l->names);
+    free(l->blob);
+}
+
+typedef struct {
+    const char *key;
+    size_t i;
+} maildir_key;
+
+static int maildir_key_cmp(const void *a, const void *b)
+{
+    return maildir_basecmp(((const maildir_key *) a)->key, ((const maildir_key *) b)->key);
+}
+
+/*-
+ * Messages still there by file name, n of them. They are looked up
+ * in a copy since the blob may move.
+ */
+static maildir_key *maildir_keys(store_box *box, char **copy, size_t *n)
+{
+    maildir_key *keys;
+
+    if ((*copy = malloc(box->names_len + 1)) == NULL) {
+        return NULL;
+    }
+    if ((keys = malloc((box->count + 1) * sizeof(maildir_key))) == NULL) {
+        free(*copy);
+        return NULL;
+    }
+    memcpy(*copy, box->names, box->names_len);
+
+    *n = 0;
+    for (size_t i=0; i < box->count; i++) {
+        if (!(box->msgs[i].flags & STORE_EXPUNGED)) {
+            keys[*n].key = *copy + box->msgs[i].name;
+            keys[(*n)++].i = i;
+        }
+    }
+    qsort(keys, *n, sizeof(maildir_key), maildir_key_cmp);
+
+    return keys;
+}
+
+static ssize_t maildir_lookup(maildir_key *keys, size_t n, const char *name)
+{
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (maildir_basecmp(keys[mid].key, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo < n && maildir_basecmp(keys[lo].key, name) == 0 ? (ssize_t) keys[lo].i : -1;
+}
+
+/*-
+ * A file nobody indexed yet, the only place a message gets stat()ed.
+ * Deliveries are \Recent to the session that took them in.
+ */
+static int maildir_add(store_box *box, const char *name, uint8_t recent)
+{
+    struct stat st;
+    store_msg *m;
+    ssize_t off;
+
+    if (fstatat(box->dir, name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    if (maildir_grow(box, box->count + 1) < 0 || (off = maildir_name(box, "%s", name)) < 0) {
+        return -1;
+    }
+
+    m = &box->msgs[box->count++];
+    memset(m, 0, sizeof(store_msg));
+    m->uid = box->uidnext++;
+    m->name = off;
+    m->flags = maildir_flags(name);
+    m->date = st.st_mtime;
+    m->size = st.st_size;
+    m->recent = recent ? box->claim : 0;
+
+    return maildir_log(box, MAILDIR_LOG_APPEND, m);
+}
+
+/*-
+ * Compare cur/ with the index when somebody else changed it, this is
+ * the only readdir of cur/ and is skipped while it stays untouched.
+ */
+static int maildir_sync_cur(store_box *box)
+{
+    maildir_dirlist l;
+    maildir_key *keys = NULL;
+    struct stat st;
+    size_t count = box->count, nkeys;
+    uint8_t *seen = NULL;
+    char *copy = NULL, path[STORE_PATH_MAX];
+    ssize_t k;
+    int ret = -1;
+
+    /* Taken first, anything changing later is seen next time */
+    if (fstatat(box->dir, "cur", &st, 0) < 0 || maildir_readdir(box, "cur", &l) < 0) {
+        return -1;
+    }
+    if ((keys = maildir_keys(box, &copy, &nkeys)) == NULL || (seen = calloc(count + 1, 1)) == NULL) {
+        goto out;
+    }
+
+    for (size_t n=0; n < l.count; n++) {
+        snprintf(path, sizeof(path), "cur/%s", l.names[n]);
+        if ((k = maildir_lookup(keys, nkeys, path)) < 0) {
+            if (maildir_add(box, path, 0) < 0) {
+                goto out;
+            }
+            continue;
+        }
+
+        seen[k] = 1;
+        if (strcmp(box->names + box->msgs[k].name, path) != 0) {
+            ssize_t off = maildir_name(box, "%s", path);
+            if (off < 0) {
+                goto out;
+            }
+            box->msgs[k].name = off;
+            box->msgs[k].flags = (box->msgs[k].flags & ~STORE_FLAGS) | maildir_flags(path);
+            maildir_changed(box, &box->msgs[k], 0);
+            maildir_log(box, MAILDIR_LOG_FLAGS, &box->msgs[k]);
+        }
+    }
+
+    /* Gone from cur/, new/ ones are looked after by maildir_sync */
+    for (size_t i=0; i < count; i++) {
+        store_msg *m = &box->msgs[i];
+
+        if (seen[i] || (m->flags & STORE_EXPUNGED) || strncmp(box->names + m->name, "new/", 4) == 0) {
+            continue;
+        }
+        maildir_log(box, MAILDIR_LOG_EXPUNGE, m);
+        maildir_gone(box, i);
+    }
+
+    maildir_set_cur(box, &st);
+    box->clean = 0;
+    box->dirty = 1;
+    ret = 0;
+
+out:
+    maildir_dirlist_free(&l);
+    free(keys);
+    free(copy);
+    free(seen);
+    return ret;
+}
+
+/* Bring box up to date with cur/ and take in new deliveries */
+static int maildir_sync(store_box *box)
+{
+    maildir_dirlist l;
+    maildir_key *keys = NULL;
+    char *copy = NULL, path[STORE_PATH_MAX], dst[STORE_PATH_MAX], info[32];
+    size_t nkeys = 0;
+    ssize_t k;
+    int ret = -1;
+
+    if (!box->clean && maildir_sync_cur(box) < 0) {
+        return -1;
+    }
+
+    /* Deliveries, usually none at all */
+    if (maildir_readdir(box, "new", &l) < 0) {
+        return -1;
+    }
+    if (l.count > 0 && (keys = maildir_keys(box, &copy, &nkeys)) == NULL) {
+        goto out;
+    }
+
+    for (size_t n=0; n < l.count; n++) {
+        snprintf(path, sizeof(path), "new/%s", l.names[n]);
+        k = maildir_lookup(keys, nkeys, path);
+
+        /* Left where it is, uids are given out all the same */
+        if (box->readonly) {
+            if (k < 0 && maildir_add(box, path, 1) < 0) {
+                goto out;
+            }
+            continue;
+        }
+
+        maildir_info(info, k >= 0 ? box->msgs[k].flags & STORE_FLAGS : 0, NULL);
+        snprintf(dst, sizeof(dst), "cur/%s:2,%s", l.names[n], info);
+        if (renameat(box->dir, path, box->dir, dst) < 0) {
+            /* Somebody else took it */
+            continue;
+        }
+
+        if (k < 0) {
+            if (maildir_add(box, dst, 1) < 0) {
+                goto out;
+            }
+        } else {
+            ssize_t off = maildir_name(box, "%s", dst);
+            if (off < 0) {
+                goto out;
+            }
+            box->msgs[k].name = off;
+            if (box->msgs[k].recent == 0) {
+                box->msgs[k].recent = box->claim;
+            }
+            maildir_log(box, MAILDIR_LOG_FLAGS, &box->msgs[k]);
+        }
+    }
+    ret = 0;
+
+out:
+    maildir_dirlist_free(&l);
+    free(keys);
+    free(copy);
+    return ret;
+}
+
+/* A handle on the mailbox at path without any message loaded */
+static store_box *maildir_attach(const char *path, uint8_t readonly)
+{
+    static uint32_t sessions = 0;
+    store_box *box;
+
+    if ((box = calloc(1, sizeof(store_box))) == NULL) {
+        return NULL;
+    }
+    snprintf(box->path, sizeof(box->path), "%s", path);
+    box->readonly = readonly;
+    box->uidnext = 1;
+    box->log = -1;
+    box->session = (uint64_t) getpid() << 32 | (__sync_add_and_fetch(&sessions, 1));
+
+    if ((box->dir = open(path, O_RDONLY | O_DIRECTORY)) < 0
+            || (box->log = openat(box->dir, MAILDIR_LOG, O_RDWR | O_CREAT | O_APPEND, 0600)) < 0) {
+        maildir_detach(box);
+        return NULL;
+    }
+
+    return box;
+}
+
+static void maildir_detach(store_box *box)
+{
+    mime_cache_free(box->mime);
+    if (box->log >= 0) {
+        close(box->log);
+    }
+    if (box->dir >= 0) {
+        close(box->dir);
+    }
+    free(box->msgs);
+    free(box->names);
+    free(box);
+}
+
+/* Fold the log of the mailbox at path into a new index */
+static void maildir_compact(const char *path)
+{
+    store_box *box;
+
+    if ((box = maildir_attach(path, 1)) == NULL) {
+        return;
+    }
+    /* Nothing to skip, every change goes in */
+    box->session = 0;
+
+    if (maildir_lock(box) == 0) {
+        if (box->disk_gen != 0 && maildir_load(box) == 0 && maildir_replay(box) == 0) {
+            maildir_write_index(box);
+        }
+        box->dirty = 0;
+        maildir_unlock(box);
+    }
+
+    maildir_detach(box);
+}
+
+static void *maildir_compactor(void *arg)
+{
+    char path[STORE_PATH_MAX];
+
+    for (;;) {
+        pthread_mutex_lock(&maildir_queue_lock);
+        while (maildir_queued == 0) {
+            pthread_cond_wait(&maildir_queue_cond, &maildir_queue_lock);
+        }
+        memcpy(path, maildir_queue[--maildir_queued], sizeof(path));
+        pthread_mutex_unlock(&maildir_queue_lock);
+
+        maildir_compact(path);
+    }
+
+    return NULL;
+}
+
+/* Have the log of path compacted by the background thread */
+static void maildir_compact_later(const char *path)
+{
+    static uint8_t started = 0;
+    pthread_t thread;
+
+    pthread_mutex_lock(&maildir_queue_lock);
+    if (!started) {
+        if (pthread_create(&thread, NULL, maildir_compactor, NULL) != 0) {
+            pthread_mutex_unlock(&maildir_queue_lock);
+            return;
+        }
+        pthread_detach(thread);
+        started = 1;
+    }
+
+    for (size_t i=0; i < maildir_queued; i++) {
+        if (!strcmp(maildir_queue[i], path)) {
+            pthread_mutex_unlock(&maildir_queue_lock);
+            return;
+        }
+    }
+    /* A full queue only delays it, the log keeps growing until then */
+    if (maildir_queued < MAILDIR_QUEUE_MAX) {
+        snprintf(maildir_queue[maildir_queued++], STORE_PATH_MAX, "%s", path);
+        pthread_cond_signal(&maildir_queue_cond);
+    }
+    pthread_mutex_unlock(&maildir_queue_lock);
+}
+
+int store_path(char *dst, size_t max, const char *user, const char *name, size_t len)
+{
+    char root[STORE_PATH_MAX];
+
+    if (snprintf(root, sizeof(root), MAIL_ROOT, user) >= (int) sizeof(root)) {
+        return -1;
+    }
+
+    if (strncaseeq(name, len, "INBOX")) {
+        return snprintf(dst, max, "%s", root) < (int) max ? 0 : -1;
+    }
+
+    /* One directory per folder, nothing that could leave the root */
+    if (len == 0 || name[0] == '.') {
+        return -1;
+    }
+    for (size_t i=0; i < len; i++) {
+        if (name[i] == '/' || (unsigned char) name[i] < ' '
+                || (name[i] == '.' && i + 1 < len && name[i+1] == '.')) {
+            return -1;
+        }
+    }
+
+    return snprintf(dst, max, "%s/.%.*s", root, (int) len, name) < (int) max ? 0 : -1;
+}
+
+int store_exists(const char *path)
+{
+    char cur[STORE_PATH_MAX];
+    struct stat st;
+
+    if ((size_t) snprintf(cur, sizeof(cur), "%s/cur", path) >= sizeof(cur)) {
+        return 0;
+    }
+    return stat(cur, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+int store_create(const char *path)
+{
+    static const char *subs[] = { "cur", "new", "tmp" };
+    char sub[STORE_PATH_MAX];
+
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    for (size_t i=0; i < 3; i++) {
+        if ((size_t) snprintf(sub, sizeof(sub), "%s/%s", path, subs[i]) >= sizeof(sub)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (mkdir(sub, 0700) < 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int store_list(const char *user, void (*cb)(void *arg, const char *name), void *arg)
+{
+    char root[STORE_PATH_MAX], path[STORE_PATH_MAX];
+    struct dirent *e;
+    DIR *d;
+
+    if (store_path(root, sizeof(root), user, "INBOX", 5) < 0 || (d = opendir(root)) == NULL) {
+        return -1;
+    }
+
+    cb(arg, "INBOX");
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.' || !strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+            continue;
+        }
+        /* A name too long for a path can't be a mailbox we could open */
+        if ((size_t) snprintf(path, sizeof(path), "%s/%s", root, e->d_name) >= sizeof(path)) {
+            continue;
+        }
+        if (store_exists(path)) {
+            cb(arg, e->d_name + 1);
+        }
+    }
+
+    closedir(d);
+    return 0;
+}
+
+/*-
+ * Boxes sessions of this thread have open. Each worker has its own,
+ * nothing in them is ever touched by another thread.
+ */
+static __thread store_box *maildir_boxes = NULL;
+
+/* Load the mailbox at path, indexing it if nobody did before */
+static store_box *maildir_open(const char *path, uint32_t claim, uint8_t readonly)
+{
+    maildir_loghdr lh;
+    store_box *box;
+    int ret;
+
+    if ((box = maildir_attach(path, readonly)) == NULL) {
+        return NULL;
+    }
+    box->claim = claim;
+    if (maildir_lock(box) < 0) {
+        maildir_detach(box);
+        return NULL;
+    }
+
+    if (box->disk_gen != 0 && maildir_load(box) == 0) {
+        /* A log left from an older generation is in the index already */
+        if (pread(box->log, &lh, sizeof(lh), 0) != sizeof(lh)
+                || memcmp(lh.magic, MAILDIR_LOG_MAGIC, 8) != 0 || lh.gen != box->gen) {
+            ret = maildir_reset_log(box, box->gen);
+        } else {
+            ret = maildir_replay(box);
+        }
+        if (ret == 0) {
+            ret = maildir_sync(box);
+        }
+    } else {
+        /* First time here, every message gets stat()ed once */
+        box->uidvalidity = (uint32_t) time(NULL);
+        box->uidnext = 1;
+        box->clean = 0;
+        if ((ret = maildir_sync(box)) == 0) {
+            ret = maildir_write_index(box);
+        }
+    }
+
+    maildir_unlock(box);
+    if (ret < 0) {
+        maildir_detach(box);
+        return NULL;
+    }
+
+    return box;
+}
+
+/*-
+ * The index was compacted since box was loaded, so its log offset is
+ * meaningless. Load it again and tell apart what changed by uid, the
+ * records kept stay where they are.
+ */
+static int maildir_reload(store_box *box)
+{
+    store_box *fresh;
+    size_t i = 0, count = box->count;
+    uint32_t last = count > 0 ? box->msgs[count - 1].uid : 0;
+    ssize_t off;
+    int ret = -1;
+
+    if ((fresh = calloc(1, sizeof(store_box))) == NULL) {
+        return -1;
+    }
+    fresh->dir = box->dir;
+    fresh->log = box->log;
+
+    if (maildir_load(fresh) < 0 || maildir_replay(fresh) < 0) {
+        goto out;
+    }
+
+    for (size_t j=0; j < fresh->count; j++) {
+        store_msg *m = &fresh->msgs[j];
+
+        if (m->flags & STORE_EXPUNGED) {
+            continue;
+        }
+        for (; i < count && box->msgs[i].uid < m->uid; i++) {
+            if (!(box->msgs[i].flags & STORE_EXPUNGED)) {
+                maildir_gone(box, i);
+            }
+        }
+        if (i < count && box->msgs[i].uid == m->uid) {
+            store_msg *old = &box->msgs[i++];
+
+            if (old->flags & STORE_EXPUNGED) {
+                continue;
+            }
+            old->name = m->name;
+            if ((old->flags & STORE_FLAGS) != (m->flags & STORE_FLAGS)) {
+                old->flags = (old->flags & ~STORE_FLAGS) | (m->flags & STORE_FLAGS);
+                maildir_changed(box, old, 0);
+            }
+        } else if (m->uid > last) {
+            if (maildir_grow(box, box->count + 1) < 0) {
+                goto out;
+            }
+            box->msgs[box->count++] = *m;
+        }
+    }
+    for (; i < count; i++) {
+        if (!(box->msgs[i].flags & STORE_EXPUNGED)) {
+            maildir_gone(box, i);
+        }
+    }
+
+    /* Whatever is still numbered keeps its name, in the new blob */
+    for (i=0; i < count; i++) {
+        if (box->msgs[i].flags & STORE_EXPUNGED) {
+            if ((off = maildir_name(fresh, "%s", box->names + box->msgs[i].name)) < 0) {
+                goto out;
+            }
+            box->msgs[i].name = off;
+        }
+    }
+
+    free(box->names);
+    box->names = fresh->names;
+    box->names_len = fresh->names_len;
+    box->names_cap = fresh->names_cap;
+    box->gen = fresh->gen;
+    box->log_off = fresh->log_off;
+    fresh->names = NULL;
+    ret = 0;
+
+out:
+    free(fresh->msgs);
+    free(fresh->names);
+    free(fresh);
+    return ret;
+}
+
+/* Catch up with the log, or the index if it was compacted, and the files */
+static int maildir_rescan(store_box *box)
+{
+    int ret;
+
+    if (maildir_lock(box) < 0) {
+        return -1;
+    }
+
+    ret = box->disk_gen != box->gen ? maildir_reload(box) : maildir_replay(box);
+    if (ret == 0) {
+        ret = maildir_sync(box);
+    }
+
+    maildir_unlock(box);
+    return ret;
+}
+
+static int maildir_uidcmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Room in mb for anything the box could make it hide or number */
+static int maildir_view_reserve(mailbox *mb)
+{
+    store_box *box = mb->box;
+    uint32_t *p;
+    size_t cap;
+
+    if (mb->nhidden + box->gone > mb->hidden_cap) {
+        for (cap = mb->hidden_cap ? mb->hidden_cap : 16; cap < mb->nhidden + box->gone; cap *= 2);
+        if ((p = realloc(mb->hidden, cap * sizeof(uint32_t))) == NULL) {
+            return -1;
+        }
+        mb->hidden = p;
+        mb->hidden_cap = cap;
+    }
+    if (box->gone > 0 && box->count > mb->map_cap) {
+        for (cap = mb->map_cap ? mb->map_cap : 256; cap < box->count; cap *= 2);
+        if ((p = realloc(mb->map, cap * sizeof(uint32_t))) == NULL) {
+            return -1;
+        }
+        mb->map = p;
+        mb->map_cap = cap;
+    }
+
+    return 0;
+}
+
+/*-
+ * Forget hidden uids the box let go of and number the rest, the map
+ * was made big enough by maildir_view_reserve before anything was.
+ */
+static void maildir_view_map(mailbox *mb)
+{
+    store_box *box = mb->box;
+    size_t j = 0, n = 0;
+
+    for (size_t i=0; i < mb->nhidden; i++) {
+        size_t k = maildir_lower(box, mb->hidden[i]);
+        if (k < box->count && box->msgs[k].uid == mb->hidden[i]) {
+            mb->hidden[j++] = mb->hidden[i];
+        }
+    }
+    mb->nhidden = j;
+
+    j = 0;
+    for (size_t i=0; mb->nhidden > 0 && i < box->count && box->msgs[i].uid <= mb->known; i++) {
+        if (j < mb->nhidden && mb->hidden[j] == box->msgs[i].uid) {
+            j++;
+            continue;
+        }
+        mb->map[n++] = i;
+    }
+}
+
+/*-
+ * Tell the session what changed in the box since it last looked:
+ * expunges while its numbers are still the old ones, then flags and,
+ * if all, new messages. Returns how many of those it got or -1.
+ */
+static ssize_t maildir_view_sync(mailbox *mb, uint8_t all, store_cb cb, void *arg)
+{
+    store_box *box = mb->box;
+    size_t seq = 0, j = 0, n = mb->nhidden, count;
+
+    if (maildir_view_reserve(mb) < 0) {
+        return -1;
+    }
+
+    for (size_t i=0; box->gone > 0 && i < box->count && box->msgs[i].uid <= mb->known; i++) {
+        store_msg *m = &box->msgs[i];
+
+        if (j < n && mb->hidden[j] == m->uid) {
+            j++;
+            continue;
+        }
+        if (!(m->flags & STORE_EXPUNGED)) {
+            seq++;
+            continue;
+        }
+        m->pending--;
+        mb->recent -= m->recent == mb->id;
+        mb->hidden[mb->nhidden++] = m->uid;
+        mb->count--;
+        if (cb != NULL) {
+            cb(arg, seq + 1, STORE_EV_EXPUNGE);
+        }
+    }
+    if (mb->nhidden > n) {
+        qsort(mb->hidden, mb->nhidden, sizeof(uint32_t), maildir_uidcmp);
+        maildir_view_map(mb);
+    }
+    if (!all) {
+        return 0;
+    }
+
+    /* Changes made by the session itself were answered already */
+    if (mb->modseq != box->modseq) {
+        for (size_t i=0; cb != NULL && i < mb->count; i++) {
+            store_msg *m = store_get(mb, i);
+            if (m->modseq > mb->modseq && m->by != mb->id) {
+                cb(arg, i + 1, STORE_EV_FLAGS);
+            }
+        }
+        mb->modseq = box->modseq;
+    }
+
+    count = mb->count;
+    if (box->count > 0 && box->msgs[box->count - 1].uid > mb->known) {
+        n = mb->nhidden;
+        for (size_t i = maildir_lower(box, mb->known + 1); i < box->count; i++) {
+            store_msg *m = &box->msgs[i];
+
+            /* Came and went unseen, nobody waits for this one */
+            if (m->flags & STORE_EXPUNGED) {
+                mb->hidden[mb->nhidden++] = m->uid;
+                continue;
+            }
+            mb->count++;
+            mb->recent += m->recent == mb->id;
+        }
+        mb->known = box->msgs[box->count - 1].uid;
+        if (mb->nhidden > 0) {
+            maildir_view_map(mb);
+        }
+    }
+
+    return mb->count - count;
+}
+
+/*-
+ * Drop the expunged messages every session was told of. The box
+ * records move, so do the maps of its sessions.
+ */
+static void maildir_purge(store_box *box)
+{
+    size_t j = 0;
+
+    if (box->gone == 0) {
+        return;
+    }
+    for (size_t i=0; i < box->count; i++) {
+        store_msg *m = &box->msgs[i];
+
+        if ((m->flags & STORE_EXPUNGED) && m->pending == 0) {
+            box->gone--;
+            continue;
+        }
+        box->msgs[j++] = *m;
+    }
+    if (j == box->count) {
+        return;
+    }
+    box->count = j;
+
+    for (mailbox *v = box->views; v != NULL; v = v->next) {
+        maildir_view_map(v);
+    }
+}
+
+mailbox *store_open(const char *path, uint8_t readonly)
+{
+    static uint32_t ids = 0;
+    store_box *box;
+    mailbox *mb;
+
+    if ((mb = calloc(1, sizeof(mailbox))) == NULL) {
+        return NULL;
+    }
+    mb->id = __sync_add_and_fetch(&ids, 1);
+    mb->readonly = readonly;
+
+    for (box = maildir_boxes; box != NULL && strcmp(box->path, path) != 0; box = box->next);
+    if (box == NULL) {
+        if ((box = maildir_open(path, mb->id, readonly)) == NULL) {
+            free(mb);
+            return NULL;
+        }
+        box->next = maildir_boxes;
+        maildir_boxes = box;
+    } else {
+        box->claim = mb->id;
+        box->readonly = readonly;
+        if (maildir_rescan(box) < 0) {
+            free(mb);
+            return NULL;
+        }
+    }
+
+    mb->box = box;
+    mb->next = box->views;
+    box->views = mb;
+    if (maildir_view_sync(mb, 1, NULL, NULL) < 0) {
+        store_close(mb);
+        return NULL;
+    }
+    maildir_purge(box);
+
+    return mb;
+}
+
+ssize_t store_rescan(mailbox *mb, store_cb cb, void *arg)
+{
+    store_box *box = mb->box;
+    ssize_t ret;
+
+    box->claim = mb->id;
+    box->readonly = mb->readonly;
+    if (maildir_rescan(box) < 0) {
+        return -1;
+    }
+
+    ret = maildir_view_sync(mb, 1, cb, arg);
+    maildir_purge(box);
+    return ret;
+}
+
+void store_close(mailbox *mb)
+{
+    store_box *box = mb->box, **p;
+    mailbox **v;
+    size_t j = 0;
+
+    /* Whatever it wasn't told of yet it never will be */
+    for (size_t i=0; box->gone > 0 && i < box->count && box->msgs[i].uid <= mb->known; i++) {
+        if (j < mb->nhidden && mb->hidden[j] == box->msgs[i].uid) {
+            j++;
+        } else if (box->msgs[i].flags & STORE_EXPUNGED) {
+            box->msgs[i].pending--;
+        }
+    }
+
+    for (v = &box->views; *v != mb; v = &(*v)->next);
+    *v = mb->next;
+    free(mb->hidden);
+    free(mb->map);
+    free(mb);
+
+    if (box->views != NULL) {
+        maildir_purge(box);
+        return;
+    }
+    for (p = &maildir_boxes; *p != box; p = &(*p)->next);
+    *p = box->next;
+    maildir_detach(box);
+}
+
+/*-
+ * Deliveries show up in new/, other programs rename and unlink in
+ * cur/ and every change a session makes is appended to the log (or
+ * folded into a new index) in the Maildir itself.
+ */
+int store_watch(int fd, const char *path, int *wds)
+{
+    static const struct {
+        const char *sub;
+        uint32_t mask;
+    } dirs[STORE_WATCH_MAX] = {
+        { "", IN_MODIFY | IN_MOVED_TO },
+        { "/new", IN_CREATE | IN_MOVED_TO },
+        { "/cur", IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO },
+    };
+    char dir[STORE_PATH_MAX];
+    int n = 0;
+
+    for (size_t i=0; i < STORE_WATCH_MAX; i++) {
+        if ((size_t) snprintf(dir, sizeof(dir), "%s%s", path, dirs[i].sub) >= sizeof(dir)) {
+            continue;
+        }
+        if ((wds[n] = inotify_add_watch(fd, dir, dirs[i].mask | IN_ONLYDIR)) >= 0) {
+            n++;
+        }
+    }
+
+    return n > 0 ? n : -1;
+}
+
+int store_begin(mailbox *mb)
+{
+    return maildir_lock(mb->box);
+}
+
+void store_end(mailbox *mb)
+{
+    maildir_unlock(mb->box);
+}
+
+size_t store_find_uid(mailbox *mb, uint32_t uid)
+{
+    size_t lo = 0, hi = mb->count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (store_get(mb, mid)->uid < uid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+int store_map_msg(mailbox *mb, size_t i, store_map *map)
+{
+    store_msg *m = store_get(mb, i);
+
+    /* The size is known already, no fstat() needed */
+    if ((map->fd = openat(mb->box->dir, mb->box->names + m->name, O_RDONLY)) < 0) {
+        return -1;
+    }
+    map->len = m->size;
+    map->data = NULL;
+
+    if (map->len > 0) {
+        map->data = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, map->fd, 0);
+        if (map->data == MAP_FAILED) {
+            close(map->fd);
+            return -1;
+        }
+        madvise(map->data, map->len, MADV_SEQUENTIAL);
+    }
+
+    return 0;
+}
+
+void store_unmap(store_map *map)
+{
+    if (map->data != NULL) {
+        munmap(map->data, map->len);
+    }
+    close(map->fd);
+}
+
+int store_files_get(mailbox *mb, store_files *files)
+{
+    store_box *box = mb->box;
+
+    files->count = mb->count;
+    files->uidvalidity = box->uidvalidity;
+    files->uids = malloc((mb->count + 1) * sizeof(uint32_t));
+    files->names = malloc((mb->count + 1) * sizeof(uint32_t));
+    files->blob = malloc(box->names_len + 1);
+    files->dir = fcntl(box->dir, F_DUPFD_CLOEXEC, 0);
+    if (files->uids == NULL || files->names == NULL || files->blob == NULL || files->dir < 0) {
+        store_files_free(files);
+        return -1;
+    }
+
+    /* Offsets of names hold for the copy */
+    memcpy(files->blob, box->names, box->names_len);
+    for (size_t i=0; i < mb->count; i++) {
+        store_msg *m = store_get(mb, i);
+        files->uids[i] = m->uid;
+        files->names[i] = m->name;
+    }
+
+    return 0;
+}
+
+void store_files_free(store_files *files)
+{
+    free(files->uids);
+    free(files->names);
+    free(files->blob);
+    if (files->dir >= 0) {
+        close(files->dir);
+    }
+    files->uids = files->names = NULL;
+    files->blob = NULL;
+    files->dir = -1;
+    files->count = 0;
+}
+
+int store_files_map(store_files *files, size_t i, store_map *map)
+{
+    struct stat st;
+
+    if ((map->fd = openat(files->dir, files->blob + files->names[i], O_RDONLY | O_CLOEXEC)) < 0) {
+        return -1;
+    }
+    if (fstat(map->fd, &st) < 0) {
+        close(map->fd);
+        return -1;
+    }
+    map->len = st.st_size;
+    map->data = NULL;
+
+    if (map->len > 0) {
+        map->data = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, map->fd, 0);
+        if (map->data == MAP_FAILED) {
+            close(map->fd);
+            return -1;
+        }
+        madvise(map->data, map->len, MADV_SEQUENTIAL);
+    }
+
+    return 0;
+}
+
+int store_set_flags(mailbox *mb, size_t i, uint8_t flags)
+{
+    store_box *box = mb->box;
+    store_msg *m = store_get(mb, i);
+    char base[STORE_PATH_MAX], info[32];
+    const char *old = box->names + m->name;
+    ssize_t off;
+    int ret = -1;
+
+    flags &= STORE_FLAGS;
+    if ((m->flags & STORE_FLAGS) == flags) {
+        return 0;
+    }
+    if (m->flags & STORE_EXPUNGED) {
+        return -1;
+    }
+
+    /* Flags are part of the name, new/ only ever holds unflagged mail */
+    snprintf(base, sizeof(base), "%.*s", (int) strcspn(old + 4, ":"), old + 4);
+    maildir_info(info, flags, old);
+    if (maildir_lock(box) < 0) {
+        return -1;
+    }
+    if ((off = maildir_name(box, "cur/%s:2,%s", base, info)) < 0) {
+        goto out;
+    }
+
+    old = box->names + m->name;
+    if (renameat(box->dir, old, box->dir, box->names + off) < 0) {
+        box->names_len = off;
+        goto out;
+    }
+
+    /* Every other session sees it from here, they are told on rescan */
+    m->name = off;
+    m->flags = (m->flags & ~STORE_FLAGS) | flags;
+    maildir_changed(box, m, mb->id);
+    ret = maildir_log(box, MAILDIR_LOG_FLAGS, m);
+
+out:
+    maildir_unlock(box);
+    return ret;
+}
+
+struct mime_cache *store_mime(mailbox *mb)
+{
+    store_box *box = mb->box;
+
+    /* Records of another uidvalidity are for other messages */
+    if (box->mime != NULL && box->mime_uidvalidity != box->uidvalidity) {
+        mime_cache_free(box->mime);
+        box->mime = NULL;
+    }
+    if (box->mime == NULL) {
+        box->mime = mime_cache_open(box->dir, box->uidvalidity);
+        box->mime_uidvalidity = box->uidvalidity;
+    }
+
+    return box->mime;
+}
+
+size_t store_expunge(mailbox *mb, store_cb cb, void *arg)
+{
+    store_box *box = mb->box;
+    size_t removed = 0;
+    uint32_t *uids;
+
+    if (maildir_lock(box) < 0) {
+        return 0;
+    }
+    /* For the search index and the structure cache, which can do without */
+    uids = malloc(box->count * sizeof(uint32_t) + 1);
+
+    /* Only what the session knows of, later ones it can't have \Deleted */
+    for (size_t i=0; i < box->count && box->msgs[i].uid <= mb->known; i++) {
+        store_msg *m = &box->msgs[i];
+
+        if (!(m->flags & STORE_DELETED) || (m->flags & STORE_EXPUNGED)
+                || (unlinkat(box->dir, box->names + m->name, 0) < 0 && errno != ENOENT)) {
+            continue;
+        }
+        maildir_log(box, MAILDIR_LOG_EXPUNGE, m);
+        maildir_gone(box, i);
+        if (uids != NULL) {
+            uids[removed] = m->uid;
+        }
+        removed++;
+    }
+    maildir_unlock(box);
+    if (uids != NULL) {
+        search_index_drop(box->dir, box->uidvalidity, uids, removed);
+        if (box->mime != NULL) {
+            mime_cache_drop(box->mime, uids, removed);
+        }
+        free(uids);
+    }
+
+    /* Expunges of others are told along with these */
+    maildir_view_sync(mb, 0, cb, arg);
+    maildir_purge(box);
+
+    return removed;
+}
+
+/*-
+ * Index a file that was just placed in cur/ of another mailbox, by
+ * way of a handle of its own.
+ */
+static int maildir_deliver(store_box *dst, const char *name, uint8_t flags, time_t date, size_t size)
+{
+    store_msg *m;
+    ssize_t off;
+
+    if (dst->disk_gen == 0) {
+        /* Not indexed yet, it will be found when it is */
+        return 0;
+    }
+    if (maildir_grow(dst, dst->count + 1) < 0 || (off = maildir_name(dst, "%s", name)) < 0) {
+        return -1;
+    }
+
+    m = &dst->msgs[dst->count++];
+    memset(m, 0, sizeof(store_msg));
+    m->uid = dst->uidnext++;
+    m->name = off;
+    m->flags = flags & STORE_FLAGS;
+    m->date = date;
+    m->size = size;
+
+    return maildir_log(dst, MAILDIR_LOG_APPEND, m);
+}
+
+/*-
+ * Renames, links and unlinks of messages happen in cur/ and new/,
+ * the index is replaced in dir and changes are logged.
+ */
+static ssize_t maildir_durable(store_box *box, int *fds)
+{
+    static const char *subs[] = { "cur", "new" };
+    size_t n = 0;
+
+    for (size_t i=0; i < 2; i++) {
+        if ((fds[n] = openat(box->dir, subs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            goto fail;
+        }
+        n++;
+    }
+    if ((fds[n] = fcntl(box->dir, F_DUPFD_CLOEXEC, 0)) < 0) {
+        goto fail;
+    }
+    n++;
+    if (box->log >= 0) {
+        if ((fds[n] = fcntl(box->log, F_DUPFD_CLOEXEC, 0)) < 0) {
+            goto fail;
+        }
+        n++;
+    }
+
+    return n;
+
+fail:
+    while (n > 0) {
+        close(fds[--n]);
+    }
+    return -1;
+}
+
+ssize_t store_durable(mailbox *mb, int *fds)
+{
+    return maildir_durable(mb->box, fds);
+}
+
+int store_draft_write(store_draft *d, const char *path, const char *data, size_t len, uint8_t flags, time_t date)
+{
+    char uniq[256], info[32];
+    struct timespec ts[2];
+    ssize_t n;
+
+    maildir_unique(uniq, sizeof(uniq));
+    maildir_info(info, flags & STORE_FLAGS, NULL);
+    snprintf(d->path, sizeof(d->path), "%s", path);
+    snprintf(d->tmp, sizeof(d->tmp), "%s/tmp/%s", path, uniq);
+    snprintf(d->name, sizeof(d->name), "cur/%s:2,%s", uniq, info);
+    d->len = len;
+    d->flags = flags;
+    d->date = date > 0 ? date : time(NULL);
+
+    if ((d->fd = open(d->tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+        d->tmp[0] = '\0';
+        return -1;
+    }
+
+    for (size_t off = 0; off < len; off += n) {
+        if ((n = write(d->fd, data + off, len - off)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            store_draft_drop(d);
+            return -1;
+        }
+    }
+
+    /* The date is the mtime, set before the file is synced */
+    ts[0].tv_sec = ts[1].tv_sec = d->date;
+    ts[0].tv_nsec = ts[1].tv_nsec = 0;
+    futimens(d->fd, ts);
+
+    return 0;
+}
+
+ssize_t store_draft_deliver(store_draft *d, int *fds)
+{
+    store_box *dst;
+    char *data;
+    ssize_t ret = -1;
+
+    if ((dst = maildir_attach(d->path, 0)) == NULL) {
+        store_draft_drop(d);
+        return -1;
+    }
+    if (maildir_lock(dst) == 0) {
+        if (renameat(AT_FDCWD, d->tmp, dst->dir, d->name) == 0) {
+            /* In cur/ whatever happens next, found on the next rescan */
+            d->tmp[0] = '\0';
+            ret = maildir_deliver(dst, d->name, d->flags, d->date, d->len);
+        }
+        maildir_unlock(dst);
+    }
+
+    /* Indexed for SEARCH while it is at hand, if it got a uid */
+    if (ret == 0 && dst->disk_gen != 0 && d->len > 0
+            && (data = mmap(NULL, d->len, PROT_READ, MAP_PRIVATE, d->fd, 0)) != MAP_FAILED) {
+        search_index_add(dst->dir, dst->uidvalidity, dst->uidnext - 1, data, d->len);
+        munmap(data, d->len);
+    }
+    if (ret == 0) {
+        ret = maildir_durable(dst, fds);
+    }
+    maildir_detach(dst);
+
+    store_draft_drop(d);
+    return ret;
+}
+
+void store_draft_drop(store_draft *d)
+{
+    if (d->fd >= 0) {
+        close(d->fd);
+        d->fd = -1;
+    }
+    if (d->tmp[0] != '\0') {
+        unlink(d->tmp);
+        d->tmp[0] = '\0';
+    }
+}
+
+int store_append(const char *path, const char *data, size_t len, uint8_t flags, time_t date)
+{
+    store_draft d;
+    int fds[STORE_SYNC_MAX];
+    ssize_t n;
+    int ret;
+
+    if (store_draft_write(&d, path, data, len, flags, date) < 0) {
+        return -1;
+    }
+    if (fsync(d.fd) < 0) {
+        store_draft_drop(&d);
+        return -1;
+    }
+    if ((n = store_draft_deliver(&d, fds)) < 0) {
+        return -1;
+    }
+
+    for (ret = 0; n > 0; n--) {
+        if (fsync(fds[n - 1]) < 0) {
+            ret = -1;
+        }
+        close(fds[n - 1]);
+    }
+    return ret;
+}
+
+int store_copy(mailbox *mb, size_t i, const char *dest)
+{
+    store_msg *m = store_get(mb, i);
+    char uniq[256], info[32], name[STORE_PATH_MAX];
+    store_map map;
+    store_box *dst;
+    int ret = -1;
+
+    maildir_unique(uniq, sizeof(uniq));
+    maildir_info(info, m->flags & STORE_FLAGS, mb->box->names + m->name);
+    snprintf(name, sizeof(name), "cur/%s:2,%s", uniq, info);
+
+    if ((dst = maildir_attach(dest, 0)) == NULL) {
+        return -1;
+    }
+    if (maildir_lock(dst) < 0) {
+        maildir_detach(dst);
+        return -1;
+    }
+
+    /* Messages never change, a second link is a copy */
+    if (linkat(mb->box->dir, mb->box->names + m->name, dst->dir, name, 0) == 0) {
+        ret = maildir_deliver(dst, name, m->flags, m->date, m->size);
+    } else if (errno == EXDEV || errno == EPERM || errno == EMLINK) {
+        maildir_unlock(dst);
+        maildir_detach(dst);
+        if (store_map_msg(mb, i, &map) < 0) {
+            return -1;
+        }
+        ret = store_append(dest, map.data, map.len, m->flags, m->date);
+        store_unmap(&map);
+        return ret;
+    }
+
+    maildir_unlock(dst);
+    maildir_detach(dst);
+    return ret;
+}
@@ -0,0 +1,313 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <buf.h>
+#include <metrics.h>
+
+/* Largest page served, and how long a client has to say it speaks HTTP (ms) */
+#define METRICS_PAGE_MAX (1024 * 1024)
+#define METRICS_WAIT 100
+
+static const char *metrics_cmds[] = {
+    IMAP_CMD_NAMES,
+    "unknown"
+};
+
+static int metrics_socket = -1;
+static int metrics_wake[2] = { -1, -1 };
+static int metrics_running = 0;
+static pthread_t metrics_thread_id;
+static metrics_t **metrics_sets = NULL;
+static size_t metrics_nsets = 0;
+static char metrics_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+/* Nothing but counters in metrics_t, summed up one at a time */
+static void metrics_sum(metrics_t *m)
+{
+    uint64_t *dst = (uint64_t *) m;
+    const uint64_t *src;
+
+    memset(m, 0, sizeof(metrics_t));
+    for (size_t i=0; i < metrics_nsets; i++) {
+        src = (const uint64_t *) metrics_sets[i];
+        for (size_t j=0; j < sizeof(metrics_t) / sizeof(uint64_t); j++) {
+            dst[j] += __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void metrics_printf(buf_t *b, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+
+    if (buf_reserve(b, 256, METRICS_PAGE_MAX) < 0) {
+        return;
+    }
+    va_start(args, fmt);
+    n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, args);
+    va_end(args);
+    if (n > 0 && (size_t) n < b->cap - b->len) {
+        b->len += n;
+    }
+}
+
+static void metrics_head(buf_t *b, const char *name, const char *type, const char *help)
+{
+    metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_value(buf_t *b, const char *name, const char *type, const char *help, uint64_t v)
+{
+    metrics_head(b, name, type, help);
+    metrics_printf(b, "%s %llu\n", name, (unsigned long long) v);
+}
+
+/* Upper bound of bucket i in ns, see metrics_bucket */
+static uint64_t metrics_bound(size_t i)
+{
+    size_t e;
+
+    if (i < METRICS_SUB) {
+        return (uint64_t) (i + 1) << METRICS_SHIFT;
+    }
+    e = i / METRICS_SUB - 1;
+
+    return (uint64_t) (i - e * METRICS_SUB + 1) << (e + METRICS_SHIFT);
+}
+
+/* Buckets nothing fell in are left out, label may be NULL */
+static void metrics_hist_print(buf_t *b, const char *name, const char *label, const metrics_hist *h)
+{
+    const char *sep = label != NULL ? "," : "";
+    uint64_t count = 0;
+
+    if (label == NULL) {
+        label = "";
+    }
+    for (size_t i=0; i < METRICS_BUCKETS - 1; i++) {
+        if (h->buckets[i] == 0) {
+            continue;
+        }
+        count += h->buckets[i];
+        metrics_printf(b, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, sep,
+                metrics_bound(i) / 1e9, (unsigned long long) count);
+    }
+    count += h->buckets[METRICS_BUCKETS - 1];
+    metrics_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, sep, (unsigned long long) count);
+    if (*label != '\0') {
+        metrics_printf(b, "%s_sum{%s} %.9f\n%s_count{%s} %llu\n", name, label, h->sum / 1e9,
+                name, label, (unsigned long long) count);
+    } else {
+        metrics_printf(b, "%s_sum %.9f\n%s_count %llu\n", name, h->sum / 1e9, name, (unsigned long long) count);
+    }
+}
+
+static int metrics_empty(const metrics_hist *h)
+{
+    for (size_t i=0; i < METRICS_BUCKETS; i++) {
+        if (h->buckets[i] != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void metrics_page(buf_t *b, const metrics_t *m)
+{
+    char label[64];
+
+    metrics_value(b, "sis_connections", "gauge", "Connections open.", m->accepted - m->closed);
+    metrics_value(b, "sis_connections_accepted_total", "counter", "Connections accepted.", m->accepted);
+    metrics_value(b, "sis_connections_refused_total", "counter",
+            "Connections closed right away, MAX_CLIENTS reached or out of resources.", m->refused);
+    metrics_value(b, "sis_received_bytes_total", "counter",
+            "Command bytes read, after TLS and COMPRESS.", m->bytes_in);
+    metrics_value(b, "sis_sent_bytes_total", "counter",
+            "Response bytes written, before COMPRESS and TLS.", m->bytes_out);
+    metrics_value(b, "sis_output_blocked_total", "counter",
+            "Flushes that left output waiting for the socket.", m->blocked);
+    metrics_value(b, "sis_output_backlog_bytes", "gauge",
+            "Bytes of responses waiting for the socket.", m->backlog);
+    metrics_head(b, "sis_tls_handshakes_total", "counter", "TLS handshakes done, by whether the session was resumed.");
+    metrics_printf(b, "sis_tls_handshakes_total{kind=\"full\"} %llu\n", (unsigned long long) m->tls_full);
+    metrics_printf(b, "sis_tls_handshakes_total{kind=\"resumed\"} %llu\n", (unsigned long long) m->tls_resumed);
+    metrics_value(b, "sis_tls_handshake_failures_total", "counter", "TLS handshakes that failed.", m->tls_failed);
+
+    metrics_head(b, "sis_tls_handshake_seconds", "histogram", "Time from the start of the TLS handshake to its end.");
+    metrics_hist_print(b, "sis_tls_handshake_seconds", NULL, &m->tls);
+
+    /* Time on the event loop, not what is spent waiting for the pools */
+    metrics_head(b, "sis_command_seconds", "histogram", "Time spent executing commands, by command.");
+    for (size_t i=0; i <= IMAP_CMD_COUNT; i++) {
+        if (metrics_empty(&m->cmds[i])) {
+            continue;
+        }
+        snprintf(label, sizeof(label), "command=\"%s\"", metrics_cmds[i]);
+        metrics_hist_print(b, "sis_command_seconds", label, &m->cmds[i]);
+    }
+}
+
+static void metrics_serve(int fd, buf_t *b, metrics_t *m)
+{
+    static const char http[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n";
+    struct timeval tv = { 1, 0 };
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    char req[512];
+    ssize_t n;
+
+    /* A GET gets an HTTP response, for curl --unix-socket and such */
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    b->off = b->len = 0;
+    if (poll(&pfd, 1, METRICS_WAIT) > 0 && (n = read(fd, req, sizeof(req))) >= 4
+            && memcmp(req, "GET ", 4) == 0) {
+        metrics_printf(b, "%s", http);
+    }
+
+    metrics_sum(m);
+    metrics_page(b, m);
+
+    while (buf_used(b) > 0) {
+        if ((n = write(fd, b->data + b->off, buf_used(b))) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        buf_consume(b, n);
+    }
+}
+
+static void *metrics_thread(void *arg)
+{
+    struct pollfd fds[2] = {
+        { metrics_socket, POLLIN, 0 },
+        { metrics_wake[0], POLLIN, 0 }
+    };
+    metrics_t *m;
+    buf_t b;
+    int fd;
+
+    if ((m = malloc(sizeof(metrics_t))) == NULL) {
+        return NULL;
+    }
+    buf_init(&b, NULL, 0);
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        if ((fd = accept(metrics_socket, NULL, NULL)) < 0) {
+            continue;
+        }
+        metrics_serve(fd, &b, m);
+        close(fd);
+    }
+
+    buf_free(&b);
+    free(m);
+    return NULL;
+}
+
+int metrics_start(const char *path, metrics_t **sets, size_t n)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((metrics_sets = malloc(n * sizeof(metrics_t *))) == NULL) {
+        return -1;
+    }
+    memcpy(metrics_sets, sets, n * sizeof(metrics_t *));
+    metrics_nsets = n;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(metrics_path, path);
+
+    /* Left behind by a previous run that didn't get to stop */
+    unlink(path);
+    if ((metrics_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+            || bind(metrics_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || chmod(path, 0600) < 0
+            || listen(metrics_socket, 16) < 0
+            || pipe(metrics_wake) < 0
+            || pthread_create(&metrics_thread_id, NULL, metrics_thread, NULL) != 0) {
+        metrics_stop();
+        return -1;
+    }
+    metrics_running = 1;
+
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (metrics_running) {
+        write(metrics_wake[1], "", 1);
+        pthread_join(metrics_thread_id, NULL);
+        metrics_running = 0;
+    }
+
+    if (metrics_socket >= 0) {
+        close(metrics_socket);
+        unlink(metrics_path);
+        metrics_socket = -1;
+    }
+    if (metrics_wake[0] >= 0) {
+        close(metrics_wake[0]);
+        close(metrics_wake[1]);
+        metrics_wake[0] = metrics_wake[1] = -1;
+    }
+    free(metrics_sets);
+    metrics_sets = NULL;
+    metrics_nsets = 0;
+}
@@ -0,0 +1,119 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <imap_cmds.h>
+
+/*-
+ * Latencies are kept in log-linear buckets of units of 2^METRICS_SHIFT
+ * ns (about a microsecond), METRICS_SUB buckets per power of two. The
+ * last one takes anything from 7 << 22 units (about 30 s) up.
+ */
+#define METRICS_SHIFT 10
+#define METRICS_SUB_BITS 2
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS 96
+
+/* Slot of commands that didn't parse, after the known ones */
+#define METRICS_CMD_UNKNOWN IMAP_CMD_COUNT
+
+typedef struct {
+    uint64_t buckets[METRICS_BUCKETS];
+    /* ns */
+    uint64_t sum;
+} metrics_hist;
+
+/*-
+ * Counters of a worker. Only the worker writes them, with plain loads
+ * and stores (see metrics_add), the admin thread reads them whenever
+ * it is asked and sums up the workers.
+ */
+typedef struct {
+    uint64_t accepted, refused, closed;
+    /* Command bytes read and response bytes written, inside TLS and COMPRESS */
+    uint64_t bytes_in, bytes_out;
+    /* Flushes left waiting for the socket, bytes they left in the output buffers */
+    uint64_t blocked, backlog;
+    /* TLS handshakes done, with a new or a resumed session, and failed */
+    uint64_t tls_full, tls_resumed, tls_failed;
+    metrics_hist tls;
+    /* imap_cmd_exec, by command id */
+    metrics_hist cmds[IMAP_CMD_COUNT + 1];
+} metrics_t;
+
+/*-
+ * Serve the sum of sets, as Prometheus text, to every connection on a
+ * UNIX socket at path, from a thread of its own. -1 on failure.
+ */
+int metrics_start(const char *path, metrics_t **sets, size_t n);
+void metrics_stop(void);
+
+/* Relaxed, this is a plain load and store, but the reader never sees a torn value */
+static inline void metrics_add(uint64_t *c, uint64_t n)
+{
+    __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_sub(uint64_t *c, uint64_t n)
+{
+    __atomic_store_n(c, *c - n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline size_t metrics_bucket(uint64_t ns)
+{
+    uint64_t v = ns >> METRICS_SHIFT;
+    size_t e, i;
+
+    if (v < METRICS_SUB) {
+        return v;
+    }
+    e = 63 - __builtin_clzll(v) - METRICS_SUB_BITS;
+    i = e * METRICS_SUB + (v >> e);
+
+    return i < METRICS_BUCKETS ? i : METRICS_BUCKETS - 1;
+}
+
+static inline void metrics_record(metrics_hist *h, uint64_t ns)
+{
+    metrics_add(&h->buckets[metrics_bucket(ns)], 1);
+    metrics_add(&h->sum, ns);
+}
+
+#endif /* ifndef METRICS_H */
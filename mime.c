@@ -0,0 +1,1234 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <buf.h>
+#include <utils.h>
+#include <mime.h>
+
+/*-
+ * Records are rendered the first time FETCH needs the structure of a
+ * message and appended to a file next to the messages:
+ *
+ *   sis.cache  header, then records in the order they were added,
+ *              flock()ed around every change
+ *
+ * The file only ever grows, so that it can be mapped by every worker
+ * at once. It is replaced instead, by a copy without the records of
+ * expunged messages once they make up most of it, or by an empty one
+ * for another uidvalidity.
+ */
+#define MIME_CACHE "sis.cache"
+#define MIME_CACHE_TMP "sis.cache.tmp"
+#define MIME_MAGIC "SISMIM1"
+/* Bytes of dead records kept before the file is rewritten */
+#define MIME_CACHE_SLACK (256 * 1024)
+/* The file is mapped in steps of this much */
+#define MIME_MAP_STEP (1024 * 1024)
+
+/* Nesting and parts beyond these are not parsed */
+#define MIME_DEPTH 32
+#define MIME_PARTS_MAX 4096
+/* Largest record, messages needing more aren't cached */
+#define MIME_REC_MAX (4 * 1024 * 1024)
+#define MIME_TYPE_MAX 128
+#define MIME_BOUNDARY_MAX 256
+/* Tokens of an address that are looked at */
+#define MIME_ADDR_TOKS 64
+
+typedef struct {
+    char magic[8];
+    uint32_t uidvalidity, pad;
+} mime_hdr;
+
+/* Where the record of uid starts in the file */
+typedef struct {
+    uint32_t uid, off;
+} mime_slot;
+
+/*-
+ * Buffers the three strings are rendered in, unfolded field values
+ * go to val and words taken out of them to word.
+ */
+typedef struct {
+    buf_t env, body, bs, val, word, rec;
+    mime_part *parts;
+    size_t nparts, cap;
+    uint8_t err;
+} mime_parser;
+
+struct mime_cache {
+    int dir, fd;
+    uint32_t uidvalidity;
+    char *map;
+    /* Mapped, size of the file and end of its last good record */
+    size_t map_len, size, end;
+    mime_slot *slots;
+    size_t n, cap;
+    size_t live, dead;
+    mime_parser p;
+};
+
+typedef struct {
+    const char *p;
+    size_t n;
+    /* 'a'tom, 'q'uoted string or the special character itself */
+    char kind;
+} mime_tok;
+
+static void mime_entity(mime_parser *mp, const char *msg, size_t off, size_t len, uint8_t digest, int depth);
+
+static void mime_reset(buf_t *b)
+{
+    b->off = b->len = 0;
+}
+
+static void mime_put(mime_parser *mp, buf_t *b, const char *s, size_t n)
+{
+    if (mp->err || buf_reserve(b, n, MIME_REC_MAX) < 0) {
+        mp->err = 1;
+        return;
+    }
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+static void mime_puts(mime_parser *mp, buf_t *b, const char *s)
+{
+    mime_put(mp, b, s, strlen(s));
+}
+
+/* BODY is BODYSTRUCTURE without extension data, what bs got since mark goes to both */
+static void mime_dup(mime_parser *mp, size_t mark)
+{
+    if (!mp->err) {
+        mime_put(mp, &mp->body, mp->bs.data + mark, mp->bs.len - mark);
+    }
+}
+
+/* s as a quoted string, or a literal if it can't be one */
+static void mime_string(mime_parser *mp, buf_t *b, const char *s, size_t n)
+{
+    char lit[32];
+    size_t i, start;
+
+    for (i=0; i < n; i++) {
+        if (s[i] == '\r' || s[i] == '\n' || s[i] == '\0' || (unsigned char) s[i] >= 0x80) {
+            snprintf(lit, sizeof(lit), "{%zu}\r\n", n);
+            mime_puts(mp, b, lit);
+            mime_put(mp, b, s, n);
+            return;
+        }
+    }
+
+    mime_put(mp, b, "\"", 1);
+    for (i = start = 0; i < n; i++) {
+        if (s[i] == '"' || s[i] == '\\') {
+            mime_put(mp, b, s + start, i - start);
+            mime_put(mp, b, "\\", 1);
+            start = i;
+        }
+    }
+    mime_put(mp, b, s + start, n - start);
+    mime_put(mp, b, "\"", 1);
+}
+
+static void mime_nstring(mime_parser *mp, buf_t *b, const char *s, size_t n)
+{
+    if (s == NULL) {
+        mime_put(mp, b, "NIL", 3);
+    } else {
+        mime_string(mp, b, s, n);
+    }
+}
+
+/* Length of the header, blank line included */
+static size_t mime_header_len(const char *p, size_t len)
+{
+    const char *end = p + len, *nl;
+
+    if (len > 0 && p[0] == '\n') {
+        return 1;
+    }
+    if (len > 1 && p[0] == '\r' && p[1] == '\n') {
+        return 2;
+    }
+    for (nl = p; (nl = memchr(nl, '\n', end - nl)) != NULL; nl++) {
+        if (nl + 1 < end && nl[1] == '\n') {
+            return nl + 2 - p;
+        }
+        if (nl + 2 < end && nl[1] == '\r' && nl[2] == '\n') {
+            return nl + 3 - p;
+        }
+    }
+
+    return len;
+}
+
+/*-
+ * Value of the first field called name in the header at p, folded
+ * as it is and without the line break ending it. NULL if none.
+ */
+static const char *mime_field(const char *p, size_t len, const char *name, size_t *n)
+{
+    const char *end = p + len, *line, *v, *e;
+    size_t nlen = strlen(name);
+
+    while (p < end && *p != '\r' && *p != '\n') {
+        /* A field goes on as long as lines start with white space */
+        for (line = p; p < end; p++) {
+            if (*p == '\n' && (p + 1 >= end || (p[1] != ' ' && p[1] != '\t'))) {
+                p++;
+                break;
+            }
+        }
+        if ((size_t) (p - line) <= nlen || line[nlen] != ':' || strncasecmp(line, name, nlen) != 0) {
+            continue;
+        }
+
+        for (v = line + nlen + 1; v < p && (*v == ' ' || *v == '\t'); v++);
+        for (e = p; e > v && (e[-1] == '\r' || e[-1] == '\n'); e--);
+        *n = e - v;
+        return v;
+    }
+
+    return NULL;
+}
+
+/* The value with its line breaks and trailing white space taken out, in val */
+static void mime_unfold(mime_parser *mp, const char *s, size_t n)
+{
+    size_t i, start;
+
+    mime_reset(&mp->val);
+    for (i = start = 0; i < n; i++) {
+        if (s[i] == '\r' || s[i] == '\n') {
+            mime_put(mp, &mp->val, s + start, i - start);
+            start = i + 1;
+        }
+    }
+    mime_put(mp, &mp->val, s + start, n - start);
+    while (mp->val.len > 0 && (mp->val.data[mp->val.len - 1] == ' ' || mp->val.data[mp->val.len - 1] == '\t')) {
+        mp->val.len--;
+    }
+}
+
+/* Unfolded value of the field called name in val, NULL if none */
+static const char *mime_value(mime_parser *mp, const char *h, size_t hdr, const char *name, const char **end)
+{
+    const char *v;
+    size_t n;
+
+    if ((v = mime_field(h, hdr, name, &n)) == NULL) {
+        return NULL;
+    }
+    mime_unfold(mp, v, n);
+    if (mp->err) {
+        return NULL;
+    }
+    *end = mp->val.data + mp->val.len;
+
+    return mp->val.data;
+}
+
+/* A field rendered as is, NIL if there is none */
+static void mime_field_nstring(mime_parser *mp, buf_t *b, const char *h, size_t hdr, const char *name)
+{
+    const char *v, *end;
+
+    if ((v = mime_value(mp, h, hdr, name, &end)) == NULL) {
+        mime_put(mp, b, "NIL", 3);
+    } else {
+        mime_string(mp, b, v, end - v);
+    }
+}
+
+/* Skip white space and comments */
+static const char *mime_cfws(const char *p, const char *end)
+{
+    int depth;
+
+    while (p < end) {
+        if (*p == ' ' || *p == '\t') {
+            p++;
+            continue;
+        }
+        if (*p != '(') {
+            break;
+        }
+        for (depth = 0; p < end; p++) {
+            if (*p == '\\' && p + 1 < end) {
+                p++;
+            } else if (*p == '(') {
+                depth++;
+            } else if (*p == ')' && --depth == 0) {
+                p++;
+                break;
+            }
+        }
+    }
+
+    return p;
+}
+
+/* End of the MIME token at p */
+static const char *mime_token(const char *p, const char *end)
+{
+    while (p < end && (unsigned char) *p > ' ' && *p != 0x7f && strchr("()<>@,;:\\\"/[]?=", *p) == NULL) {
+        p++;
+    }
+
+    return p;
+}
+
+/* Copy the content of the quoted string at p to b, returns its end */
+static const char *mime_quoted(mime_parser *mp, const char *p, const char *end, buf_t *b)
+{
+    const char *start;
+
+    for (start = ++p; p < end && *p != '"'; p++) {
+        if (*p == '\\' && p + 1 < end) {
+            mime_put(mp, b, start, p - start);
+            start = ++p;
+        }
+    }
+    mime_put(mp, b, start, p - start);
+
+    return p < end ? p + 1 : p;
+}
+
+/* type/subtype at p, copied out, -1 if there is no such thing */
+static int mime_ctype(const char **pp, const char *end, char *type, size_t *tl, char *subtype, size_t *sl)
+{
+    const char *p = mime_cfws(*pp, end), *t, *s;
+
+    p = mime_token(t = p, end);
+    *tl = p - t;
+    p = mime_cfws(p, end);
+    if (*tl == 0 || p >= end || *p != '/') {
+        return -1;
+    }
+    p = mime_token(s = mime_cfws(p + 1, end), end);
+    if ((*sl = p - s) == 0) {
+        return -1;
+    }
+
+    *tl = *tl < MIME_TYPE_MAX ? *tl : MIME_TYPE_MAX;
+    *sl = *sl < MIME_TYPE_MAX ? *sl : MIME_TYPE_MAX;
+    memcpy(type, t, *tl);
+    memcpy(subtype, s, *sl);
+    *pp = p;
+
+    return 0;
+}
+
+/* Next name=value of the parameters at *pp, the value lands in word */
+static int mime_param_next(mime_parser *mp, const char **pp, const char *end, const char **name, size_t *nlen)
+{
+    const char *p = *pp, *v;
+
+    for (;;) {
+        /* Whatever isn't a parameter is skipped */
+        while (p < end && *p != ';') {
+            p++;
+        }
+        if (p >= end) {
+            *pp = p;
+            return 0;
+        }
+
+        p = mime_token(*name = mime_cfws(p + 1, end), end);
+        *nlen = p - *name;
+        p = mime_cfws(p, end);
+        if (*nlen == 0 || p >= end || *p != '=') {
+            continue;
+        }
+
+        p = mime_cfws(p + 1, end);
+        mime_reset(&mp->word);
+        if (p < end && *p == '"') {
+            p = mime_quoted(mp, p, end, &mp->word);
+        } else {
+            for (v = p; p < end && *p != ';' && *p != ' ' && *p != '\t' && *p != '('; p++);
+            mime_put(mp, &mp->word, v, p - v);
+        }
+        *pp = p;
+        return 1;
+    }
+}
+
+/* The parameters at p as a list, NIL if there are none */
+static void mime_params(mime_parser *mp, buf_t *b, const char *p, const char *end)
+{
+    const char *name;
+    size_t nlen, n = 0;
+
+    while (mime_param_next(mp, &p, end, &name, &nlen)) {
+        mime_put(mp, b, n++ == 0 ? "(" : " ", 1);
+        mime_string(mp, b, name, nlen);
+        mime_put(mp, b, " ", 1);
+        mime_string(mp, b, mp->word.data, mp->word.len);
+    }
+    mime_puts(mp, b, n > 0 ? ")" : "NIL");
+}
+
+/* Content-Disposition as (type params), NIL if there is none */
+static void mime_disposition(mime_parser *mp, buf_t *b, const char *h, size_t hdr)
+{
+    const char *p, *t = NULL, *end;
+
+    if ((p = mime_value(mp, h, hdr, "Content-Disposition", &end)) != NULL) {
+        t = mime_cfws(p, end);
+        p = mime_token(t, end);
+    }
+    if (p == NULL || p == t) {
+        mime_put(mp, b, "NIL", 3);
+        return;
+    }
+    mime_put(mp, b, "(", 1);
+    mime_string(mp, b, t, p - t);
+    mime_put(mp, b, " ", 1);
+    mime_params(mp, b, p, end);
+    mime_put(mp, b, ")", 1);
+}
+
+/* Content-Language as a list of tags, NIL if there is none */
+static void mime_language(mime_parser *mp, buf_t *b, const char *h, size_t hdr)
+{
+    const char *p, *t, *end;
+    size_t n = 0;
+
+    if ((p = mime_value(mp, h, hdr, "Content-Language", &end)) != NULL) {
+        while ((p = mime_cfws(p, end)) < end) {
+            t = p;
+            if ((p = mime_token(t, end)) == t) {
+                p++;
+                continue;
+            }
+            mime_put(mp, b, n++ == 0 ? "(" : " ", 1);
+            mime_string(mp, b, t, p - t);
+        }
+    }
+    mime_puts(mp, b, n > 0 ? ")" : "NIL");
+}
+
+/* Words of a display name joined by single spaces, in word */
+static void mime_phrase(mime_parser *mp, const mime_tok *toks, size_t n)
+{
+    mime_reset(&mp->word);
+    for (size_t i=0; i < n; i++) {
+        if (toks[i].kind == 'a' || toks[i].kind == 'q') {
+            if (mp->word.len > 0) {
+                mime_put(mp, &mp->word, " ", 1);
+            }
+        }
+        if (toks[i].kind == 'q') {
+            mime_quoted(mp, toks[i].p, toks[i].p + toks[i].n, &mp->word);
+        } else {
+            mime_put(mp, &mp->word, toks[i].p, toks[i].n);
+        }
+    }
+}
+
+/* Tokens of a local part or domain run together, in word */
+static void mime_concat(mime_parser *mp, const mime_tok *toks, size_t n)
+{
+    mime_reset(&mp->word);
+    for (size_t i=0; i < n; i++) {
+        if (toks[i].kind == 'q') {
+            mime_quoted(mp, toks[i].p, toks[i].p + toks[i].n, &mp->word);
+        } else {
+            mime_put(mp, &mp->word, toks[i].p, toks[i].n);
+        }
+    }
+}
+
+/* A mailbox as (name adl mailbox host), from the tokens between commas */
+static void mime_mailbox(mime_parser *mp, buf_t *b, const mime_tok *toks, size_t n)
+{
+    size_t lt, gt, at, start;
+
+    for (lt = 0; lt < n && toks[lt].kind != '<'; lt++);
+    mime_put(mp, b, "(", 1);
+    if (lt < n) {
+        mime_phrase(mp, toks, lt);
+        mime_nstring(mp, b, mp->word.len > 0 ? mp->word.data : NULL, mp->word.len);
+        for (gt = lt + 1; gt < n && toks[gt].kind != '>'; gt++);
+        /* A source route is left out */
+        start = lt + 1;
+        for (size_t i = start; i < gt; i++) {
+            if (toks[i].kind == ':') {
+                start = i + 1;
+            }
+        }
+    } else {
+        mime_put(mp, b, "NIL", 3);
+        start = 0;
+        gt = n;
+    }
+    mime_put(mp, b, " NIL ", 5);
+
+    for (at = gt; at > start && toks[at - 1].kind != '@'; at--);
+    if (at > start) {
+        mime_concat(mp, toks + start, at - 1 - start);
+        mime_string(mp, b, mp->word.data, mp->word.len);
+        mime_put(mp, b, " ", 1);
+        mime_concat(mp, toks + at, gt - at);
+    } else {
+        mime_concat(mp, toks + start, gt - start);
+        mime_string(mp, b, mp->word.data, mp->word.len);
+        mime_put(mp, b, " ", 1);
+        mime_reset(&mp->word);
+    }
+    mime_string(mp, b, mp->word.data, mp->word.len);
+    mime_put(mp, b, ")", 1);
+}
+
+/*-
+ * An address list as a list of addresses, NIL if there are none.
+ * Groups are opened by (NIL NIL name NIL) and closed by all NIL.
+ */
+static size_t mime_addresses(mime_parser *mp, buf_t *b, const char *p, const char *end)
+{
+    mime_tok toks[MIME_ADDR_TOKS], tok;
+    size_t n, count = 0;
+    uint8_t group = 0, angle;
+    char stop;
+
+    while (p < end) {
+        n = 0;
+        angle = 0;
+        stop = 0;
+        while ((p = mime_cfws(p, end)) < end) {
+            tok.p = p;
+            if (*p == '"') {
+                for (p++; p < end && *p != '"'; p++) {
+                    if (*p == '\\' && p + 1 < end) {
+                        p++;
+                    }
+                }
+                p = p < end ? p + 1 : p;
+                tok.kind = 'q';
+            } else if (strchr("<>@:;,.", *p) != NULL) {
+                if ((*p == ',' || *p == ';' || (*p == ':' && !group)) && !angle) {
+                    stop = *p++;
+                    break;
+                }
+                angle = *p == '<' ? 1 : *p == '>' ? 0 : angle;
+                tok.kind = *p++;
+            } else {
+                while (p < end && *p != ' ' && *p != '\t' && *p != '(' && *p != '"' && strchr("<>@:;,.", *p) == NULL) {
+                    p++;
+                }
+                tok.kind = 'a';
+            }
+            tok.n = p - tok.p;
+            if (n < MIME_ADDR_TOKS) {
+                toks[n++] = tok;
+            }
+        }
+
+        if (stop == ':') {
+            mime_phrase(mp, toks, n);
+            mime_puts(mp, b, count++ == 0 ? "((NIL NIL " : "(NIL NIL ");
+            mime_string(mp, b, mp->word.data, mp->word.len);
+            mime_put(mp, b, " NIL)", 5);
+            group = 1;
+            continue;
+        }
+        if (n > 0) {
+            if (count++ == 0) {
+                mime_put(mp, b, "(", 1);
+            }
+            mime_mailbox(mp, b, toks, n);
+        }
+        if (stop == ';' && group) {
+            mime_puts(mp, b, count++ == 0 ? "((NIL NIL NIL NIL)" : "(NIL NIL NIL NIL)");
+            group = 0;
+        }
+    }
+    if (group) {
+        mime_puts(mp, b, "(NIL NIL NIL NIL)");
+    }
+    mime_puts(mp, b, count > 0 ? ")" : "NIL");
+
+    return count;
+}
+
+/* The addresses of a field, or of fallback if it has none */
+static void mime_address_field(mime_parser *mp, buf_t *b, const char *h, size_t hdr, const char *name,
+        const char *fallback)
+{
+    const char *p, *end;
+
+    if (((p = mime_value(mp, h, hdr, name, &end)) == NULL || p == end) && fallback != NULL) {
+        p = mime_value(mp, h, hdr, fallback, &end);
+    }
+    if (p == NULL) {
+        mime_put(mp, b, "NIL", 3);
+    } else {
+        mime_addresses(mp, b, p, end);
+    }
+}
+
+static void mime_envelope_of(mime_parser *mp, buf_t *b, const char *h, size_t hdr)
+{
+    mime_put(mp, b, "(", 1);
+    mime_field_nstring(mp, b, h, hdr, "Date");
+    mime_put(mp, b, " ", 1);
+    mime_field_nstring(mp, b, h, hdr, "Subject");
+    mime_put(mp, b, " ", 1);
+    mime_address_field(mp, b, h, hdr, "From", NULL);
+    mime_put(mp, b, " ", 1);
+    mime_address_field(mp, b, h, hdr, "Sender", "From");
+    mime_put(mp, b, " ", 1);
+    mime_address_field(mp, b, h, hdr, "Reply-To", "From");
+    mime_put(mp, b, " ", 1);
+    mime_address_field(mp, b, h, hdr, "To", NULL);
+    mime_put(mp, b, " ", 1);
+    mime_address_field(mp, b, h, hdr, "Cc", NULL);
+    mime_put(mp, b, " ", 1);
+    mime_address_field(mp, b, h, hdr, "Bcc", NULL);
+    mime_put(mp, b, " ", 1);
+    mime_field_nstring(mp, b, h, hdr, "In-Reply-To");
+    mime_put(mp, b, " ", 1);
+    mime_field_nstring(mp, b, h, hdr, "Message-ID");
+    mime_put(mp, b, ")", 1);
+}
+
+/* Lines of a body, a last one without line break included */
+static size_t mime_lines(const char *p, size_t len)
+{
+    const char *end = p + len, *nl;
+    size_t n = 0;
+
+    for (nl = p; (nl = memchr(nl, '\n', end - nl)) != NULL; nl++) {
+        n++;
+    }
+
+    return n + (len > 0 && end[-1] != '\n');
+}
+
+/*-
+ * Parse the parts of the multipart body at msg[off, off + len). The
+ * line break in front of a delimiter belongs to it, whatever follows
+ * the last part or precedes the first isn't part of anything.
+ */
+static void mime_multipart(mime_parser *mp, const char *msg, size_t off, size_t len, const char *bnd, size_t blen,
+        uint8_t digest, int depth)
+{
+    const char *p = msg + off, *end = p + len, *line, *nl, *q, *e, *start = NULL;
+    size_t n = 0;
+    uint8_t last;
+
+    for (line = p; line < end; line = nl + 1) {
+        if ((nl = memchr(line, '\n', end - line)) == NULL) {
+            nl = end;
+        }
+        if ((size_t) (nl - line) >= blen + 2 && line[0] == '-' && line[1] == '-'
+                && memcmp(line + 2, bnd, blen) == 0) {
+            q = line + 2 + blen;
+            if ((last = nl - q >= 2 && q[0] == '-' && q[1] == '-')) {
+                q += 2;
+            }
+            while (q < nl && (*q == ' ' || *q == '\t' || *q == '\r')) {
+                q++;
+            }
+            if (q == nl) {
+                if (start != NULL) {
+                    e = line;
+                    if (e > start && e[-1] == '\n') {
+                        e--;
+                    }
+                    if (e > start && e[-1] == '\r') {
+                        e--;
+                    }
+                    mime_entity(mp, msg, start - msg, e - start, digest, depth + 1);
+                    n++;
+                }
+                start = nl < end ? nl + 1 : end;
+                if (last) {
+                    start = NULL;
+                    break;
+                }
+            }
+        }
+        if (nl == end) {
+            break;
+        }
+    }
+
+    /* Cut short, the last part runs to the end */
+    if (start != NULL) {
+        mime_entity(mp, msg, start - msg, end - start, digest, depth + 1);
+        n++;
+    }
+    /* A multipart has a part at least, an empty one will do */
+    if (n == 0) {
+        mime_entity(mp, msg, end - msg, 0, 0, depth + 1);
+    }
+}
+
+/*-
+ * Add the part at msg[off, off + len) and those below to the list,
+ * and render it in BODY and BODYSTRUCTURE. Its type defaults to
+ * message/rfc822 in a multipart/digest, text/plain elsewhere.
+ */
+static void mime_entity(mime_parser *mp, const char *msg, size_t off, size_t len, uint8_t digest, int depth)
+{
+    const char *h = msg + off, *p = NULL, *end = NULL, *name;
+    char type[MIME_TYPE_MAX], subtype[MIME_TYPE_MAX], bnd[MIME_BOUNDARY_MAX], num[32];
+    size_t hdr, tl = 0, sl = 0, bl = 0, nlen, idx, mark;
+    uint32_t kind = MIME_LEAF;
+    mime_part *parts;
+    uint8_t text;
+
+    if (mp->err) {
+        return;
+    }
+    if (mp->nparts == mp->cap) {
+        if (mp->cap == MIME_PARTS_MAX || (parts = realloc(mp->parts, (mp->cap ? mp->cap * 2 : 16)
+                        * sizeof(mime_part))) == NULL) {
+            mp->err = 1;
+            return;
+        }
+        mp->parts = parts;
+        mp->cap = mp->cap ? mp->cap * 2 : 16;
+    }
+    idx = mp->nparts++;
+    hdr = mime_header_len(h, len);
+
+    if ((p = mime_value(mp, h, hdr, "Content-Type", &end)) == NULL
+            || mime_ctype(&p, end, type, &tl, subtype, &sl) < 0) {
+        p = NULL;
+        tl = sl = 0;
+    }
+    if (tl == 0 && digest) {
+        memcpy(type, "MESSAGE", tl = 7);
+        memcpy(subtype, "RFC822", sl = 6);
+    } else if (tl == 0) {
+        memcpy(type, "TEXT", tl = 4);
+        memcpy(subtype, "PLAIN", sl = 5);
+    }
+    text = strncaseeq(type, tl, "TEXT");
+
+    if (depth < MIME_DEPTH && strncaseeq(type, tl, "MULTIPART")) {
+        while (p != NULL && mime_param_next(mp, &p, end, &name, &nlen)) {
+            if (strncaseeq(name, nlen, "BOUNDARY") && mp->word.len > 0 && mp->word.len < MIME_BOUNDARY_MAX) {
+                memcpy(bnd, mp->word.data, bl = mp->word.len);
+                kind = MIME_MULTIPART;
+                break;
+            }
+        }
+    } else if (depth < MIME_DEPTH && strncaseeq(type, tl, "MESSAGE") && strncaseeq(subtype, sl, "RFC822")) {
+        kind = MIME_MESSAGE;
+    }
+
+    mp->parts[idx].off = off;
+    mp->parts[idx].hdr = hdr;
+    mp->parts[idx].len = len;
+    mp->parts[idx].type = kind;
+
+    mark = mp->bs.len;
+    mime_put(mp, &mp->bs, "(", 1);
+    if (kind == MIME_MULTIPART) {
+        mime_dup(mp, mark);
+        mime_multipart(mp, msg, off + hdr, len - hdr, bnd, bl, strncaseeq(subtype, sl, "DIGEST"), depth);
+        mark = mp->bs.len;
+        mime_put(mp, &mp->bs, " ", 1);
+        mime_string(mp, &mp->bs, subtype, sl);
+        mime_dup(mp, mark);
+        mime_put(mp, &mp->bs, " ", 1);
+        /* Parsed again, parts below used val */
+        if ((p = mime_value(mp, h, hdr, "Content-Type", &end)) != NULL) {
+            mime_ctype(&p, end, type, &tl, subtype, &sl);
+            mime_params(mp, &mp->bs, p, end);
+        } else {
+            mime_put(mp, &mp->bs, "NIL", 3);
+        }
+    } else {
+        mime_string(mp, &mp->bs, type, tl);
+        mime_put(mp, &mp->bs, " ", 1);
+        mime_string(mp, &mp->bs, subtype, sl);
+        mime_put(mp, &mp->bs, " ", 1);
+        if (p != NULL) {
+            mime_params(mp, &mp->bs, p, end);
+        } else {
+            mime_puts(mp, &mp->bs, text ? "(\"CHARSET\" \"US-ASCII\")" : "NIL");
+        }
+        mime_put(mp, &mp->bs, " ", 1);
+        mime_field_nstring(mp, &mp->bs, h, hdr, "Content-ID");
+        mime_put(mp, &mp->bs, " ", 1);
+        mime_field_nstring(mp, &mp->bs, h, hdr, "Content-Description");
+        mime_put(mp, &mp->bs, " ", 1);
+        if ((p = mime_value(mp, h, hdr, "Content-Transfer-Encoding", &end)) != NULL) {
+            p = mime_cfws(p, end);
+            end = mime_token(p, end);
+        }
+        if (p != NULL && end > p) {
+            mime_string(mp, &mp->bs, p, end - p);
+        } else {
+            mime_puts(mp, &mp->bs, "\"7BIT\"");
+        }
+        snprintf(num, sizeof(num), " %zu", len - hdr);
+        mime_puts(mp, &mp->bs, num);
+
+        if (kind == MIME_MESSAGE) {
+            mime_put(mp, &mp->bs, " ", 1);
+            mime_envelope_of(mp, &mp->bs, h + hdr, mime_header_len(h + hdr, len - hdr));
+            mime_put(mp, &mp->bs, " ", 1);
+            mime_dup(mp, mark);
+            mime_entity(mp, msg, off + hdr, len - hdr, 0, depth + 1);
+            mark = mp->bs.len;
+        }
+        if (kind == MIME_MESSAGE || text) {
+            snprintf(num, sizeof(num), " %zu", mime_lines(h + hdr, len - hdr));
+            mime_puts(mp, &mp->bs, num);
+        }
+        mime_dup(mp, mark);
+        mime_put(mp, &mp->bs, " ", 1);
+        mime_field_nstring(mp, &mp->bs, h, hdr, "Content-MD5");
+    }
+
+    mime_put(mp, &mp->bs, " ", 1);
+    mime_disposition(mp, &mp->bs, h, hdr);
+    mime_put(mp, &mp->bs, " ", 1);
+    mime_language(mp, &mp->bs, h, hdr);
+    mime_put(mp, &mp->bs, " ", 1);
+    mime_field_nstring(mp, &mp->bs, h, hdr, "Content-Location");
+    mime_put(mp, &mp->bs, ")", 1);
+    mime_put(mp, &mp->body, ")", 1);
+
+    mp->parts[idx].size = mp->nparts - idx;
+}
+
+/* Parse the message at data into a record in rec, -1 on failure */
+static int mime_parse(mime_parser *mp, uint32_t uid, const char *data, size_t len)
+{
+    static const char zero[4];
+    mime_rec rec;
+    size_t size;
+
+    if (len > UINT32_MAX) {
+        return -1;
+    }
+    mp->err = 0;
+    mp->nparts = 0;
+    mime_reset(&mp->env);
+    mime_reset(&mp->body);
+    mime_reset(&mp->bs);
+
+    mime_envelope_of(mp, &mp->env, data, mime_header_len(data, len));
+    mime_entity(mp, data, 0, len, 0, 0);
+    if (mp->err) {
+        return -1;
+    }
+
+    size = sizeof(rec) + mp->nparts * sizeof(mime_part) + mp->env.len + mp->body.len + mp->bs.len;
+    if (size > MIME_REC_MAX - 4) {
+        return -1;
+    }
+    rec.uid = uid;
+    rec.size = (size + 3) & ~(size_t) 3;
+    rec.nparts = mp->nparts;
+    rec.envelope = mp->env.len;
+    rec.body = mp->body.len;
+    rec.bodystructure = mp->bs.len;
+
+    mime_reset(&mp->rec);
+    mime_put(mp, &mp->rec, (const char *) &rec, sizeof(rec));
+    mime_put(mp, &mp->rec, (const char *) mp->parts, mp->nparts * sizeof(mime_part));
+    mime_put(mp, &mp->rec, mp->env.data, mp->env.len);
+    mime_put(mp, &mp->rec, mp->body.data, mp->body.len);
+    mime_put(mp, &mp->rec, mp->bs.data, mp->bs.len);
+    mime_put(mp, &mp->rec, zero, rec.size - size);
+
+    return mp->err ? -1 : 0;
+}
+
+ssize_t mime_section(const mime_rec *rec, const uint32_t *path, size_t n)
+{
+    const mime_part *parts = mime_parts(rec);
+    size_t msg = 0, cur = 0, i;
+
+    for (size_t k=0; k < n; k++) {
+        if (parts[msg].type == MIME_MULTIPART) {
+            /* Children follow, each with those below it */
+            for (i = msg + 1, cur = 1; cur < path[k] && i < msg + parts[msg].size; cur++) {
+                i += parts[i].size;
+            }
+            if (path[k] == 0 || i >= msg + parts[msg].size) {
+                return -1;
+            }
+            cur = i;
+        } else if (path[k] == 1) {
+            /* Part 1 of a message that isn't multipart is its body */
+            cur = msg;
+        } else {
+            return -1;
+        }
+
+        if (k + 1 < n) {
+            if (parts[cur].type == MIME_MESSAGE) {
+                msg = cur + 1;
+            } else if (parts[cur].type == MIME_MULTIPART) {
+                msg = cur;
+            } else {
+                return -1;
+            }
+        }
+    }
+
+    return cur;
+}
+
+/* Is the record at rec, avail bytes from the end of the file, whole */
+static int mime_rec_ok(const mime_rec *rec, size_t avail)
+{
+    uint64_t need;
+
+    if (avail < sizeof(mime_rec) || rec->size < sizeof(mime_rec) || rec->size % 4 != 0 || rec->size > avail
+            || rec->nparts == 0) {
+        return 0;
+    }
+    need = sizeof(mime_rec) + (uint64_t) rec->nparts * sizeof(mime_part)
+        + (uint64_t) rec->envelope + rec->body + rec->bodystructure;
+
+    return need <= rec->size;
+}
+
+/* Slot of uid, or where it would go */
+static size_t mime_cache_lower(mime_cache *c, uint32_t uid)
+{
+    size_t lo = 0, hi = c->n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (c->slots[mid].uid < uid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static const mime_rec *mime_cache_find(mime_cache *c, uint32_t uid)
+{
+    size_t i = mime_cache_lower(c, uid);
+
+    return i < c->n && c->slots[i].uid == uid ? (const mime_rec *) (c->map + c->slots[i].off) : NULL;
+}
+
+/*-
+ * Map whatever was added to the file since and index its records.
+ * Mostly the uids grow, the slots are appended to.
+ */
+static void mime_cache_scan(mime_cache *c)
+{
+    const mime_rec *rec;
+    struct stat st;
+    mime_slot *slots;
+    size_t len, i;
+    char *map;
+
+    if (c->fd < 0 || fstat(c->fd, &st) < 0 || (size_t) st.st_size <= c->end) {
+        return;
+    }
+    /* Past the end of the file is never read, the file never shrinks */
+    if ((size_t) st.st_size > c->map_len) {
+        len = ((size_t) st.st_size + MIME_MAP_STEP) & ~(size_t) (MIME_MAP_STEP - 1);
+        if ((map = mmap(NULL, len, PROT_READ, MAP_SHARED, c->fd, 0)) == MAP_FAILED) {
+            return;
+        }
+        if (c->map != NULL) {
+            munmap(c->map, c->map_len);
+        }
+        c->map = map;
+        c->map_len = len;
+    }
+    c->size = st.st_size;
+
+    while (mime_rec_ok(rec = (const mime_rec *) (c->map + c->end), c->size - c->end)) {
+        i = mime_cache_lower(c, rec->uid);
+        if (i < c->n && c->slots[i].uid == rec->uid) {
+            c->dead += rec->size;
+            c->end += rec->size;
+            continue;
+        }
+        if (c->n == c->cap) {
+            if ((slots = realloc(c->slots, (c->cap ? c->cap * 2 : 64) * sizeof(mime_slot))) == NULL) {
+                break;
+            }
+            c->slots = slots;
+            c->cap = c->cap ? c->cap * 2 : 64;
+        }
+        memmove(c->slots + i + 1, c->slots + i, (c->n - i) * sizeof(mime_slot));
+        c->slots[i].uid = rec->uid;
+        c->slots[i].off = c->end;
+        c->n++;
+        c->live += rec->size;
+        c->end += rec->size;
+    }
+}
+
+/* Forget the file, it is read from scratch next time */
+static void mime_cache_close(mime_cache *c)
+{
+    if (c->map != NULL) {
+        munmap(c->map, c->map_len);
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->map = NULL;
+    c->map_len = c->size = c->end = 0;
+    c->n = c->live = c->dead = 0;
+}
+
+static int mime_write(int fd, const char *p, size_t len, off_t off)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = pwrite(fd, p, len, off)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+        off += n;
+    }
+
+    return 0;
+}
+
+/*-
+ * Replace the locked file by one holding the records of the slots
+ * only, born locked. Left with no file if that fails.
+ */
+static int mime_cache_rewrite(mime_cache *c)
+{
+    const mime_rec *rec;
+    mime_hdr h;
+    off_t off;
+    int fd;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MIME_MAGIC, sizeof(h.magic));
+    h.uidvalidity = c->uidvalidity;
+
+    if ((fd = openat(c->dir, MIME_CACHE_TMP, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+        mime_cache_close(c);
+        return -1;
+    }
+    if (flock(fd, LOCK_EX) < 0 || mime_write(fd, (const char *) &h, sizeof(h), 0) < 0) {
+        goto fail;
+    }
+    off = sizeof(h);
+    for (size_t i=0; i < c->n; i++) {
+        rec = (const mime_rec *) (c->map + c->slots[i].off);
+        if (mime_write(fd, (const char *) rec, rec->size, off) < 0) {
+            goto fail;
+        }
+        off += rec->size;
+    }
+    if (renameat(c->dir, MIME_CACHE_TMP, c->dir, MIME_CACHE) < 0) {
+        goto fail;
+    }
+
+    mime_cache_close(c);
+    c->fd = fd;
+    c->end = sizeof(h);
+    mime_cache_scan(c);
+    return 0;
+
+fail:
+    unlinkat(c->dir, MIME_CACHE_TMP, 0);
+    close(fd);
+    mime_cache_close(c);
+    return -1;
+}
+
+/*-
+ * Lock the file for a change and catch up with it. It may have been
+ * replaced meanwhile, or never read, then it is opened again, and
+ * emptied if it is of another uidvalidity.
+ */
+static int mime_cache_lock(mime_cache *c)
+{
+    struct stat a, b;
+    mime_hdr h;
+
+    for (;;) {
+        if (c->fd < 0 && (c->fd = openat(c->dir, MIME_CACHE, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+            return -1;
+        }
+        if (flock(c->fd, LOCK_EX) < 0) {
+            mime_cache_close(c);
+            return -1;
+        }
+        if (fstatat(c->dir, MIME_CACHE, &a, 0) < 0 || fstat(c->fd, &b) < 0
+                || a.st_ino != b.st_ino || a.st_dev != b.st_dev) {
+            mime_cache_close(c);
+            continue;
+        }
+
+        if (c->end == 0) {
+            if (pread(c->fd, &h, sizeof(h), 0) == sizeof(h) && memcmp(h.magic, MIME_MAGIC, sizeof(h.magic)) == 0
+                    && h.uidvalidity == c->uidvalidity) {
+                c->end = sizeof(h);
+            } else if (mime_cache_rewrite(c) < 0) {
+                return -1;
+            }
+        }
+        mime_cache_scan(c);
+        return 0;
+    }
+}
+
+mime_cache *mime_cache_open(int dir, uint32_t uidvalidity)
+{
+    mime_cache *c;
+
+    if ((c = calloc(1, sizeof(mime_cache))) == NULL) {
+        return NULL;
+    }
+    c->dir = dir;
+    c->fd = -1;
+    c->uidvalidity = uidvalidity;
+    buf_init(&c->p.env, NULL, 0);
+    buf_init(&c->p.body, NULL, 0);
+    buf_init(&c->p.bs, NULL, 0);
+    buf_init(&c->p.val, NULL, 0);
+    buf_init(&c->p.word, NULL, 0);
+    buf_init(&c->p.rec, NULL, 0);
+
+    /* Without a file, records are parsed every time */
+    if (mime_cache_lock(c) == 0) {
+        flock(c->fd, LOCK_UN);
+    }
+
+    return c;
+}
+
+void mime_cache_free(mime_cache *c)
+{
+    if (c == NULL) {
+        return;
+    }
+    mime_cache_close(c);
+    free(c->slots);
+    free(c->p.parts);
+    buf_free(&c->p.env);
+    buf_free(&c->p.body);
+    buf_free(&c->p.bs);
+    buf_free(&c->p.val);
+    buf_free(&c->p.word);
+    buf_free(&c->p.rec);
+    free(c);
+}
+
+const mime_rec *mime_cache_get(mime_cache *c, uint32_t uid)
+{
+    const mime_rec *rec;
+
+    /* Another session may have added it */
+    if ((rec = mime_cache_find(c, uid)) == NULL) {
+        mime_cache_scan(c);
+        rec = mime_cache_find(c, uid);
+    }
+
+    return rec;
+}
+
+const mime_rec *mime_cache_add(mime_cache *c, uint32_t uid, const char *data, size_t len)
+{
+    const mime_rec *rec;
+
+    if (mime_parse(&c->p, uid, data, len) < 0) {
+        return NULL;
+    }
+    rec = (const mime_rec *) c->p.rec.data;
+    if (mime_cache_lock(c) < 0) {
+        return rec;
+    }
+
+    if (mime_cache_find(c, uid) == NULL) {
+        /* A torn record would hide every later one */
+        if ((c->size == c->end || mime_cache_rewrite(c) == 0)
+                && mime_write(c->fd, (const char *) rec, rec->size, c->end) == 0) {
+            mime_cache_scan(c);
+        }
+    }
+    if (c->fd >= 0) {
+        flock(c->fd, LOCK_UN);
+    }
+
+    return mime_cache_find(c, uid) != NULL ? mime_cache_find(c, uid) : rec;
+}
+
+void mime_cache_drop(mime_cache *c, const uint32_t *uids, size_t n)
+{
+    const mime_rec *rec;
+    size_t j = 0, k = 0;
+
+    for (size_t i=0; i < c->n; i++) {
+        while (j < n && uids[j] < c->slots[i].uid) {
+            j++;
+        }
+        if (j < n && uids[j] == c->slots[i].uid) {
+            rec = (const mime_rec *) (c->map + c->slots[i].off);
+            c->live -= rec->size;
+            c->dead += rec->size;
+            continue;
+        }
+        c->slots[k++] = c->slots[i];
+    }
+    c->n = k;
+
+    if (c->dead > MIME_CACHE_SLACK && c->dead > c->live && mime_cache_lock(c) == 0) {
+        if (mime_cache_rewrite(c) == 0) {
+            flock(c->fd, LOCK_UN);
+        }
+    }
+}
@@ -0,0 +1,100 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MIME_H
+#define MIME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* What a part is, the message inside a MIME_MESSAGE is the next part */
+#define MIME_LEAF 0x0
+#define MIME_MULTIPART 0x1
+#define MIME_MESSAGE 0x2
+
+/*-
+ * A part of a message, parts are listed depth first with the message
+ * itself first. off is where its header starts, hdr the length of the
+ * header (blank line included) and len that of the whole part, size
+ * counts the parts below it and itself.
+ */
+typedef struct {
+    uint32_t off, hdr, len, size, type;
+} mime_part;
+
+/*-
+ * The structure of a message as FETCH answers it: nparts parts,
+ * then the ENVELOPE, BODY and BODYSTRUCTURE strings, of the lengths
+ * given, padded up to size.
+ */
+typedef struct {
+    uint32_t uid, size, nparts;
+    uint32_t envelope, body, bodystructure;
+} mime_rec;
+
+static inline const mime_part *mime_parts(const mime_rec *rec)
+{
+    return (const mime_part *) (rec + 1);
+}
+
+static inline const char *mime_envelope(const mime_rec *rec)
+{
+    return (const char *) (mime_parts(rec) + rec->nparts);
+}
+
+static inline const char *mime_body(const mime_rec *rec)
+{
+    return mime_envelope(rec) + rec->envelope;
+}
+
+static inline const char *mime_bodystructure(const mime_rec *rec)
+{
+    return mime_body(rec) + rec->body;
+}
+
+/* Part a section like 1.2.3 (n numbers) refers to, -1 if none */
+ssize_t mime_section(const mime_rec *rec, const uint32_t *path, size_t n);
+
+/*-
+ * Records of the messages of a mailbox, kept in a file next to them
+ * and shared by every session on it. A record is only good until the
+ * next call on the cache.
+ */
+typedef struct mime_cache mime_cache;
+
+/* Cache of the mailbox in dir, never NULL unless out of memory */
+mime_cache *mime_cache_open(int dir, uint32_t uidvalidity);
+void mime_cache_free(mime_cache *c);
+/* Record of uid, NULL if it wasn't parsed yet */
+const mime_rec *mime_cache_get(mime_cache *c, uint32_t uid);
+/* Parse the message at data and keep its record, NULL on failure */
+const mime_rec *mime_cache_add(mime_cache *c, uint32_t uid, const char *data, size_t len);
+/* The uids, sorted, were expunged */
+void mime_cache_drop(mime_cache *c, const uint32_t *uids, size_t n);
+
+#endif /* ifndef MIME_H */
@@ -0,0 +1,97 @@
+# sis - generate imap_cmds.h from imap.commands
+# See LICENSE file for copyright and license details.
+#
+# Command names are packed, lowercase, in two 64 bit words (byte i
+# at bits 8 * (i % 8) of word i / 8) and looked up with a switch on
+# their length, see imap_match_cmd in imap.c.
+
+BEGIN {
+    for (i = 0; i < 256; i++) {
+        ord[sprintf("%c", i)] = i
+    }
+    n = 0
+}
+
+/^#/ || NF == 0 {
+    next
+}
+
+{
+    name = tolower($1)
+    if (name !~ /^[a-z]+$/ || length(name) > 16 || NF != 2) {
+        printf("imap.commands:%d: invalid entry\n", NR) > "/dev/stderr"
+        exit 1
+    }
+    names[n] = name
+    routines[n] = $2
+    n++
+}
+
+function pack(s, from,    i, hex, c) {
+    hex = ""
+    for (i = from + 7; i >= from; i--) {
+        c = i < length(s) ? ord[substr(s, i + 1, 1)] : 0
+        hex = hex sprintf("%02x", c)
+    }
+    return "0x" hex "ULL"
+}
+
+END {
+    print "/* Generated from imap.commands by mkcmds.awk, do not edit. */"
+    print ""
+    print "#ifndef IMAP_CMDS_H"
+    print "#define IMAP_CMDS_H"
+    print ""
+    print "#include <stdint.h>"
+    print "#include <stddef.h>"
+    print ""
+    for (i = 0; i < n; i++) {
+        printf("#define IMAP_CMD_%s 0x%02x\n", toupper(names[i]), i)
+    }
+    printf("#define IMAP_CMD_COUNT %d\n", n)
+    print ""
+    print "/* Labels of imap_cmd_exec, indexed by command id */"
+    print "#define IMAP_CMD_LABELS \\"
+    for (i = 0; i < n; i++) {
+        printf("    &&cmd_%s%s\n", names[i], i < n - 1 ? ", \\" : "")
+    }
+    print ""
+    print "/* Names, lowercase, indexed by command id */"
+    print "#define IMAP_CMD_NAMES \\"
+    for (i = 0; i < n; i++) {
+        printf("    \"%s\"%s\n", names[i], i < n - 1 ? ", \\" : "")
+    }
+    print ""
+    print "#define IMAP_CMD_ROUTINES \\"
+    for (i = 0; i < n; i++) {
+        printf("    IMAP_ROUTINE(cmd_%s, %s)%s\n", names[i], routines[i], i < n - 1 ? " \\" : "")
+    }
+    print ""
+    print "static inline uint8_t imap_cmd_lookup(size_t len, uint64_t lo, uint64_t hi)"
+    print "{"
+    print "    switch (len) {"
+    for (len = 1; len <= 16; len++) {
+        found = 0
+        for (i = 0; i < n; i++) {
+            if (length(names[i]) != len) {
+                continue
+            }
+            if (!found) {
+                printf("        case %d:\n", len)
+                found = 1
+            }
+            printf("            if (lo == %s && hi == %s) {\n", pack(names[i], 0), pack(names[i], 8))
+            printf("                return IMAP_CMD_%s;\n", toupper(names[i]))
+            print  "            }"
+        }
+        if (found) {
+            print "            break;"
+        }
+    }
+    print "    }"
+    print ""
+    print "    return 0xff;"
+    print "}"
+    print ""
+    print "#endif /* ifndef IMAP_CMDS_H */"
+}
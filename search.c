@@ -0,0 +1,1124 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <config.h>
+#include <store.h>
+#include <search.h>
+
+/*-
+ * Header fields are indexed by trigram. A term is the field in the
+ * top byte and three lowercased bytes of its value below, a string
+ * of three bytes or more can then only be in messages that have all
+ * of its trigrams, and only those are read. The index is kept next
+ * to the messages:
+ *
+ *   sis.search      header, indexed uids and postings (uids again)
+ *                   then the sorted terms with their postings range
+ *   sis.search.log  records of messages indexed or expunged since,
+ *                   flock()ed around every change
+ *
+ * The log is folded into a new index once it outgrows SEARCH_LOG_MAX
+ * and an eighth of the index. Messages that were never indexed, from
+ * outside deliveries or copies, are read by the first search coming
+ * across them and indexed on the way.
+ */
+#define SEARCH_INDEX "sis.search"
+#define SEARCH_INDEX_TMP "sis.search.tmp"
+#define SEARCH_LOG "sis.search.log"
+#define SEARCH_MAGIC "SISSRC2"
+#define SEARCH_LOG_MAGIC "SISSLG2"
+/* New records a search holds on to before writing them out */
+#define SEARCH_BATCH (8 * 1024 * 1024)
+/* Largest uid an alive set is a bitmap for, binary search above */
+#define SEARCH_BITMAP_MAX (64 * 1024 * 1024)
+
+#define SEARCH_LOG_ADD 0x1
+#define SEARCH_LOG_DROP 0x2
+
+typedef struct {
+    char magic[8];
+    uint32_t uidvalidity, pad;
+    uint64_t nuids, npost, nterms;
+} search_hdr;
+
+typedef struct {
+    uint32_t term, off, n;
+} search_term;
+
+typedef struct {
+    char magic[8];
+    uint32_t uidvalidity, pad;
+} search_loghdr;
+
+/* Followed by n terms, sorted */
+typedef struct {
+    uint32_t uid, op, n;
+} search_rec;
+
+/* Header fields in the index, by what */
+static const struct {
+    const char *name;
+    uint8_t what;
+} search_fields[] = {
+    { "From", SEARCH_FROM },
+    { "To", SEARCH_TO },
+    { "Cc", SEARCH_CC },
+    { "Bcc", SEARCH_BCC },
+    { "Subject", SEARCH_SUBJECT },
+};
+
+#define SEARCH_NFIELDS (sizeof(search_fields) / sizeof(search_fields[0]))
+
+/* The index as a search sees it, the log copied while locked */
+typedef struct {
+    char *map;
+    size_t map_len;
+    const uint32_t *uids, *post;
+    const search_term *terms;
+    size_t nuids, npost, nterms;
+    char *log;
+    size_t log_len;
+    /* Uids of the log records adding a message, sorted */
+    uint32_t *added;
+    size_t nadded;
+    /* Records adding a message, a uid may have several */
+    size_t nadds;
+    uint8_t ok;
+} search_index;
+
+/* Growing buffer of log records */
+typedef struct {
+    char *data;
+    size_t len, cap;
+} search_recs;
+
+/* Uids still in the mailbox, to leave the others out of a new index */
+typedef struct {
+    const store_files *files;
+    uint64_t *bits;
+    uint32_t max;
+    const uint32_t *dropped;
+    size_t ndropped;
+} search_alive;
+
+typedef struct {
+    const char *name, *value;
+    size_t nlen, vlen;
+} search_field;
+
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t search_cond = PTHREAD_COND_INITIALIZER;
+static search_req *search_head = NULL, *search_tail = NULL;
+static size_t search_queued = 0;
+static int search_stopping = 0;
+static pthread_t search_threads[SEARCH_THREADS > 0 ? SEARCH_THREADS : 1];
+static size_t search_nthreads = 0;
+
+static inline unsigned char search_lower(unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+static int search_eq(const char *a, const char *needle, size_t n)
+{
+    for (size_t i=0; i < n; i++) {
+        if (search_lower(a[i]) != (unsigned char) needle[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*-
+ * Sixteen positions at a time: bit 5 forced on in the text matches
+ * any case of a letter, positions where both the first and the last
+ * byte of needle fit are then compared in full. Bit 5 also merges a
+ * few non-letters, the full compare sorts those out.
+ */
+const char *search_find(const char *hay, size_t len, const char *needle, size_t n)
+{
+    size_t i = 0;
+
+    if (n == 0) {
+        return hay;
+    }
+    if (n > len) {
+        return NULL;
+    }
+
+#ifdef __SSE2__
+    const __m128i fold = _mm_set1_epi8(0x20);
+    const __m128i first = _mm_set1_epi8(needle[0] | 0x20);
+    const __m128i last = _mm_set1_epi8(needle[n - 1] | 0x20);
+
+    for (; i + n - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *) (hay + i)), fold);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *) (hay + i + n - 1)), fold);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        for (; mask != 0; mask &= mask - 1) {
+            size_t at = i + __builtin_ctz(mask);
+            if (search_eq(hay + at, needle, n)) {
+                return hay + at;
+            }
+        }
+    }
+#endif
+
+    for (; i + n <= len; i++) {
+        if (search_lower(hay[i]) == (unsigned char) needle[0] && search_eq(hay + i, needle, n)) {
+            return hay + i;
+        }
+    }
+
+    return NULL;
+}
+
+/* Field from *p on, *p moves past it. 0 once the header is over */
+static int search_field_next(const char **p, const char *end, search_field *f)
+{
+    const char *s = *p, *eol, *colon;
+
+    while (s < end && *s != '\r' && *s != '\n') {
+        /* Lines starting with white space carry on the field */
+        for (eol = s; (eol = memchr(eol, '\n', end - eol)) != NULL
+                && eol + 1 < end && (eol[1] == ' ' || eol[1] == '\t'); eol++);
+        eol = eol != NULL ? eol + 1 : end;
+
+        if ((colon = memchr(s, ':', eol - s)) != NULL) {
+            f->name = s;
+            f->nlen = colon - s;
+            f->value = colon + 1;
+            f->vlen = eol - colon - 1;
+            while (f->nlen > 0 && (s[f->nlen - 1] == ' ' || s[f->nlen - 1] == '\t')) {
+                f->nlen--;
+            }
+            *p = eol;
+            return 1;
+        }
+        s = eol;
+    }
+
+    *p = s;
+    return 0;
+}
+
+static int search_field_is(const search_field *f, const char *name)
+{
+    return strlen(name) == f->nlen && strncasecmp(f->name, name, f->nlen) == 0;
+}
+
+int search_match(const search_query *q, const char *data, size_t len)
+{
+    const char *p, *end, *name = NULL;
+    search_field f;
+
+    if (data == NULL) {
+        data = "";
+        len = 0;
+    }
+    p = data;
+    end = data + len;
+
+    if (q->what == SEARCH_TEXT) {
+        return search_find(data, len, q->str, q->len) != NULL;
+    }
+
+    if (q->what == SEARCH_HEADER) {
+        name = q->name;
+    } else {
+        for (size_t i=0; i < SEARCH_NFIELDS; i++) {
+            if (search_fields[i].what == q->what) {
+                name = search_fields[i].name;
+            }
+        }
+    }
+
+    while (search_field_next(&p, end, &f)) {
+        if (q->what != SEARCH_BODY && search_field_is(&f, name)
+                && search_find(f.value, f.vlen, q->str, q->len) != NULL) {
+            return 1;
+        }
+    }
+    if (q->what != SEARCH_BODY) {
+        return 0;
+    }
+
+    /* The empty line ending the header isn't part of the body */
+    p += p < end && *p == '\r';
+    p += p < end && *p == '\n';
+    return search_find(p, end - p, q->str, q->len) != NULL;
+}
+
+static int search_u32cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int search_u64cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sort and drop duplicates, returns how many are left */
+static size_t search_unique(uint32_t *v, size_t n)
+{
+    size_t k = 0;
+
+    qsort(v, n, sizeof(uint32_t), search_u32cmp);
+    for (size_t i=0; i < n; i++) {
+        if (k == 0 || v[i] != v[k - 1]) {
+            v[k++] = v[i];
+        }
+    }
+
+    return k;
+}
+
+static int search_has(const uint32_t *v, size_t n, uint32_t x)
+{
+    return n > 0 && bsearch(&x, v, n, sizeof(uint32_t), search_u32cmp) != NULL;
+}
+
+static inline uint32_t search_term_of(uint8_t what, const char *p)
+{
+    return (uint32_t) what << 24 | (uint32_t) search_lower(p[0]) << 16
+        | (uint32_t) search_lower(p[1]) << 8 | search_lower(p[2]);
+}
+
+/* The search_fields entry f is, -1 if it isn't indexed */
+static int search_field_index(const search_field *f)
+{
+    for (size_t i=0; i < SEARCH_NFIELDS; i++) {
+        if (search_field_is(f, search_fields[i].name)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*-
+ * Append the log record indexing message uid to r. Values are indexed
+ * whole: an indexed message missing a trigram is never read, a match
+ * past a cut would go unnoticed.
+ */
+static int search_rec_add(search_recs *r, uint32_t uid, const char *data, size_t len)
+{
+    const char *p = data, *end = data + len;
+    search_field f;
+    search_rec *rec;
+    uint32_t *terms;
+    size_t n = 0, max = 0;
+    char *grown;
+    int i;
+
+    /* Room for every trigram there can be, trimmed once known */
+    while (search_field_next(&p, end, &f)) {
+        max += search_field_index(&f) >= 0 ? f.vlen : 0;
+    }
+    if (r->cap - r->len < sizeof(search_rec) + max * sizeof(uint32_t)) {
+        size_t cap = r->cap > 0 ? r->cap : 4096;
+
+        while (cap - r->len < sizeof(search_rec) + max * sizeof(uint32_t)) {
+            cap *= 2;
+        }
+        if ((grown = realloc(r->data, cap)) == NULL) {
+            return -1;
+        }
+        r->data = grown;
+        r->cap = cap;
+    }
+
+    rec = (search_rec *) (r->data + r->len);
+    terms = (uint32_t *) (rec + 1);
+    for (p = data; search_field_next(&p, end, &f);) {
+        if ((i = search_field_index(&f)) < 0) {
+            continue;
+        }
+        for (size_t k=0; k + 3 <= f.vlen; k++) {
+            terms[n++] = search_term_of(search_fields[i].what, f.value + k);
+        }
+    }
+
+    rec->uid = uid;
+    rec->op = SEARCH_LOG_ADD;
+    rec->n = search_unique(terms, n);
+    r->len += sizeof(search_rec) + rec->n * sizeof(uint32_t);
+
+    return 0;
+}
+
+/* Next record of a log at *p, NULL at the end or at a torn one */
+static const search_rec *search_rec_next(const char **p, const char *end)
+{
+    const search_rec *rec = (const search_rec *) *p;
+
+    if ((size_t) (end - *p) < sizeof(search_rec)
+            || rec->n > (end - *p - sizeof(search_rec)) / sizeof(uint32_t)) {
+        return NULL;
+    }
+    *p += sizeof(search_rec) + rec->n * sizeof(uint32_t);
+
+    return rec;
+}
+
+/*-
+ * Open the log of dir and lock it, a log of another uidvalidity is
+ * emptied and the index removed: the uids in there mean nothing.
+ */
+static int search_log_open(int dir, uint32_t uidvalidity)
+{
+    search_loghdr h;
+    int fd;
+
+    if ((fd = openat(dir, SEARCH_LOG, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        return -1;
+    }
+    if (flock(fd, LOCK_EX) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, SEARCH_LOG_MAGIC, sizeof(h.magic))
+            || h.uidvalidity != uidvalidity) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, SEARCH_LOG_MAGIC, sizeof(h.magic));
+        h.uidvalidity = uidvalidity;
+        unlinkat(dir, SEARCH_INDEX, 0);
+        if (ftruncate(fd, 0) < 0 || pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/* Append records to the locked log, all of them or none */
+static int search_log_write(int fd, const char *data, size_t len)
+{
+    off_t end;
+    ssize_t n;
+
+    if ((end = lseek(fd, 0, SEEK_END)) < 0) {
+        return -1;
+    }
+    for (size_t off = 0; off < len; off += n) {
+        if ((n = write(fd, data + off, len - off)) < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            /* A torn record would hide every later one */
+            ftruncate(fd, end);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Read the whole log behind its header, fd is locked */
+static char *search_log_read(int fd, size_t *len)
+{
+    struct stat st;
+    char *data;
+    ssize_t n;
+
+    *len = 0;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(search_loghdr)) {
+        return NULL;
+    }
+    if ((data = malloc(st.st_size - sizeof(search_loghdr) + 1)) == NULL) {
+        return NULL;
+    }
+    while (*len < st.st_size - sizeof(search_loghdr)) {
+        n = pread(fd, data + *len, st.st_size - sizeof(search_loghdr) - *len, sizeof(search_loghdr) + *len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        *len += n;
+    }
+
+    return data;
+}
+
+/* Map the index of dir if it is whole and of uidvalidity */
+static void search_map(search_index *ix, int dir, uint32_t uidvalidity)
+{
+    const search_hdr *h;
+    struct stat st;
+    int fd;
+
+    if ((fd = openat(dir, SEARCH_INDEX, O_RDONLY | O_CLOEXEC)) < 0) {
+        return;
+    }
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(search_hdr)
+            || (ix->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        ix->map = NULL;
+        close(fd);
+        return;
+    }
+    close(fd);
+    ix->map_len = st.st_size;
+
+    h = (const search_hdr *) ix->map;
+    if (memcmp(h->magic, SEARCH_MAGIC, sizeof(h->magic)) || h->uidvalidity != uidvalidity
+            || h->nuids > ix->map_len || h->npost > ix->map_len || h->nterms > ix->map_len
+            || sizeof(search_hdr) + (h->nuids + h->npost) * sizeof(uint32_t)
+                + h->nterms * sizeof(search_term) != ix->map_len) {
+        munmap(ix->map, ix->map_len);
+        ix->map = NULL;
+        ix->map_len = 0;
+        return;
+    }
+
+    ix->nuids = h->nuids;
+    ix->npost = h->npost;
+    ix->nterms = h->nterms;
+    ix->uids = (const uint32_t *) (h + 1);
+    ix->post = ix->uids + ix->nuids;
+    ix->terms = (const search_term *) (ix->post + ix->npost);
+}
+
+static void search_unload(search_index *ix)
+{
+    if (ix->map != NULL) {
+        munmap(ix->map, ix->map_len);
+    }
+    free(ix->log);
+    free(ix->added);
+    memset(ix, 0, sizeof(*ix));
+}
+
+/* Take the index and log of dir as they are now */
+static int search_load(search_index *ix, int dir, uint32_t uidvalidity)
+{
+    const char *p, *end;
+    const search_rec *rec;
+    int fd;
+
+    memset(ix, 0, sizeof(*ix));
+    if ((fd = search_log_open(dir, uidvalidity)) < 0) {
+        return -1;
+    }
+    ix->log = search_log_read(fd, &ix->log_len);
+    search_map(ix, dir, uidvalidity);
+    close(fd);
+    if (ix->log == NULL) {
+        search_unload(ix);
+        return -1;
+    }
+
+    if ((ix->added = malloc((ix->log_len / sizeof(search_rec) + 1) * sizeof(uint32_t))) == NULL) {
+        search_unload(ix);
+        return -1;
+    }
+    p = ix->log;
+    end = ix->log + ix->log_len;
+    while ((rec = search_rec_next(&p, end)) != NULL) {
+        if (rec->op == SEARCH_LOG_ADD) {
+            ix->added[ix->nadded++] = rec->uid;
+        }
+    }
+    ix->nadds = ix->nadded;
+    ix->nadded = search_unique(ix->added, ix->nadded);
+    ix->ok = 1;
+
+    return 0;
+}
+
+static int search_indexed(search_index *ix, uint32_t uid)
+{
+    return search_has(ix->uids, ix->nuids, uid) || search_has(ix->added, ix->nadded, uid);
+}
+
+/* Postings of term in the mapped index */
+static const uint32_t *search_postings(search_index *ix, uint32_t term, size_t *n)
+{
+    size_t lo = 0, hi = ix->nterms, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ix->terms[mid].term < term) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == ix->nterms || ix->terms[lo].term != term || ix->terms[lo].off > ix->npost
+            || ix->terms[lo].n > ix->npost - ix->terms[lo].off) {
+        *n = 0;
+        return NULL;
+    }
+
+    *n = ix->terms[lo].n;
+    return ix->post + ix->terms[lo].off;
+}
+
+/*-
+ * Indexed messages that have every trigram of q, sorted into *out.
+ * Any other indexed message can't match it.
+ */
+static ssize_t search_candidates(search_index *ix, const search_query *q, uint32_t **out)
+{
+    const char *p, *end = ix->log + ix->log_len;
+    const search_rec *rec;
+    const uint32_t *post;
+    uint32_t *cand = NULL, *list, term;
+    size_t ncand = 0, npost, n, k;
+
+    for (size_t i=0; i + 3 <= q->len; i++) {
+        term = search_term_of(q->what, q->str + i);
+        post = search_postings(ix, term, &npost);
+        if ((list = malloc((npost + ix->nadds + 1) * sizeof(uint32_t))) == NULL) {
+            free(cand);
+            return -1;
+        }
+        if (npost > 0) {
+            memcpy(list, post, npost * sizeof(uint32_t));
+        }
+        n = npost;
+        for (p = ix->log; (rec = search_rec_next(&p, end)) != NULL;) {
+            if (rec->op == SEARCH_LOG_ADD && n < npost + ix->nadds
+                    && search_has((const uint32_t *) (rec + 1), rec->n, term)) {
+                list[n++] = rec->uid;
+            }
+        }
+        if (n > npost) {
+            n = search_unique(list, n);
+        }
+
+        if (i == 0) {
+            cand = list;
+            ncand = n;
+        } else {
+            /* Both sorted, keep what is in both */
+            k = 0;
+            for (size_t a=0, b=0; a < ncand && b < n;) {
+                if (cand[a] < list[b]) {
+                    a++;
+                } else if (cand[a] > list[b]) {
+                    b++;
+                } else {
+                    cand[k++] = cand[a];
+                    a++;
+                    b++;
+                }
+            }
+            ncand = k;
+            free(list);
+        }
+        if (ncand == 0) {
+            break;
+        }
+    }
+
+    *out = cand;
+    return ncand;
+}
+
+static int search_alive_init(search_alive *alive, const store_files *files, const char *log, size_t log_len)
+{
+    const char *p = log, *end = log + log_len;
+    const search_rec *rec;
+    uint32_t *dropped;
+
+    memset(alive, 0, sizeof(*alive));
+    alive->files = files;
+    alive->max = files->count > 0 ? files->uids[files->count - 1] : 0;
+
+    if ((dropped = malloc((log_len / sizeof(search_rec) + 1) * sizeof(uint32_t))) == NULL) {
+        return -1;
+    }
+    while ((rec = search_rec_next(&p, end)) != NULL) {
+        if (rec->op == SEARCH_LOG_DROP) {
+            dropped[alive->ndropped++] = rec->uid;
+        }
+    }
+    alive->ndropped = search_unique(dropped, alive->ndropped);
+    alive->dropped = dropped;
+
+    if (alive->max < SEARCH_BITMAP_MAX && (alive->bits = calloc(alive->max / 64 + 1, sizeof(uint64_t))) != NULL) {
+        for (size_t i=0; i < files->count; i++) {
+            search_set(alive->bits, files->uids[i]);
+        }
+    }
+
+    return 0;
+}
+
+/*-
+ * Gone from the mailbox: expunged through us, or at most the last
+ * uid the search knows of and not in the mailbox. Later ones came
+ * after the search started, they are kept.
+ */
+static int search_is_alive(search_alive *alive, uint32_t uid)
+{
+    if (search_has(alive->dropped, alive->ndropped, uid)) {
+        return 0;
+    }
+    if (uid > alive->max) {
+        return 1;
+    }
+    if (alive->bits != NULL) {
+        return search_isset(alive->bits, uid);
+    }
+
+    return search_has(alive->files->uids, alive->files->count, uid);
+}
+
+static void search_alive_free(search_alive *alive)
+{
+    free((uint32_t *) alive->dropped);
+    free(alive->bits);
+}
+
+/* Terms and uids of the ADD records of data, packed as term << 32 | uid */
+static size_t search_pairs(const char *data, size_t len, uint64_t *pairs, size_t n, search_alive *alive)
+{
+    const char *p = data, *end = data + len;
+    const search_rec *rec;
+    const uint32_t *terms;
+
+    while ((rec = search_rec_next(&p, end)) != NULL) {
+        if (rec->op != SEARCH_LOG_ADD || !search_is_alive(alive, rec->uid)) {
+            continue;
+        }
+        terms = (const uint32_t *) (rec + 1);
+        for (size_t i=0; i < rec->n; i++) {
+            pairs[n++] = (uint64_t) terms[i] << 32 | rec->uid;
+        }
+    }
+
+    return n;
+}
+
+static int search_write(FILE *f, const void *data, size_t len)
+{
+    return len == 0 || fwrite(data, len, 1, f) == 1 ? 0 : -1;
+}
+
+/*-
+ * Fold the index, the log and extra into a new index. Messages that
+ * left the mailbox are dropped on the way, the log is emptied. Called
+ * with the log locked.
+ */
+static int search_fold(int log, int dir, const store_files *files, const char *extra, size_t extra_len)
+{
+    search_index ix;
+    search_alive alive;
+    search_term *terms = NULL, *grown;
+    search_hdr h;
+    const uint32_t *post;
+    uint64_t *pairs = NULL;
+    uint32_t *uids = NULL, t, uid, last;
+    size_t npairs = 0, nuids = 0, nterms = 0, cap = 0, npost = 0, bt = 0, pi = 0, n, a;
+    int more;
+    const char *p, *end;
+    const search_rec *rec;
+    FILE *out = NULL;
+    int fd, ret = -1;
+
+    memset(&ix, 0, sizeof(ix));
+    if ((ix.log = search_log_read(log, &ix.log_len)) == NULL) {
+        return -1;
+    }
+    search_map(&ix, dir, files->uidvalidity);
+    if (search_alive_init(&alive, files, ix.log, ix.log_len) < 0) {
+        search_unload(&ix);
+        return -1;
+    }
+
+    /* Every record has at most as many terms as it has bytes */
+    pairs = malloc((ix.log_len + extra_len) / sizeof(uint32_t) * sizeof(uint64_t) + sizeof(uint64_t));
+    uids = malloc((ix.nuids + (ix.log_len + extra_len) / sizeof(search_rec) + 1) * sizeof(uint32_t));
+    if (pairs == NULL || uids == NULL) {
+        goto out;
+    }
+    npairs = search_pairs(ix.log, ix.log_len, pairs, 0, &alive);
+    npairs = search_pairs(extra, extra_len, pairs, npairs, &alive);
+    qsort(pairs, npairs, sizeof(uint64_t), search_u64cmp);
+
+    for (size_t i=0; i < ix.nuids; i++) {
+        if (search_is_alive(&alive, ix.uids[i])) {
+            uids[nuids++] = ix.uids[i];
+        }
+    }
+    for (int k=0; k < 2; k++) {
+        p = k == 0 ? ix.log : extra;
+        end = k == 0 ? ix.log + ix.log_len : extra + extra_len;
+        while ((rec = search_rec_next(&p, end)) != NULL) {
+            if (rec->op == SEARCH_LOG_ADD && search_is_alive(&alive, rec->uid)) {
+                uids[nuids++] = rec->uid;
+            }
+        }
+    }
+    nuids = search_unique(uids, nuids);
+
+    if ((fd = openat(dir, SEARCH_INDEX_TMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+        goto out;
+    }
+    if ((out = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        goto out;
+    }
+    memset(&h, 0, sizeof(h));
+    if (search_write(out, &h, sizeof(h)) < 0 || search_write(out, uids, nuids * sizeof(uint32_t)) < 0) {
+        goto out;
+    }
+
+    /* Terms of both in order, postings of a term merged as they go */
+    while (bt < ix.nterms || pi < npairs) {
+        t = bt < ix.nterms ? ix.terms[bt].term : UINT32_MAX;
+        if (pi < npairs && (uint32_t) (pairs[pi] >> 32) < t) {
+            t = pairs[pi] >> 32;
+        }
+        post = NULL;
+        n = 0;
+        if (bt < ix.nterms && ix.terms[bt].term == t) {
+            post = search_postings(&ix, t, &n);
+            bt++;
+        }
+
+        if (nterms == cap) {
+            cap = cap > 0 ? cap * 2 : 1024;
+            if ((grown = realloc(terms, cap * sizeof(search_term))) == NULL) {
+                goto out;
+            }
+            terms = grown;
+        }
+        terms[nterms].term = t;
+        terms[nterms].off = npost;
+
+        /* Both sorted, duplicates end up next to each other */
+        for (a = 0, last = 0;; last = uid) {
+            more = pi < npairs && (uint32_t) (pairs[pi] >> 32) == t;
+            if (a < n && (!more || post[a] <= (uint32_t) pairs[pi])) {
+                uid = post[a++];
+            } else if (more) {
+                uid = (uint32_t) pairs[pi++];
+            } else {
+                break;
+            }
+            if (uid == last || !search_is_alive(&alive, uid)) {
+                continue;
+            }
+            if (search_write(out, &uid, sizeof(uid)) < 0) {
+                goto out;
+            }
+            npost++;
+        }
+        if ((terms[nterms].n = npost - terms[nterms].off) > 0) {
+            nterms++;
+        }
+    }
+
+    memcpy(h.magic, SEARCH_MAGIC, sizeof(h.magic));
+    h.uidvalidity = files->uidvalidity;
+    h.nuids = nuids;
+    h.npost = npost;
+    h.nterms = nterms;
+    if (search_write(out, terms, nterms * sizeof(search_term)) < 0 || fseek(out, 0, SEEK_SET) < 0
+            || search_write(out, &h, sizeof(h)) < 0 || fflush(out) != 0 || fsync(fileno(out)) < 0) {
+        goto out;
+    }
+
+    /* Whoever reads the log now finds it empty and the new index */
+    if (renameat(dir, SEARCH_INDEX_TMP, dir, SEARCH_INDEX) == 0 && ftruncate(log, sizeof(search_loghdr)) == 0) {
+        ret = 0;
+    }
+
+out:
+    if (out != NULL) {
+        fclose(out);
+    }
+    if (ret < 0) {
+        unlinkat(dir, SEARCH_INDEX_TMP, 0);
+    }
+    free(terms);
+    free(pairs);
+    free(uids);
+    search_alive_free(&alive);
+    search_unload(&ix);
+    return ret;
+}
+
+/* Records made by a search go to the log, or straight into the index */
+static void search_commit(const store_files *files, search_recs *r)
+{
+    struct stat st;
+    off_t size = 0;
+    int fd;
+
+    if ((fd = search_log_open(files->dir, files->uidvalidity)) < 0) {
+        return;
+    }
+    if (fstatat(files->dir, SEARCH_INDEX, &st, 0) == 0) {
+        size = st.st_size / 8;
+    }
+    if (fstat(fd, &st) == 0 && st.st_size + r->len > (size_t) (size > SEARCH_LOG_MAX ? size : SEARCH_LOG_MAX)) {
+        search_fold(fd, files->dir, files, r->data, r->len);
+    } else {
+        search_log_write(fd, r->data, r->len);
+    }
+    close(fd);
+    r->len = 0;
+}
+
+void search_run(search_req *req)
+{
+    store_files *files = &req->files;
+    uint32_t *cands[SEARCH_QUERY_MAX];
+    ssize_t ncands[SEARCH_QUERY_MAX];
+    uint8_t check[SEARCH_QUERY_MAX], any, known;
+    search_recs r = { NULL, 0, 0 };
+    search_index ix;
+    store_map map;
+    uint32_t uid;
+
+    if (search_load(&ix, files->dir, files->uidvalidity) < 0) {
+        /* Still answered, reading everything */
+        memset(&ix, 0, sizeof(ix));
+    }
+    for (size_t q=0; q < req->nqueries; q++) {
+        cands[q] = NULL;
+        ncands[q] = -1;
+        if (ix.ok && req->queries[q].what >= SEARCH_FROM && req->queries[q].len >= 3) {
+            ncands[q] = search_candidates(&ix, &req->queries[q], &cands[q]);
+        }
+    }
+
+    for (size_t i=0; i < files->count; i++) {
+        uid = files->uids[i];
+        known = ix.ok && search_indexed(&ix, uid);
+        any = !known && ix.ok;
+        for (size_t q=0; q < req->nqueries; q++) {
+            check[q] = !known || ncands[q] < 0 || search_has(cands[q], ncands[q], uid);
+            any |= check[q];
+        }
+        if (!any) {
+            continue;
+        }
+
+        if (store_files_map(files, i, &map) < 0) {
+            search_set(req->missed, i);
+            continue;
+        }
+        for (size_t q=0; q < req->nqueries; q++) {
+            if (check[q] && search_match(&req->queries[q], map.data, map.len)) {
+                search_set(search_hits(req, q), i);
+            }
+        }
+        if (!known && ix.ok && search_rec_add(&r, uid, map.data != NULL ? map.data : "", map.len) == 0
+                && r.len >= SEARCH_BATCH) {
+            search_commit(files, &r);
+        }
+        store_unmap(&map);
+    }
+
+    if (r.len > 0) {
+        search_commit(files, &r);
+    }
+    for (size_t q=0; q < req->nqueries; q++) {
+        free(cands[q]);
+    }
+    free(r.data);
+    search_unload(&ix);
+}
+
+void search_index_add(int dir, uint32_t uidvalidity, uint32_t uid, const char *data, size_t len)
+{
+    search_recs r = { NULL, 0, 0 };
+    int fd;
+
+    if (search_rec_add(&r, uid, data, len) == 0 && (fd = search_log_open(dir, uidvalidity)) >= 0) {
+        search_log_write(fd, r.data, r.len);
+        close(fd);
+    }
+    free(r.data);
+}
+
+void search_index_drop(int dir, uint32_t uidvalidity, const uint32_t *uids, size_t n)
+{
+    search_rec *recs;
+    int fd;
+
+    if (n == 0 || (recs = calloc(n, sizeof(search_rec))) == NULL) {
+        return;
+    }
+    for (size_t i=0; i < n; i++) {
+        recs[i].uid = uids[i];
+        recs[i].op = SEARCH_LOG_DROP;
+    }
+    if ((fd = search_log_open(dir, uidvalidity)) >= 0) {
+        search_log_write(fd, (const char *) recs, n * sizeof(search_rec));
+        close(fd);
+    }
+    free(recs);
+}
+
+static void *search_thread(void *arg)
+{
+    search_req *req;
+
+    for (;;) {
+        pthread_mutex_lock(&search_lock);
+        while (search_head == NULL && !search_stopping) {
+            pthread_cond_wait(&search_cond, &search_lock);
+        }
+        if (search_stopping) {
+            pthread_mutex_unlock(&search_lock);
+            return NULL;
+        }
+        req = search_head;
+        if ((search_head = req->next) == NULL) {
+            search_tail = NULL;
+        }
+        search_queued--;
+        pthread_mutex_unlock(&search_lock);
+
+        search_run(req);
+
+        /* A pointer is well below PIPE_BUF, the write is atomic */
+        while (write(req->notify, &req, sizeof(req)) < 0 && errno == EINTR);
+    }
+}
+
+int search_start(void)
+{
+    for (search_nthreads = 0; search_nthreads < SEARCH_THREADS; search_nthreads++) {
+        if (pthread_create(&search_threads[search_nthreads], NULL, search_thread, NULL) != 0) {
+            break;
+        }
+    }
+
+    return search_nthreads > 0 ? 0 : -1;
+}
+
+void search_stop(void)
+{
+    search_req *req;
+
+    pthread_mutex_lock(&search_lock);
+    search_stopping = 1;
+    pthread_cond_broadcast(&search_cond);
+    pthread_mutex_unlock(&search_lock);
+
+    for (size_t i=0; i < search_nthreads; i++) {
+        pthread_join(search_threads[i], NULL);
+    }
+    search_nthreads = 0;
+
+    while ((req = search_head) != NULL) {
+        search_head = req->next;
+        search_req_free(req);
+    }
+    search_tail = NULL;
+    search_queued = 0;
+}
+
+search_req *search_req_new(void)
+{
+    search_req *req;
+
+    if ((req = calloc(1, sizeof(search_req))) == NULL) {
+        return NULL;
+    }
+    req->files.dir = -1;
+    req->notify = -1;
+
+    return req;
+}
+
+int search_req_files(search_req *req, mailbox *mb)
+{
+    size_t words;
+
+    if (store_files_get(mb, &req->files) < 0) {
+        return -1;
+    }
+    words = (req->files.count + 63) / 64;
+    req->hits = calloc(words * req->nqueries + 1, sizeof(uint64_t));
+    req->missed = calloc(words + 1, sizeof(uint64_t));
+
+    return req->hits != NULL && req->missed != NULL ? 0 : -1;
+}
+
+void search_req_free(search_req *req)
+{
+    store_files_free(&req->files);
+    free(req->hits);
+    free(req->missed);
+    free(req);
+}
+
+int search_submit(search_req *req)
+{
+    pthread_mutex_lock(&search_lock);
+    if (search_nthreads == 0 || search_stopping || search_queued >= SEARCH_QUEUE) {
+        pthread_mutex_unlock(&search_lock);
+        return -1;
+    }
+
+    req->next = NULL;
+    if (search_tail != NULL) {
+        search_tail->next = req;
+    } else {
+        search_head = req;
+    }
+    search_tail = req;
+    search_queued++;
+    pthread_cond_signal(&search_cond);
+    pthread_mutex_unlock(&search_lock);
+
+    return 0;
+}
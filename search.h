@@ -0,0 +1,123 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <store.h>
+
+/* Part of the message a query looks at */
+#define SEARCH_BODY 0x0
+#define SEARCH_TEXT 0x1
+/* Any header field called name */
+#define SEARCH_HEADER 0x2
+/* Header fields kept in the index */
+#define SEARCH_FROM 0x3
+#define SEARCH_TO 0x4
+#define SEARCH_CC 0x5
+#define SEARCH_BCC 0x6
+#define SEARCH_SUBJECT 0x7
+
+/* Queries in a request, longest field name and string */
+#define SEARCH_QUERY_MAX 16
+#define SEARCH_NAME_MAX 64
+#define SEARCH_STRING_MAX 256
+
+/* A string to look for, ASCII letters match either case */
+typedef struct {
+    uint8_t what;
+    char name[SEARCH_NAME_MAX];
+    /* Lowercase */
+    char str[SEARCH_STRING_MAX];
+    size_t len;
+} search_query;
+
+/*-
+ * Strings are looked for on a pool of SEARCH_THREADS threads, in a
+ * copy of the file list of the mailbox taken when the request was
+ * made. Like auth_req, a request is handed to search_submit and its
+ * address written to notify once it is done. hits holds a bit per
+ * message for each query, missed the messages that couldn't be
+ * opened (renamed meanwhile) and are left to the submitter.
+ */
+typedef struct search_req {
+    store_files files;
+    search_query queries[SEARCH_QUERY_MAX];
+    size_t nqueries;
+    uint64_t *hits, *missed;
+    int notify;
+    /* Owned by the submitter */
+    void *data;
+    uint32_t serial;
+    struct search_req *next;
+} search_req;
+
+/* Start the pool, -1 on failure */
+int search_start(void);
+/* Stop the pool, requests not run yet are freed */
+void search_stop(void);
+search_req *search_req_new(void);
+/* Take the file list of mb once the queries are in, -1 on failure */
+int search_req_files(search_req *req, mailbox *mb);
+void search_req_free(search_req *req);
+/* Queue req, -1 if SEARCH_QUEUE requests are already waiting */
+int search_submit(search_req *req);
+/* Run req on the calling thread instead */
+void search_run(search_req *req);
+
+/* Set bit i of a per message bitmap, or test it */
+static inline void search_set(uint64_t *set, size_t i)
+{
+    set[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+static inline int search_isset(const uint64_t *set, size_t i)
+{
+    return (set[i / 64] >> (i % 64)) & 1;
+}
+
+/* Bitmap of query q in hits */
+static inline uint64_t *search_hits(search_req *req, size_t q)
+{
+    return req->hits + q * ((req->files.count + 63) / 64);
+}
+
+/* Does the message at data match q */
+int search_match(const search_query *q, const char *data, size_t len);
+/* First occurence of needle, lowercase, in hay, NULL if none */
+const char *search_find(const char *hay, size_t len, const char *needle, size_t n);
+
+/*-
+ * Keep the index of the mailbox in dir up to date: a message was
+ * appended with uid, or the uids were expunged.
+ */
+void search_index_add(int dir, uint32_t uidvalidity, uint32_t uid, const char *data, size_t len);
+void search_index_drop(int dir, uint32_t uidvalidity, const uint32_t *uids, size_t n);
+
+#endif /* ifndef SEARCH_H */
@@ -32,20 +32,11 @@
 #include <syslog.h>
 #include <imap.h>
 
-static imap_t *instance;
-
-void int_handler(int sig)
-{
-    if (instance != NULL) {
-        imap_close(instance);
-    }
-
-    exit(0);
-}
-
 int main(void)
 {
-    signal(SIGINT, int_handler);
+    imap_t *instance;
+
+    /* SIGINT and SIGTERM are waited for in imap_start */
     signal(SIGPIPE, SIG_IGN);
 
     openlog("sis", LOG_PID, LOG_MAIL);
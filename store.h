@@ -0,0 +1,257 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* Message flags, the first five are kept by the backend */
+#define STORE_SEEN 0x01
+#define STORE_ANSWERED 0x02
+#define STORE_FLAGGED 0x04
+#define STORE_DELETED 0x08
+#define STORE_DRAFT 0x10
+#define STORE_FLAGS 0x1f
+/* First session to see the message, never stored */
+#define STORE_RECENT 0x20
+/* Gone, still numbered by sessions that weren't told yet */
+#define STORE_EXPUNGED 0x40
+
+/* Most descriptors store_durable asks to sync */
+#define STORE_SYNC_MAX 4
+/* Most inotify watches a mailbox needs */
+#define STORE_WATCH_MAX 3
+/* Longest path of a mailbox or message file */
+#define STORE_PATH_MAX 1024
+
+/* Changes reported by store_rescan and store_expunge */
+#define STORE_EV_EXPUNGE 0x1
+#define STORE_EV_FLAGS 0x2
+
+/* Called with the sequence number a change applies to */
+typedef void (*store_cb)(void *arg, size_t seq, uint8_t ev);
+
+/*-
+ * What FETCH needs without touching the message itself. Records are
+ * loaded from the index when the mailbox is opened, sorted by uid,
+ * and kept in a single array; file names live in one shared blob.
+ */
+typedef struct {
+    uint32_t uid;
+    uint8_t flags;
+    time_t date;
+    size_t size;
+    /* Offset of the file name in mailbox names */
+    uint32_t name;
+    /* Last flag change and the session that made it */
+    uint32_t modseq, by;
+    /* Session that sees it as \Recent, 0 if none does */
+    uint32_t recent;
+    /* Sessions to tell about it once STORE_EXPUNGED */
+    uint32_t pending;
+} store_msg;
+
+struct mailbox;
+
+/*-
+ * The state of a mailbox, shared by every session of the worker that
+ * has it selected. Messages stay where they are when expunged until
+ * the last session numbering them was told, so that sequence numbers
+ * of the others don't move under them.
+ */
+typedef struct store_box {
+    char path[STORE_PATH_MAX];
+    /* Directory of the mailbox, message files are opened from it */
+    int dir;
+    store_msg *msgs;
+    size_t count, cap;
+    char *names;
+    size_t names_len, names_cap;
+    uint32_t uidvalidity, uidnext;
+    /* Last flag change, how many messages are STORE_EXPUNGED */
+    uint32_t modseq;
+    size_t gone;
+    /*-
+     * Sessions on it. The one bringing it up to date gets to see
+     * deliveries as \Recent, and leaves them in new/ if readonly.
+     */
+    struct mailbox *views;
+    struct store_box *next;
+    uint32_t claim;
+    uint8_t readonly;
+    /* Structure of the messages, see mime.h, opened by store_mime */
+    struct mime_cache *mime;
+    uint32_t mime_uidvalidity;
+    /*-
+     * Backend state. The Maildir one keeps an index and a log of
+     * changes next to the messages, see maildir.c.
+     */
+    int log;
+    uint32_t gen, disk_gen;
+    uint64_t session;
+    off_t log_off;
+    uint8_t locked, clean, dirty;
+    int64_t cur_sec, cur_nsec;
+} store_box;
+
+/*-
+ * A session's view of a store_box. It numbers the messages up to
+ * uid known minus the expunged ones it was told of, which are kept
+ * in hidden until the box lets them go. Only then does it need map.
+ */
+typedef struct mailbox {
+    store_box *box;
+    uint32_t id;
+    uint8_t readonly;
+    size_t count, recent;
+    uint32_t known, modseq;
+    /* Sorted uids */
+    uint32_t *hidden;
+    size_t nhidden, hidden_cap;
+    /* Box index of each sequence number while anything is hidden */
+    uint32_t *map;
+    size_t map_cap;
+    struct mailbox *next;
+} mailbox;
+
+/* Message i of the session, 0 based */
+static inline store_msg *store_get(mailbox *mb, size_t i)
+{
+    return &mb->box->msgs[mb->nhidden > 0 ? mb->map[i] : i];
+}
+
+/* Flags of m as the session sees them, \Recent included */
+static inline uint8_t store_flags(mailbox *mb, const store_msg *m)
+{
+    return (m->flags & STORE_FLAGS) | (m->recent == mb->id ? STORE_RECENT : 0);
+}
+
+/* A message mapped in memory, fd stays open for streaming */
+typedef struct {
+    int fd;
+    char *data;
+    size_t len;
+} store_map;
+
+/*-
+ * Path of the mailbox called name (len bytes, INBOX is the root one)
+ * of user. Returns -1 if the name is not acceptable.
+ */
+int store_path(char *dst, size_t max, const char *user, const char *name, size_t len);
+int store_exists(const char *path);
+int store_create(const char *path);
+/* Call cb with the name of every mailbox of user, INBOX first */
+int store_list(const char *user, void (*cb)(void *arg, const char *name), void *arg);
+
+/*-
+ * Open the mailbox at path, NULL on error. Sessions of the same
+ * thread opening the same path share its state.
+ */
+mailbox *store_open(const char *path, uint8_t readonly);
+/*-
+ * Catch up with changes made by others since, expunges and flags are
+ * reported through cb. Returns how many messages were added or -1.
+ */
+ssize_t store_rescan(mailbox *mb, store_cb cb, void *arg);
+void store_close(mailbox *mb);
+/*-
+ * Have the inotify instance fd watch whatever changes along with the
+ * mailbox at path. Up to STORE_WATCH_MAX watch descriptors are put
+ * in wds, returns their number or -1.
+ */
+int store_watch(int fd, const char *path, int *wds);
+/* Make the changes in between one batch, they nest */
+int store_begin(mailbox *mb);
+void store_end(mailbox *mb);
+/* Index of the first message with a uid not below uid */
+size_t store_find_uid(mailbox *mb, uint32_t uid);
+
+/* Map message i read-only, release it with store_unmap */
+int store_map_msg(mailbox *mb, size_t i, store_map *map);
+void store_unmap(store_map *map);
+/* Replace the stored flags of message i, once for every session */
+int store_set_flags(mailbox *mb, size_t i, uint8_t flags);
+/* Records of the structure of the messages, NULL if out of memory */
+struct mime_cache *store_mime(mailbox *mb);
+/* Remove the messages flagged \Deleted, reported through cb */
+size_t store_expunge(mailbox *mb, store_cb cb, void *arg);
+
+/*-
+ * Where the messages of a session are, for readers on other threads
+ * that must not touch the mailbox: a directory descriptor of their
+ * own, every uid and the file name of the message relative to dir.
+ */
+typedef struct {
+    int dir;
+    uint32_t uidvalidity;
+    size_t count;
+    uint32_t *uids, *names;
+    char *blob;
+} store_files;
+
+int store_files_get(mailbox *mb, store_files *files);
+void store_files_free(store_files *files);
+/* Map message i of files, -1 if it was renamed or removed since */
+int store_files_map(store_files *files, size_t i, store_map *map);
+
+/*-
+ * Descriptors to sync for the changes made to the mailbox to be
+ * durable, put in fds (STORE_SYNC_MAX long). Returns their number
+ * or -1, they are the caller's to close.
+ */
+ssize_t store_durable(mailbox *mb, int *fds);
+
+/*-
+ * A message on its way into the mailbox at path. It is written to
+ * tmp/ by store_draft_write, and delivered by store_draft_deliver
+ * once the caller has synced fd: a message must be on disk before it
+ * shows up in cur/. store_draft_drop removes what is left of it.
+ */
+typedef struct {
+    char path[STORE_PATH_MAX];
+    char tmp[STORE_PATH_MAX];
+    char name[STORE_PATH_MAX];
+    int fd;
+    size_t len;
+    uint8_t flags;
+    time_t date;
+} store_draft;
+
+int store_draft_write(store_draft *d, const char *path, const char *data, size_t len, uint8_t flags, time_t date);
+/* Put d in place, fds as for store_durable of the mailbox it went to */
+ssize_t store_draft_deliver(store_draft *d, int *fds);
+void store_draft_drop(store_draft *d);
+
+/* All of the above in one go, synced on the calling thread */
+int store_append(const char *path, const char *data, size_t len, uint8_t flags, time_t date);
+int store_copy(mailbox *mb, size_t i, const char *dest);
+
+#endif /* ifndef STORE_H */
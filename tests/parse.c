@@ -0,0 +1,182 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*-
+ * parse - check how command lines are split into tokens
+ *
+ * Runs imap_tokenize and imap_parse_cmd over tables of lines and
+ * compares what they give with what they should. Exits 1 if any
+ * line differs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <imap.h>
+#include <imap_cmds.h>
+
+/*-
+ * Tokens as their kind and text, joined by '|'. Kinds are a for atoms,
+ * q for quoted strings, l for literals and ( for lists. want is NULL
+ * when the line must be refused.
+ */
+static const struct {
+    const char *line, *want;
+} tokens[] = {
+    { "", "" },
+    { "   ", "" },
+    { "1:* FLAGS", "a:1:*|a:FLAGS" },
+    { "  INBOX   Sent ", "a:INBOX|a:Sent" },
+    { "\"a b\" \"\"", "q:a b|q:" },
+    { "\"q\\\"uo\\\\te\"x", "q:q\"uo\\te|a:x" },
+    { "{5}\r\nhello rest", "l:hello|a:rest" },
+    { "{5+}\r\nhello", "l:hello" },
+    { "{5}\nhello", "l:hello" },
+    { "{0}\r\n", "l:" },
+    { "{4}\r\n(\"{}", "l:(\"{}" },
+    { "(FLAGS (\\Seen \\Deleted))", "(:FLAGS (\\Seen \\Deleted)" },
+    { "(a (b (c)) d) e", "(:a (b (c)) d|a:e" },
+    { "()(x)", "(:|(:x" },
+    { "(\"x)\" {2}\r\n)( y)", "(:\"x)\" {2}\r\n)( y" },
+    { "(\"a\\\"b)\")", "(:\"a\\\"b)\"" },
+    { "BODY[HEADER.FIELDS (TO CC)]<0.10> UID", "a:BODY[HEADER.FIELDS (TO CC)]<0.10>|a:UID" },
+    { "a(b)", "a:a|(:b" },
+    { "\"open", NULL },
+    { "(a (b)", NULL },
+    { "(a \"b)", NULL },
+    { "a)", NULL },
+    { ")", NULL },
+    { "{5}\r\nhey", NULL },
+    { "{5}hello", NULL },
+    { "{5\r\nhello", NULL },
+    { "{x}\r\n", NULL },
+    { "{99999999999}\r\n", NULL },
+    { "(a {3}\r\nb)", NULL },
+};
+
+/* Tag, command id and argument count imap_parse_cmd should give */
+static const struct {
+    const char *line, *tag;
+    uint8_t id;
+    size_t count;
+} cmds[] = {
+    { "a1 FETCH 1:* (FLAGS UID)", "a1", IMAP_CMD_FETCH, 2 },
+    { "a2 login alice \"s e\"", "a2", IMAP_CMD_LOGIN, 2 },
+    { "a3 NOOP", "a3", IMAP_CMD_NOOP, 0 },
+    { "a4 APPEND INBOX {3}\r\nabc", "a4", IMAP_CMD_APPEND, 2 },
+    { "a5 FROB x", "a5", 0xff, 1 },
+    { "a6 SELECT \"INBOX", "a6", 0xff, 0 },
+    { "a7 ", "a7", 0xff, 0 },
+    { "NOOP", "*", 0xff, 0 },
+    { " NOOP", "*", 0xff, 0 },
+    { "123456789012345678901234567890123 NOOP", "*", 0xff, 0 },
+};
+
+static int failed = 0;
+
+/* What toks hold, in the notation of tokens[] */
+static void show(char *out, size_t max, const imap_tok *toks, ssize_t n)
+{
+    static const char kinds[] = { 'a', 'q', 'l', '(' };
+    size_t len = 0;
+
+    out[0] = '\0';
+    for (ssize_t i=0; i < n && len < max; i++) {
+        len += snprintf(out + len, max - len, "%s%c:%.*s", i > 0 ? "|" : "",
+                kinds[toks[i].type], (int) toks[i].len, toks[i].p);
+    }
+}
+
+static void check_tokens(void)
+{
+    imap_tok toks[IMAP_TOK_MAX];
+    char line[256], got[512];
+    ssize_t n;
+
+    for (size_t i=0; i < sizeof(tokens) / sizeof(tokens[0]); i++) {
+        /* Quoted strings are unescaped in place */
+        snprintf(line, sizeof(line), "%s", tokens[i].line);
+        n = imap_tokenize(line, strlen(line), toks, IMAP_TOK_MAX);
+        show(got, sizeof(got), toks, n);
+        if (tokens[i].want == NULL ? n >= 0 : n < 0 || strcmp(got, tokens[i].want) != 0) {
+            fprintf(stderr, "parse: \"%s\": got %s, wanted %s\n", tokens[i].line,
+                    n < 0 ? "(refused)" : got, tokens[i].want != NULL ? tokens[i].want : "(refused)");
+            failed = 1;
+        }
+    }
+}
+
+/* Exactly max tokens fit, one more and the line is refused */
+static void check_max(void)
+{
+    imap_tok toks[IMAP_TOK_MAX];
+    char line[2 * IMAP_TOK_MAX + 2];
+    ssize_t n;
+
+    for (size_t i=0; i <= IMAP_TOK_MAX; i++) {
+        line[2 * i] = 'x';
+        line[2 * i + 1] = ' ';
+    }
+    if ((n = imap_tokenize(line, 2 * IMAP_TOK_MAX, toks, IMAP_TOK_MAX)) != IMAP_TOK_MAX) {
+        fprintf(stderr, "parse: %d atoms: got %zd tokens\n", IMAP_TOK_MAX, n);
+        failed = 1;
+    }
+    if ((n = imap_tokenize(line, 2 * IMAP_TOK_MAX + 2, toks, IMAP_TOK_MAX)) >= 0) {
+        fprintf(stderr, "parse: %d atoms: got %zd tokens, wanted it refused\n", IMAP_TOK_MAX + 1, n);
+        failed = 1;
+    }
+}
+
+static void check_cmds(void)
+{
+    imap_tok toks[IMAP_TOK_MAX];
+    char line[256];
+    imap_cmd cmd;
+
+    for (size_t i=0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+        snprintf(line, sizeof(line), "%s", cmds[i].line);
+        cmd = imap_parse_cmd(line, strlen(line), toks, IMAP_TOK_MAX);
+        if (cmd.tag.len != strlen(cmds[i].tag) || memcmp(cmd.tag.p, cmds[i].tag, cmd.tag.len) != 0
+                || cmd.id != cmds[i].id || cmd.p_count != cmds[i].count) {
+            fprintf(stderr, "parse: \"%s\": got tag %.*s, id 0x%02x, %zu arguments, "
+                    "wanted %s, 0x%02x, %zu\n", cmds[i].line, (int) cmd.tag.len, cmd.tag.p,
+                    cmd.id, cmd.p_count, cmds[i].tag, cmds[i].id, cmds[i].count);
+            failed = 1;
+        }
+    }
+}
+
+int main(void)
+{
+    check_tokens();
+    check_max();
+    check_cmds();
+
+    printf("parse: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
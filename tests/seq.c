@@ -0,0 +1,226 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*-
+ * seq - check how sequence and uid sets are parsed and walked
+ *
+ * The set functions are static in imap.routines, so imap.c is built
+ * into this file instead of linked. Each set of a table is parsed
+ * against a mailbox of given uids, then its merged ranges and the
+ * messages a walk visits are compared with what they should be.
+ * Exits 1 if any set differs.
+ */
+
+#include <imap.c>
+
+#define SEQ_UIDS_MAX 16
+
+/*-
+ * Sets parsed against a mailbox holding uids, as sequence numbers or
+ * as uids. ranges is NULL when the set must be refused, walk lists
+ * the 0 based indexes visited.
+ */
+static const struct {
+    const char *set;
+    uint8_t uid;
+    uint32_t uids[SEQ_UIDS_MAX];
+    size_t count;
+    const char *ranges, *walk;
+} sets[] = {
+    { "1:*", 0, { 1, 2, 3, 4, 5 }, 5, "1:5", "0 1 2 3 4" },
+    { "*:2", 0, { 1, 2, 3, 4, 5 }, 5, "2:5", "1 2 3 4" },
+    { "*", 0, { 0 }, 0, "1:1", "" },
+    { "1:*", 0, { 0 }, 0, "1:1", "" },
+    { "*", 1, { 0 }, 0, "1:1", "" },
+    { "3:9", 0, { 1, 2, 3, 4 }, 4, "3:9", "2 3" },
+    { "5:7,1:3,2:6,9,10", 0, { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 }, 10, "1:7,9:10", "0 1 2 3 4 5 6 8 9" },
+    { "3,1,2", 0, { 1, 2, 3 }, 3, "1:3", "0 1 2" },
+    { "4,4,4:4", 0, { 1, 2, 3, 4 }, 4, "4:4", "3" },
+    { "1:2,4:5,3", 0, { 1, 2, 3, 4, 5 }, 5, "1:5", "0 1 2 3 4" },
+    { "1:*", 1, { 3, 7, 9 }, 3, "1:9", "0 1 2" },
+    { "9:7,*", 1, { 3, 7, 9 }, 3, "7:9", "1 2" },
+    { "3:7,9:*", 1, { 2, 4, 6, 8, 10 }, 5, "3:7,9:10", "1 2 4" },
+    { "1,5,11", 1, { 2, 4, 6, 8, 10 }, 5, "1:1,5:5,11:11", "" },
+    { "1:4294967295,5", 1, { 2, 4 }, 2, "1:4294967295", "0 1" },
+    { "4294967295,1:4294967294", 1, { 2, 4 }, 2, "1:4294967295", "0 1" },
+    { "0", 0, { 1 }, 1, NULL, NULL },
+    { "1:0", 0, { 1 }, 1, NULL, NULL },
+    { "1:", 0, { 1 }, 1, NULL, NULL },
+    { ",1", 0, { 1 }, 1, NULL, NULL },
+    { "1,", 0, { 1 }, 1, NULL, NULL },
+    { "1::2", 0, { 1 }, 1, NULL, NULL },
+    { "1;2", 0, { 1 }, 1, NULL, NULL },
+    { "4294967296", 1, { 1 }, 1, NULL, NULL },
+    { "", 0, { 1 }, 1, NULL, NULL },
+};
+
+static int failed = 0;
+
+/* Ranges of set as "a:b,c:d" */
+static void show_ranges(char *out, size_t max, const imap_seqset *set)
+{
+    size_t len = 0;
+
+    out[0] = '\0';
+    for (size_t i=0; i < set->n && len < max; i++) {
+        len += snprintf(out + len, max - len, "%s%u:%u", i > 0 ? "," : "",
+                (unsigned) set->r[i][0], (unsigned) set->r[i][1]);
+    }
+}
+
+/* Indexes a walk of set over mb visits, as "0 1 2" */
+static void show_walk(char *out, size_t max, imap_seqset *set, mailbox *mb)
+{
+    size_t len = 0;
+    ssize_t i;
+
+    out[0] = '\0';
+    while ((i = imap_seq_next(set, mb)) >= 0 && len < max) {
+        len += snprintf(out + len, max - len, "%s%zd", len > 0 ? " " : "", i);
+    }
+}
+
+/* A mailbox of nothing but the given uids, enough for the sets */
+static void fake(mailbox *mb, store_box *box, store_msg *msgs, const uint32_t *uids, size_t count)
+{
+    memset(box, 0, sizeof(*box));
+    memset(mb, 0, sizeof(*mb));
+    for (size_t i=0; i < count; i++) {
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].uid = uids[i];
+    }
+    box->msgs = msgs;
+    box->count = count;
+    mb->box = box;
+    mb->count = count;
+}
+
+static void check_sets(void)
+{
+    store_msg msgs[SEQ_UIDS_MAX];
+    char text[64], ranges[256], walk[256];
+    imap_seqset set;
+    store_box box;
+    mailbox mb;
+    imap_tok tok;
+    int ret;
+
+    for (size_t i=0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+        fake(&mb, &box, msgs, sets[i].uids, sets[i].count);
+        snprintf(text, sizeof(text), "%s", sets[i].set);
+        tok.p = text;
+        tok.len = strlen(text);
+        tok.type = IMAP_TOK_ATOM;
+
+        if ((ret = imap_seq_init(&set, &tok, sets[i].uid, &mb)) < 0) {
+            if (sets[i].ranges != NULL) {
+                fprintf(stderr, "seq: %s%s: refused\n", sets[i].uid ? "UID " : "", sets[i].set);
+                failed = 1;
+            }
+            continue;
+        }
+        show_ranges(ranges, sizeof(ranges), &set);
+        show_walk(walk, sizeof(walk), &set, &mb);
+        imap_seq_free(&set);
+        if (sets[i].ranges == NULL || strcmp(ranges, sets[i].ranges) != 0 || strcmp(walk, sets[i].walk) != 0) {
+            fprintf(stderr, "seq: %s%s: got ranges %s walk \"%s\", wanted %s walk \"%s\"\n",
+                    sets[i].uid ? "UID " : "", sets[i].set, ranges, walk,
+                    sets[i].ranges != NULL ? sets[i].ranges : "(refused)",
+                    sets[i].walk != NULL ? sets[i].walk : "");
+            failed = 1;
+        }
+    }
+}
+
+/*-
+ * More ranges than fit inline: apart, they must all be kept once the
+ * set moved to the heap, touching each other they come down to one.
+ */
+static void check_growth(void)
+{
+    char text[16 * IMAP_SEQ_INLINE * 4], want[sizeof(text)], ranges[sizeof(text)];
+    size_t n = 4 * IMAP_SEQ_INLINE + 1, len;
+    imap_seqset set;
+    store_box box;
+    mailbox mb;
+    imap_tok tok;
+
+    fake(&mb, &box, NULL, NULL, 0);
+    tok.p = text;
+    tok.type = IMAP_TOK_ATOM;
+
+    /* Backwards, so that the sort has something to do */
+    len = 0;
+    for (size_t i=n; i > 0; i--) {
+        len += snprintf(text + len, sizeof(text) - len, "%s%zu", i < n ? "," : "", 3 * i);
+    }
+    tok.len = len;
+    len = 0;
+    for (size_t i=1; i <= n; i++) {
+        len += snprintf(want + len, sizeof(want) - len, "%s%zu:%zu", i > 1 ? "," : "", 3 * i, 3 * i);
+    }
+    if (imap_seq_init(&set, &tok, 0, &mb) < 0) {
+        fprintf(stderr, "seq: %zu ranges: refused\n", n);
+        failed = 1;
+    } else {
+        show_ranges(ranges, sizeof(ranges), &set);
+        if (set.r == set.inl || set.n != n || strcmp(ranges, want) != 0) {
+            fprintf(stderr, "seq: %zu ranges: got %zu%s, %s\n", n, set.n,
+                    set.r == set.inl ? " inline" : "", ranges);
+            failed = 1;
+        }
+        imap_seq_free(&set);
+    }
+
+    len = 0;
+    for (size_t i=1; i <= n; i++) {
+        len += snprintf(text + len, sizeof(text) - len, "%s%zu:%zu", i > 1 ? "," : "", 2 * i - 1, 2 * i);
+    }
+    tok.len = len;
+    snprintf(want, sizeof(want), "1:%zu", 2 * n);
+    if (imap_seq_init(&set, &tok, 0, &mb) < 0) {
+        fprintf(stderr, "seq: %zu touching ranges: refused\n", n);
+        failed = 1;
+    } else {
+        show_ranges(ranges, sizeof(ranges), &set);
+        if (strcmp(ranges, want) != 0) {
+            fprintf(stderr, "seq: %zu touching ranges: got %s, wanted %s\n", n, ranges, want);
+            failed = 1;
+        }
+        imap_seq_free(&set);
+    }
+}
+
+int main(void)
+{
+    check_sets();
+    check_growth();
+
+    printf("seq: %s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
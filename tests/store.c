@@ -0,0 +1,146 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*-
+ * store - check the file names the Maildir backend gives messages
+ *
+ * Appends messages to a throwaway Maildir and changes their flags,
+ * then looks at what ended up in cur/ and new/. Exits 1 if a name is
+ * not what it should be.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <store.h>
+
+static const char msg[] = "From: a@example.org\r\nSubject: test\r\n\r\nbody\r\n";
+static int failed = 0;
+
+/* Info part of the only message in dir of root, NULL if there is none */
+static const char *info(const char *root, const char *dir, char *name, size_t max)
+{
+    char path[STORE_PATH_MAX];
+    struct dirent *e;
+    const char *ret = NULL;
+    DIR *d;
+
+    snprintf(path, sizeof(path), "%s/%s", root, dir);
+    if ((d = opendir(path)) == NULL) {
+        return NULL;
+    }
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.') {
+            snprintf(name, max, "%s", e->d_name);
+            ret = strstr(name, ":2,");
+            ret = ret != NULL ? ret + 3 : name + strlen(name);
+        }
+    }
+    closedir(d);
+
+    return ret;
+}
+
+static void expect(const char *root, const char *dir, const char *want, const char *what)
+{
+    char name[512];
+    const char *got = info(root, dir, name, sizeof(name));
+
+    if (got == NULL || strcmp(got, want) != 0) {
+        fprintf(stderr, "store: %s: %s/%s, wanted info \"%s\"\n", what, dir,
+                got != NULL ? name : "(none)", want);
+        failed = 1;
+    }
+}
+
+/* Leave garbage where the store functions will have their buffers */
+static void scribble(void)
+{
+    volatile char junk[16384];
+
+    for (size_t i=0; i < sizeof(junk); i++) {
+        junk[i] = (char) 0xff;
+    }
+}
+
+static int run(const char *root, uint8_t flags, const char *want)
+{
+    char box[STORE_PATH_MAX];
+    mailbox *mb;
+
+    snprintf(box, sizeof(box), "%s/%s", root, want[0] != '\0' ? want : "none");
+    scribble();
+    if (store_create(box) < 0 || store_append(box, msg, sizeof(msg) - 1, flags, time(NULL)) < 0) {
+        fprintf(stderr, "store: %s: can't append\n", box);
+        return -1;
+    }
+    expect(box, "cur", want, "APPEND");
+
+    /* Everything on, then everything off again */
+    if ((mb = store_open(box, 0)) == NULL || mb->count != 1) {
+        fprintf(stderr, "store: %s: can't open\n", box);
+        return -1;
+    }
+    scribble();
+    if (store_set_flags(mb, 0, STORE_FLAGS) < 0 || (scribble(), store_set_flags(mb, 0, 0)) < 0) {
+        fprintf(stderr, "store: %s: can't store flags\n", box);
+        store_close(mb);
+        return -1;
+    }
+    store_close(mb);
+    expect(box, "cur", "", "STORE FLAGS ()");
+
+    return 0;
+}
+
+int main(void)
+{
+    char root[] = "/tmp/sis-test.XXXXXX";
+    char cmd[64];
+    int ret = 0;
+
+    if (mkdtemp(root) == NULL) {
+        perror("mkdtemp");
+        return 2;
+    }
+
+    if (run(root, 0, "") < 0 || run(root, STORE_SEEN | STORE_FLAGGED, "FS") < 0) {
+        ret = 2;
+    }
+
+    snprintf(cmd, sizeof(cmd), "rm -r %s", root);
+    system(cmd);
+
+    if (ret == 0 && failed) {
+        ret = 1;
+    }
+    printf("store: %s\n", ret == 0 ? "ok" : "FAILED");
+    return ret;
+}
@@ -0,0 +1,318 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+#include <config.h>
+#include <tls.h>
+
+/* Entries hashing to the same place, the oldest is replaced */
+#define TLS_CACHE_WAYS 4
+#define TLS_CACHE_SHARDS 16
+/* Encoded sessions larger than this are not cached */
+#define TLS_SESSION_MAX 1024
+
+typedef struct {
+    time_t expires;
+    uint16_t id_len, len;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char der[TLS_SESSION_MAX];
+} tls_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    /* TLS_CACHE_WAYS entries per set */
+    size_t sets;
+    tls_entry *entries;
+} tls_shard;
+
+typedef struct {
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+} tls_key;
+
+static tls_shard *tls_shards;
+static size_t tls_size;
+
+/* keys[0] seals new tickets, keys[1] is only accepted */
+static tls_key tls_keys[2];
+static time_t tls_rotated;
+static pthread_rwlock_t tls_keys_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* FNV-1a, ids are random already */
+static uint64_t tls_hash(const unsigned char *id, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i=0; i < len; i++) {
+        h = (h ^ id[i]) * 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/* Shard and first way of id, the shard is returned locked */
+static tls_entry *tls_set(const unsigned char *id, size_t len, tls_shard **shard)
+{
+    uint64_t h = tls_hash(id, len);
+
+    *shard = &tls_shards[h % TLS_CACHE_SHARDS];
+    pthread_mutex_lock(&(*shard)->lock);
+
+    return &(*shard)->entries[(h / TLS_CACHE_SHARDS) % (*shard)->sets * TLS_CACHE_WAYS];
+}
+
+static int tls_new_session(SSL *ssl, SSL_SESSION *sess)
+{
+    const unsigned char *id;
+    unsigned int id_len;
+    unsigned char *p;
+    tls_shard *shard;
+    tls_entry *set, *e;
+    int len;
+
+    id = SSL_SESSION_get_id(sess, &id_len);
+    if ((len = i2d_SSL_SESSION(sess, NULL)) <= 0 || len > TLS_SESSION_MAX || id_len == 0) {
+        return 0;
+    }
+
+    set = tls_set(id, id_len, &shard);
+    e = &set[0];
+    for (size_t i=1; i < TLS_CACHE_WAYS; i++) {
+        if (set[i].expires < e->expires) {
+            e = &set[i];
+        }
+    }
+    p = e->der;
+    e->len = i2d_SSL_SESSION(sess, &p);
+    memcpy(e->id, id, id_len);
+    e->id_len = id_len;
+    e->expires = time(NULL) + SSL_SESSION_get_timeout(sess);
+    pthread_mutex_unlock(&shard->lock);
+
+    /* Nothing kept a reference to sess */
+    return 0;
+}
+
+static SSL_SESSION *tls_get_session(SSL *ssl, const unsigned char *id, int len, int *copy)
+{
+    const unsigned char *p;
+    SSL_SESSION *sess = NULL;
+    tls_shard *shard;
+    tls_entry *set;
+    time_t now = time(NULL);
+
+    *copy = 0;
+    set = tls_set(id, len, &shard);
+    for (size_t i=0; i < TLS_CACHE_WAYS; i++) {
+        if (set[i].id_len == len && set[i].expires > now && !memcmp(set[i].id, id, len)) {
+            p = set[i].der;
+            sess = d2i_SSL_SESSION(NULL, &p, set[i].len);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return sess;
+}
+
+static void tls_remove_session(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+    const unsigned char *id;
+    unsigned int len;
+    tls_shard *shard;
+    tls_entry *set;
+
+    id = SSL_SESSION_get_id(sess, &len);
+    set = tls_set(id, len, &shard);
+    for (size_t i=0; i < TLS_CACHE_WAYS; i++) {
+        if (set[i].id_len == len && !memcmp(set[i].id, id, len)) {
+            set[i].id_len = 0;
+            set[i].expires = 0;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static int tls_new_key(tls_key *key)
+{
+    return RAND_bytes((unsigned char *) key, sizeof(*key)) == 1 ? 0 : -1;
+}
+
+/* Called with the write lock held */
+static void tls_rotate(time_t now)
+{
+    tls_key next;
+
+    if (tls_new_key(&next) < 0) {
+        return;
+    }
+    tls_keys[1] = tls_keys[0];
+    tls_keys[0] = next;
+    tls_rotated = now;
+}
+
+static int tls_ticket_key(SSL *ssl, unsigned char name[16], unsigned char *iv,
+        EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+{
+    OSSL_PARAM params[3];
+    time_t now = time(NULL);
+    tls_key *key = NULL;
+    int ret = 1;
+
+    if (enc && now - tls_rotated >= TICKET_ROTATE) {
+        pthread_rwlock_wrlock(&tls_keys_lock);
+        if (now - tls_rotated >= TICKET_ROTATE) {
+            tls_rotate(now);
+        }
+        pthread_rwlock_unlock(&tls_keys_lock);
+    }
+
+    pthread_rwlock_rdlock(&tls_keys_lock);
+    if (enc) {
+        key = &tls_keys[0];
+        memcpy(name, key->name, sizeof(key->name));
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) {
+            ret = -1;
+        }
+    } else if (!memcmp(name, tls_keys[0].name, sizeof(tls_keys[0].name))) {
+        key = &tls_keys[0];
+    } else if (!memcmp(name, tls_keys[1].name, sizeof(tls_keys[1].name))) {
+        /* Still good, but have the client take a fresh one */
+        key = &tls_keys[1];
+        ret = 2;
+    } else {
+        /* Unknown or too old, a full handshake follows */
+        ret = 0;
+    }
+
+    if (key != NULL && ret > 0) {
+        params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac, sizeof(key->hmac));
+        params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+        params[2] = OSSL_PARAM_construct_end();
+        if (!EVP_MAC_CTX_set_params(hctx, params)
+                || (enc ? !EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key->aes, iv)
+                        : !EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key->aes, iv))) {
+            ret = -1;
+        }
+    }
+    pthread_rwlock_unlock(&tls_keys_lock);
+
+    return ret;
+}
+
+static int tls_cache_init(void)
+{
+    size_t sets;
+    char *p;
+
+    sets = (SESSION_CACHE + TLS_CACHE_SHARDS * TLS_CACHE_WAYS - 1) / (TLS_CACHE_SHARDS * TLS_CACHE_WAYS);
+    if (sets == 0) {
+        sets = 1;
+    }
+
+    /*-
+     * One cache for every worker thread, a session made on one worker
+     * resumes on any other. Mapped so that pages are only touched once
+     * sessions land in them.
+     */
+    tls_size = TLS_CACHE_SHARDS * (sizeof(tls_shard) + sets * TLS_CACHE_WAYS * sizeof(tls_entry));
+    p = mmap(NULL, tls_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+
+    tls_shards = (tls_shard *) p;
+    p += TLS_CACHE_SHARDS * sizeof(tls_shard);
+
+    for (size_t i=0; i < TLS_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&tls_shards[i].lock, NULL);
+        tls_shards[i].sets = sets;
+        tls_shards[i].entries = (tls_entry *) p;
+        p += sets * TLS_CACHE_WAYS * sizeof(tls_entry);
+    }
+
+    return 0;
+}
+
+int tls_setup(SSL_CTX *ctx)
+{
+    if (tls_new_key(&tls_keys[0]) < 0 || tls_new_key(&tls_keys[1]) < 0) {
+        return -1;
+    }
+    tls_rotated = time(NULL);
+
+    SSL_CTX_set_timeout(ctx, SESSION_TIMEOUT);
+    /*-
+     * Clients often just close the socket, which OpenSSL takes as
+     * an error and drops the session. IMAP has its own framing and
+     * LOGOUT, a truncation attack buys nothing.
+     */
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "sis", 3);
+    if (SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_key) != 1) {
+        return -1;
+    }
+
+    if (SESSION_CACHE == 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+        return 0;
+    }
+    if (tls_cache_init() < 0) {
+        return -1;
+    }
+
+    /* The internal cache would be one more lock shared by everyone */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+    SSL_CTX_sess_set_get_cb(ctx, tls_get_session);
+    SSL_CTX_sess_set_remove_cb(ctx, tls_remove_session);
+
+    return 0;
+}
+
+void tls_cleanup(void)
+{
+    if (tls_shards != NULL) {
+        for (size_t i=0; i < TLS_CACHE_SHARDS; i++) {
+            pthread_mutex_destroy(&tls_shards[i].lock);
+        }
+        munmap(tls_shards, tls_size);
+        tls_shards = NULL;
+    }
+    OPENSSL_cleanse(tls_keys, sizeof(tls_keys));
+}
@@ -0,0 +1,389 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <config.h>
+#include <uring.h>
+
+#if URING_ENABLED
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*-
+ * No liburing, the rings are mapped and driven by hand. The
+ * submission queue array is the identity, set once, so queuing a
+ * request is filling the next entry and moving a private tail that
+ * the kernel sees at the next io_uring_enter.
+ */
+struct uring {
+    int fd;
+    /* Submission queue, tail is ours until published */
+    unsigned *sq_head, *sq_tail, sq_mask, sq_entries, tail;
+    struct io_uring_sqe *sqes;
+    /* Completion queue */
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+    /* Provided buffers, group 0 */
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    char *bufs;
+    unsigned nbufs, buf_size;
+    uint16_t br_tail;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(uring *r, unsigned op, void *arg, unsigned n)
+{
+    return syscall(__NR_io_uring_register, r->fd, op, arg, n);
+}
+
+/* Publish the queued requests and submit them, waiting for wait completions */
+static int uring_enter(uring *r, unsigned wait)
+{
+    unsigned submit;
+
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    submit = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (submit == 0 && wait == 0) {
+        return 0;
+    }
+
+    return syscall(__NR_io_uring_enter, r->fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* Next free submission entry, the queue is submitted first if full */
+static struct io_uring_sqe *uring_sqe(uring *r, int op, int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries
+            && (uring_enter(r, 0) < 0 || r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)) {
+        return NULL;
+    }
+
+    sqe = &r->sqes[r->tail++ & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = data;
+
+    return sqe;
+}
+
+static void uring_buf_add(uring *r, uint16_t bid)
+{
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (r->nbufs - 1)];
+
+    b->addr = (uintptr_t) (r->bufs + (size_t) bid * r->buf_size);
+    b->len = r->buf_size;
+    b->bid = bid;
+    __atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+/* Multishot receive came along with IORING_OP_SEND_ZC in 6.0 */
+static int uring_probe(uring *r)
+{
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe;
+    int ret = -1;
+
+    if ((probe = calloc(1, len)) == NULL) {
+        return -1;
+    }
+    if (uring_register(r, IORING_REGISTER_PROBE, probe, 256) == 0 && probe->last_op >= IORING_OP_SEND_ZC
+            && (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED)) {
+        ret = 0;
+    }
+    free(probe);
+
+    return ret;
+}
+
+static int uring_map(uring *r, struct io_uring_params *p)
+{
+    r->sq_ring_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    r->cq_ring_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+
+    if ((r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQ_RING)) == MAP_FAILED
+            || (r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED
+            || (r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        return -1;
+    }
+
+    r->sq_head = (unsigned *) ((char *) r->sq_ring + p->sq_off.head);
+    r->sq_tail = (unsigned *) ((char *) r->sq_ring + p->sq_off.tail);
+    r->sq_mask = *(unsigned *) ((char *) r->sq_ring + p->sq_off.ring_mask);
+    r->sq_entries = p->sq_entries;
+    r->tail = *r->sq_tail;
+    for (unsigned i=0; i < p->sq_entries; i++) {
+        ((unsigned *) ((char *) r->sq_ring + p->sq_off.array))[i] = i;
+    }
+
+    r->cq_head = (unsigned *) ((char *) r->cq_ring + p->cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) r->cq_ring + p->cq_off.tail);
+    r->cq_mask = *(unsigned *) ((char *) r->cq_ring + p->cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring + p->cq_off.cqes);
+
+    return 0;
+}
+
+static int uring_bufs(uring *r, unsigned nbufs, unsigned buf_size)
+{
+    struct io_uring_buf_reg reg;
+
+    r->nbufs = nbufs;
+    r->buf_size = buf_size;
+    r->br_len = nbufs * sizeof(struct io_uring_buf);
+    if ((r->br = mmap(NULL, r->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        r->br = NULL;
+        return -1;
+    }
+    if ((r->bufs = malloc((size_t) nbufs * buf_size)) == NULL) {
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) r->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = 0;
+    if (uring_register(r, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+
+    r->br_tail = 0;
+    for (unsigned i=0; i < nbufs; i++) {
+        uring_buf_add(r, i);
+    }
+
+    return 0;
+}
+
+uring *uring_new(unsigned entries, unsigned nbufs, unsigned buf_size)
+{
+    /* Completions only run when waited for, by the thread waiting */
+    static const unsigned setups[] = {
+        IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN
+            | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_CQSIZE
+    };
+    struct io_uring_params p;
+    uring *r;
+
+    /* Buffers are picked by masking the ring tail */
+    if (nbufs == 0 || (nbufs & (nbufs - 1)) != 0 || nbufs > 32768
+            || (r = calloc(1, sizeof(uring))) == NULL) {
+        return NULL;
+    }
+    r->sq_ring = r->cq_ring = r->sqes = MAP_FAILED;
+
+    for (size_t i=0; i < sizeof(setups) / sizeof(setups[0]); i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = setups[i];
+        /* Multishot requests post many completions each */
+        p.cq_entries = entries * 4;
+        if ((r->fd = uring_setup(entries, &p)) >= 0 || errno != EINVAL) {
+            break;
+        }
+    }
+
+    if (r->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)
+            || uring_map(r, &p) < 0 || uring_probe(r) < 0 || uring_bufs(r, nbufs, buf_size) < 0) {
+        uring_free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+void uring_free(uring *r)
+{
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    if (r->sq_ring != MAP_FAILED) {
+        munmap(r->sq_ring, r->sq_ring_len);
+    }
+    if (r->cq_ring != MAP_FAILED) {
+        munmap(r->cq_ring, r->cq_ring_len);
+    }
+    if (r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->br != NULL) {
+        munmap(r->br, r->br_len);
+    }
+    free(r->bufs);
+    free(r);
+}
+
+int uring_accept(uring *r, int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_sqe(r, IORING_OP_ACCEPT, fd, data)) == NULL) {
+        return -1;
+    }
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+
+    return 0;
+}
+
+int uring_recv(uring *r, int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_sqe(r, IORING_OP_RECV, fd, data)) == NULL) {
+        return -1;
+    }
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+
+    return 0;
+}
+
+int uring_send(uring *r, int fd, const void *p, size_t len, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_sqe(r, IORING_OP_SEND, fd, data)) == NULL) {
+        return -1;
+    }
+    sqe->addr = (uintptr_t) p;
+    sqe->len = len;
+    /* Retried by the kernel until it all went, a short send is an error */
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+
+    return 0;
+}
+
+int uring_poll(uring *r, int fd, uint32_t events, int multi, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_sqe(r, IORING_OP_POLL_ADD, fd, data)) == NULL) {
+        return -1;
+    }
+    sqe->poll32_events = events;
+    sqe->len = multi ? IORING_POLL_ADD_MULTI : 0;
+
+    return 0;
+}
+
+int uring_cancel(uring *r, uint64_t data)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, 0)) == NULL) {
+        return -1;
+    }
+    sqe->addr = data;
+
+    return 0;
+}
+
+int uring_submit(uring *r)
+{
+    return uring_enter(r, 0) < 0 ? -1 : 0;
+}
+
+int uring_wait(uring *r, uring_cqe *cqes, int max)
+{
+    unsigned head = *r->cq_head, tail;
+    int n = 0;
+
+    /* Only sleep with nothing to reap, submitting goes along either way */
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    if (uring_enter(r, head == tail ? 1 : 0) < 0 && errno != EBUSY) {
+        return -1;
+    }
+
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && n < max; head++, n++) {
+        struct io_uring_cqe *c = &r->cqes[head & r->cq_mask];
+
+        cqes[n].data = c->user_data;
+        cqes[n].res = c->res;
+        cqes[n].flags = (c->flags & IORING_CQE_F_MORE ? URING_MORE : 0)
+            | (c->flags & IORING_CQE_F_BUFFER ? URING_BUFFER : 0);
+        cqes[n].buf = c->flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+const char *uring_data(uring *r, const uring_cqe *c)
+{
+    return c->flags & URING_BUFFER ? r->bufs + (size_t) c->buf * r->buf_size : NULL;
+}
+
+void uring_release(uring *r, const uring_cqe *c)
+{
+    if (c->flags & URING_BUFFER) {
+        uring_buf_add(r, c->buf);
+    }
+}
+
+#else
+
+/* Never made, nothing else gets called */
+uring *uring_new(unsigned entries, unsigned nbufs, unsigned buf_size)
+{
+    return NULL;
+}
+
+void uring_free(uring *r) {}
+int uring_accept(uring *r, int fd, uint64_t data) { return -1; }
+int uring_recv(uring *r, int fd, uint64_t data) { return -1; }
+int uring_send(uring *r, int fd, const void *p, size_t len, uint64_t data) { return -1; }
+int uring_poll(uring *r, int fd, uint32_t events, int multi, uint64_t data) { return -1; }
+int uring_cancel(uring *r, uint64_t data) { return -1; }
+int uring_submit(uring *r) { return -1; }
+int uring_wait(uring *r, uring_cqe *cqes, int max) { return -1; }
+const char *uring_data(uring *r, const uring_cqe *c) { return NULL; }
+void uring_release(uring *r, const uring_cqe *c) {}
+
+#endif /* if URING_ENABLED */
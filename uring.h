@@ -0,0 +1,83 @@
+/*-
+ * Copyright (c) 2024, Lorenzo Torres
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the <organization> nor the
+ *    names of its contributors may be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*-
+ * A bare io_uring, one per worker thread. Requests are queued by the
+ * functions below and only submitted by the next uring_wait (or when
+ * the queue is full), which also reaps their completions: a batch of
+ * receives and sends for any number of connections costs a single
+ * system call. Data is received into a ring of URING_BUFS provided
+ * buffers, handed back with uring_release once consumed.
+ */
+typedef struct uring uring;
+
+typedef struct {
+    uint64_t data;
+    int32_t res;
+    uint32_t flags;
+    /* Provided buffer the data is in, with URING_BUFFER */
+    uint16_t buf;
+} uring_cqe;
+
+/* Completion flags, more will follow for a multishot request */
+#define URING_MORE 0x1
+#define URING_BUFFER 0x2
+
+/*-
+ * Create a ring, NULL if the kernel lacks what is needed (multishot
+ * receive and provided buffer rings, Linux 6.0) or URING_ENABLED is
+ * 0. Must be called by the thread that uses it.
+ */
+uring *uring_new(unsigned entries, unsigned nbufs, unsigned buf_size);
+void uring_free(uring *r);
+
+/* Accept connections on fd until cancelled, res is the new socket */
+int uring_accept(uring *r, int fd, uint64_t data);
+/* Receive into provided buffers until cancelled, 0 at end of file */
+int uring_recv(uring *r, int fd, uint64_t data);
+/* Send all len bytes at p, which must stay there until it completes */
+int uring_send(uring *r, int fd, const void *p, size_t len, uint64_t data);
+/* Wait for events (POLLIN, POLLOUT) on fd, every time they happen if multi */
+int uring_poll(uring *r, int fd, uint32_t events, int multi, uint64_t data);
+/* Cancel the request made with data */
+int uring_cancel(uring *r, uint64_t data);
+/* Submit what was queued without waiting */
+int uring_submit(uring *r);
+/* Submit what was queued, wait for completions and fill at most max */
+int uring_wait(uring *r, uring_cqe *cqes, int max);
+/* Received data of c, NULL if it has none */
+const char *uring_data(uring *r, const uring_cqe *c);
+/* Give the buffer of c back to the ring */
+void uring_release(uring *r, const uring_cqe *c);
+
+#endif /* ifndef URING_H */
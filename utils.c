@@ -57,3 +57,14 @@ void strnlower(char *str, size_t len)
         str[i] = tolower(str[i]);
     }
 }
+
+int strncaseeq(const char *s, size_t len, const char *str)
+{
+    for (size_t i=0; i < len; i++) {
+        if (str[i] == '\0' || tolower((unsigned char) s[i]) != tolower((unsigned char) str[i])) {
+            return 0;
+        }
+    }
+
+    return str[len] == '\0';
+}
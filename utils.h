@@ -31,5 +31,7 @@
 void strstrip(char* str);
 void strlower(char* str);
 void strnlower(char *str, size_t len);
+/* Compare the first len bytes of s with str, ignoring case */
+int strncaseeq(const char *s, size_t len, const char *str);
 
 #endif /* ifndef UTILS_H */